@@ -37,13 +37,15 @@ local function save(filename)
     filename = core.normalize_to_project_dir(filename)
     abs_filename = core.project_absolute_path(filename)
   end
-  local ok, err = pcall(doc().save, doc(), filename, abs_filename)
-  if ok then
-    local saved_filename = doc().filename
-    core.log("Saved \"%s\"", saved_filename)
-  else
+  local saved_doc = doc()
+  -- the file is written in the background, so typing isn't blocked
+  local function on_saved(ok, err)
+    if ok then
+      core.log("Saved \"%s\"", saved_doc.filename)
+      return
+    end
     core.error(err)
-    core.nag_view:show("Saving failed", string.format("Couldn't save file \"%s\". Do you want to save to another location?", doc().filename), {
+    core.nag_view:show("Saving failed", string.format("Couldn't save file \"%s\". Do you want to save to another location?", saved_doc.filename), {
       { text = "Yes", default_yes = true },
       { text = "No", default_no = true }
     }, function(item)
@@ -55,6 +57,8 @@ local function save(filename)
       end
     end)
   end
+  local ok, err = pcall(saved_doc.save, saved_doc, filename, abs_filename, on_saved)
+  if not ok then on_saved(nil, err) end
 end
 
 local function cut_or_copy(delete)
@@ -347,27 +351,24 @@ local commands = {
   end,
 
   ["doc:delete"] = function(dv)
-    for idx, line1, col1, line2, col2 in dv.doc:get_selections(true, true) do
-      if line1 == line2 and col1 == col2 and dv.doc.lines[line1]:find("^%s*$", col1) then
-        dv.doc:remove(line1, col1, line1, math.huge)
+    -- the whitespace at the end of the line is deleted with the newline
+    dv.doc:delete_to(function(doc, line, col)
+      if doc.lines[line]:find("^%s*$", col) then
+        col = #doc.lines[line]
       end
-      dv.doc:delete_to_cursor(idx, translate.next_char)
-    end
+      return translate.next_char(doc, line, col)
+    end)
   end,
 
   ["doc:backspace"] = function(dv)
     local _, indent_size = dv.doc:get_indent_info()
-    for idx, line1, col1, line2, col2 in dv.doc:get_selections(true, true) do
-      if line1 == line2 and col1 == col2 then
-        local text = dv.doc:get_text(line1, 1, line1, col1)
-        if #text >= indent_size and text:find("^ *$") then
-          dv.doc:delete_to_cursor(idx, 0, -indent_size)
-          goto continue
-        end
+    dv.doc:delete_to(function(doc, line, col)
+      local text = doc:get_text(line, 1, line, col)
+      if #text >= indent_size and text:find("^ *$") then
+        return doc:position_offset(line, col, 0, -indent_size)
       end
-      dv.doc:delete_to_cursor(idx, translate.previous_char)
-      ::continue::
-    end
+      return translate.previous_char(doc, line, col)
+    end)
   end,
 
   ["doc:select-all"] = function(dv)
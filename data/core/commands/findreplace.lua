@@ -157,10 +157,19 @@ local function is_in_selection(line, col, l1, c1, l2, c2)
 end
 
 local function is_in_any_selection(line, col)
-  for idx, l1, c1, l2, c2 in doc():get_selections(true, false) do
-    if is_in_selection(line, col, l1, c1, l2, c2) then return true end
+  -- the selections are sorted, only the last one starting before the
+  -- position can contain it
+  local d, lo, hi, found = doc(), 1, #doc().selections // 4, nil
+  while lo <= hi do
+    local mid = (lo + hi) // 2
+    local l1, c1 = d:get_selection_idx(mid, true)
+    if l1 < line or l1 == line and c1 < col then
+      found, lo = mid, mid + 1
+    else
+      hi = mid - 1
+    end
   end
-  return false
+  return found ~= nil and is_in_selection(line, col, d:get_selection_idx(found, true))
 end
 
 local function select_add_next(all)
@@ -17,6 +17,13 @@ function SingleLineDoc:insert(line, col, text)
   SingleLineDoc.super.insert(self, line, col, text:gsub("\n", ""))
 end
 
+function SingleLineDoc:apply_edits(edits)
+  for i = 5, #edits, 5 do
+    edits[i] = edits[i]:gsub("\n", "")
+  end
+  return SingleLineDoc.super.apply_edits(self, edits)
+end
+
 ---@class core.commandview : core.docview
 ---@field super core.docview
 local CommandView = DocView:extend()
@@ -136,14 +136,19 @@ function common.color(str)
 end
 
 
----Splices a numerically indexed table.
+---Splices a numerically indexed table, a textbuffer.buffer or a
+---segarray.array.
 ---This function mutates the original table.
----@param t any[]
+---@param t any[]|textbuffer.buffer|segarray.array
 ---@param at number Index at which to start splicing.
 ---@param remove number Number of elements to remove.
 ---@param insert? any[] A table containing elements to insert after splicing.
 function common.splice(t, at, remove, insert)
   assert(remove >= 0, "bad argument #3 to 'splice' (non-negative value expected)")
+  if type(t) == "userdata" then
+    -- like the lines of documents, see textbuffer and segarray
+    return t:splice(at, remove, insert)
+  end
   insert = insert or {}
   local len = #insert
   if remove ~= len then table.move(t, at + remove, #t + remove, at + len) end
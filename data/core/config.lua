@@ -62,6 +62,16 @@ config.force_scrollbar_status = false
 ---@type number
 config.file_size_limit = 10
 
+---The size from which files are mapped in memory instead of being read, in
+---megabytes. Their lines are read from the file only when needed.
+---
+---These files are loaded in the background, and can't be edited until they
+---are loaded; smaller files are read before they are opened.
+---
+---Defaults to 64.
+---@type number
+config.large_file_size = 64
+
 ---A list of files and directories to ignore.
 ---Each element is a Lua pattern, where patterns ending with a forward slash
 ---are recognized as directories while patterns ending with an anchor ("$") are
@@ -106,6 +116,13 @@ config.undo_merge_timeout = 0.3
 ---@type number
 config.max_undos = 10000
 
+---The maximum memory, in MB, used by the undo history of each document.
+---The oldest undo steps are forgotten once it's reached.
+---
+---The default is 64MB.
+---@type number
+config.max_undo_memory = 64
+
 ---The maximum number of tabs shown at a time.
 ---
 ---The default is 8.
@@ -265,6 +282,14 @@ config.stonks = true
 ---@type boolean
 config.use_system_file_picker = system.get_sandbox() ~= "none"
 
+---Use the native tokenizer for syntax highlighting.
+---The Lua tokenizer produces the same tokens, but it is a lot slower;
+---it can be useful when debugging the patterns of a language plugin.
+---
+---Defaults to true.
+---@type boolean
+config.native_tokenizer = true
+
 -- holds the plugins real config table
 local plugins_config = {}
 
@@ -1,5 +1,4 @@
 local core = require "core"
-local common = require "core.common"
 local config = require "core.config"
 local tokenizer = require "core.tokenizer"
 local Object = require "core.object"
@@ -9,47 +8,318 @@ local Highlighter = Object:extend()
 
 function Highlighter:__tostring() return "Highlighter" end
 
+-- maximum amount of lines tokenized by each background job
+local job_lines = 2000
+-- the tokens of lines that weren't used for this many seconds are evicted,
+-- keeping the states of one line every `checkpoint_lines` lines
+local retain_time = 5
+local checkpoint_lines = 64
+-- lines tokenized before looking for lines to evict
+local evict_after_lines = 5000
+-- state before the lines of the chunks tokenized speculatively
+local default_state = string.char(0)
+
+-- The lines whose tokens were evicted are false in `lines`, like the lines
+-- never tokenized, and are kept in `evicted_lines`: one every
+-- `checkpoint_lines` with its states, the others as this placeholder. They
+-- are still valid as long as the line before them is: when that line changes
+-- its state, the evicted line after it is invalidated.
+local evicted = setmetatable({}, { __newindex = function() error("evicted lines are read-only") end })
+
 function Highlighter:new(doc)
   self.doc = doc
   self.running = false
+  self.job_id = nil
+  self.speculative_jobs = {}
+  self.listeners = setmetatable({}, { __mode = "k" })
   self:reset()
 end
 
+local function notify(self, event, line, n)
+  for listener in pairs(self.listeners) do
+    listener[event](listener, line, n)
+  end
+end
+
+-- returns the line, or what's kept of it if it was evicted
+local function get_known_line(self, i)
+  return self.lines[i] or self.evicted_lines[i]
+end
+
+local function store_line(self, i, line)
+  self.lines[i] = line
+  if self.evicted_lines[i] then self.evicted_lines[i] = false end
+end
+
+local function is_line_valid(self, line, i, state)
+  return line and line.init_state == state and line.text == self.doc.lines[i] and not line.resume
+end
+
+-- replaces a line with a new tokenization of it
+local function set_line(self, i, line)
+  local old = get_known_line(self, i)
+  if self.evicted_lines[i + 1] == evicted and (not old or old.state ~= line.state) then
+    self.evicted_lines[i + 1] = false
+  end
+  store_line(self, i, line)
+end
+
+local function tokenize_fully(self, i, state)
+  local line = self:tokenize_line(i, state)
+  while line.resume do
+    line = self:tokenize_line(i, state, line.resume)
+  end
+  return line
+end
+
+-- returns the state before line `i`, which must be preceded by valid lines;
+-- evicted lines are tokenized again from the closest line with a state
+local function get_state_before(self, i)
+  local j = i - 1
+  while j >= 1 and self.evicted_lines[j] == evicted do
+    j = j - 1
+  end
+  local known = j >= 1 and get_known_line(self, j)
+  local state = known and known.state or false
+  if j + 1 < i then
+    for k = j + 1, i - 1 do
+      local line = tokenize_fully(self, k, state)
+      store_line(self, k, line)
+      state = line.state
+    end
+    self:update_notify(j + 1, i - j - 2)
+  end
+  return state
+end
+
+-- moves first_invalid_line past the lines that are still valid, and returns
+-- the state before it
+local function skip_valid_lines(self)
+  local i = self.first_invalid_line
+  local state, known = nil, false
+  while i <= self.max_wanted_line do
+    local line = get_known_line(self, i)
+    if line ~= evicted then
+      if not line or line.text ~= self.doc.lines[i] or line.resume then break end
+      if not known then
+        self.first_invalid_line = i
+        state = get_state_before(self, i)
+      end
+      if line.init_state ~= state then break end
+      state = line.state
+    end
+    known = line ~= evicted
+    i = i + 1
+  end
+  self.first_invalid_line = i
+  if not known then
+    state = get_state_before(self, i)
+  end
+  return state
+end
+
+local function evict_lines(self)
+  self.tokenized_lines = 0
+  self.last_eviction = core.frame_start
+  local keep_after = core.frame_start - retain_time
+  -- the line after an evicted one must be valid, so the one before the first
+  -- invalid line is kept until it's checked
+  for i = 1, self.first_invalid_line - 2 do
+    local line = self.lines[i]
+    if line and not line.resume and (line.used or 0) < keep_after then
+      self.lines[i] = false
+      if i % checkpoint_lines == 0 then
+        self.evicted_lines[i] = { text = line.text, init_state = line.init_state, state = line.state }
+      else
+        self.evicted_lines[i] = evicted
+      end
+    end
+  end
+end
+
+local function check_eviction(self)
+  if self.tokenized_lines >= evict_after_lines and core.frame_start - self.last_eviction >= 1 then
+    evict_lines(self)
+  end
+end
+
+-- tokenize up to 40 lines on the main thread
+local function tokenize_slice(self)
+  local state = skip_valid_lines(self)
+  local first = self.first_invalid_line
+  local max = math.min(first + 40, self.max_wanted_line)
+  local i = first
+  while i <= max do
+    local line = get_known_line(self, i)
+    if line and line.resume and (line.init_state ~= state or line.text ~= self.doc.lines[i]) then
+      -- Reset the progress if no longer valid
+      line.resume = nil
+    end
+    -- valid lines are skipped by the next slice
+    if line == evicted or is_line_valid(self, line, i, state) then break end
+    line = self:tokenize_line(i, state, line and line.resume)
+    set_line(self, i, line)
+    if line.resume then
+      self.first_invalid_line = i
+      self:update_notify(first, i - first)
+      core.redraw = true
+      return
+    end
+    state = line.state
+    i = i + 1
+  end
+  self.first_invalid_line = i
+  if i > first then
+    self:update_notify(first, i - first - 1)
+  end
+  check_eviction(self)
+  core.redraw = true
+end
+
+local function stop_job(self)
+  if self.job_id then
+    tokenizer.cancel_job(self.job_id)
+    self.job_id = nil
+  end
+  for job_id in pairs(self.speculative_jobs) do
+    tokenizer.cancel_job(job_id)
+  end
+  self.speculative_jobs = {}
+  self.next_speculative_line = 1
+end
+
+local function on_speculative_results(self, job_id, lines, done)
+  local job = self.speculative_jobs[job_id]
+  if not job then return end
+  local first = job.first + job.taken
+  for k, line in ipairs(lines) do
+    -- lines tokenized with their actual state are kept
+    if not get_known_line(self, first + k - 1) then
+      line.used = core.frame_start
+      self.lines[first + k - 1] = line
+    end
+  end
+  job.taken = job.taken + #lines
+  if #lines > 0 then
+    self:update_notify(first, #lines - 1)
+    core.redraw = true
+  end
+  if done then
+    -- on errors the lines are tokenized by the sequential jobs
+    self.speculative_jobs[job_id] = nil
+  end
+end
+
+-- Most syntaxes are back to the default state at the end of most lines, so
+-- the chunks of wanted lines that were never tokenized are tokenized in
+-- parallel assuming it, while one worker is left for the sequential jobs.
+-- Once the lines before a chunk are done, skip_valid_lines accepts it if the
+-- state before it was the default one; otherwise its lines are tokenized
+-- again, only until the state converges with the speculative results.
+local function start_speculative_jobs(self)
+  local running = 0
+  for _ in pairs(self.speculative_jobs) do running = running + 1 end
+  local workers = tokenizer.get_worker_count()
+  local last_line = math.min(self.max_wanted_line, #self.doc.lines)
+  while running < workers - 1 do
+    local first = math.max(self.next_speculative_line, self.first_invalid_line + job_lines)
+    local last = first + job_lines - 1
+    if last > last_line then break end
+    self.next_speculative_line = last + 1
+    if not get_known_line(self, first) and not get_known_line(self, last) then
+      local texts = {}
+      for i = first, last do
+        texts[#texts + 1] = self.doc.lines[i]
+      end
+      local job_id
+      job_id = tokenizer.start_job(
+        self.doc.syntax, texts, default_state, {},
+        function(lines, done) on_speculative_results(self, job_id, lines, done) end
+      )
+      if not job_id then break end
+      self.speculative_jobs[job_id] = { first = first, last = last, taken = 0 }
+      running = running + 1
+    end
+  end
+end
+
+local start_job
+
+local function on_job_results(self, job_id, lines, done, err)
+  if job_id ~= self.job_id then return end
+  local first = self.first_invalid_line
+  for k, line in ipairs(lines) do
+    line.used = core.frame_start
+    set_line(self, first + k - 1, line)
+  end
+  if #lines > 0 then
+    self.first_invalid_line = first + #lines
+    self.tokenized_lines = self.tokenized_lines + #lines
+    self:update_notify(first, #lines - 1)
+    core.redraw = true
+  end
+  if done then
+    self.job_id = nil
+    if err then
+      -- keep tokenizing on the main thread
+      self.job_failed = true
+      core.error("Error tokenizing %s in the background: %s", self.doc:get_name(), err)
+    else
+      start_job(self)
+    end
+  end
+  check_eviction(self)
+end
+
+-- tokenize the invalid lines on a worker thread, the results are spliced into
+-- the lines as they arrive; returns false if not available
+function start_job(self)
+  if self.job_failed then return false end
+  local state = skip_valid_lines(self)
+  local i = self.first_invalid_line
+  if i > self.max_wanted_line then return true end
+
+  -- stop before the speculative chunks, waiting for the results of the one
+  -- the lines start in
+  local last = math.min(i + job_lines - 1, self.max_wanted_line, #self.doc.lines)
+  for _, job in pairs(self.speculative_jobs) do
+    if job.first <= i and i <= job.last then
+      if not get_known_line(self, i) then return true end
+    elseif job.first > i then
+      last = math.min(last, job.first - 1)
+    end
+  end
+
+  local texts, expected_states = {}, {}
+  for j = i, last do
+    local line = get_known_line(self, j)
+    texts[#texts + 1] = self.doc.lines[j]
+    expected_states[#texts] = line and line.text == self.doc.lines[j] and not line.resume
+      and line.init_state or false
+  end
+  local job_id
+  job_id = tokenizer.start_job(
+    self.doc.syntax, texts, state, expected_states,
+    function(...) on_job_results(self, job_id, ...) end
+  )
+  self.job_id = job_id
+  return job_id ~= nil
+end
+
 -- init incremental syntax highlighting
 function Highlighter:start()
   if self.running then return end
   self.running = true
   core.add_thread(function()
     while self.first_invalid_line <= self.max_wanted_line do
-      local max = math.min(self.first_invalid_line + 40, self.max_wanted_line)
-      local retokenized_from
-      for i = self.first_invalid_line, max do
-        local state = (i > 1) and self.lines[i - 1].state
-        local line = self.lines[i]
-        if line and line.resume and (line.init_state ~= state or line.text ~= self.doc.lines[i]) then
-          -- Reset the progress if no longer valid
-          line.resume = nil
-        end
-        if not (line and line.init_state == state and line.text == self.doc.lines[i] and not line.resume) then
-          retokenized_from = retokenized_from or i
-          self.lines[i] = self:tokenize_line(i, state, line and line.resume)
-          if self.lines[i].resume then
-            self.first_invalid_line = i
-            goto yield
-          end
-        elseif retokenized_from then
-          self:update_notify(retokenized_from, i - retokenized_from - 1)
-          retokenized_from = nil
-        end
-      end
-
-      self.first_invalid_line = max + 1
-      ::yield::
-      if retokenized_from then
-        self:update_notify(retokenized_from, max - retokenized_from)
+      start_speculative_jobs(self)
+      if self.job_id or start_job(self) then
+        -- wait for the results of the job
+        coroutine.yield(1 / config.fps)
+      else
+        tokenize_slice(self)
+        coroutine.yield(0)
       end
-      core.redraw = true
-      coroutine.yield(0)
     end
     self.max_wanted_line = 0
     self.running = false
@@ -65,39 +335,76 @@ end
 
 
 function Highlighter:reset()
-  self.lines = {}
+  self.lines = segarray.new()
   self:soft_reset()
 end
 
 function Highlighter:soft_reset()
-  for i=1,#self.lines do
-    self.lines[i] = false
-  end
+  stop_job(self)
+  self.lines = segarray.new(#self.lines, false)
+  self.evicted_lines = segarray.new(#self.lines, false)
   self.first_invalid_line = 1
   self.max_wanted_line = 0
+  self.tokenized_lines = 0
+  self.last_eviction = 0
+  if #self.lines > 0 then
+    notify(self, "on_update", 1, #self.lines - 1)
+  end
 end
 
 function Highlighter:invalidate(idx)
+  -- the lines may be spliced next, so a new job is only started by the
+  -- highlighting thread
+  stop_job(self)
+  if self.evicted_lines[idx] == evicted then
+    self.evicted_lines[idx] = false
+  end
   self.first_invalid_line = math.min(self.first_invalid_line, idx)
   set_max_wanted_lines(self, math.min(self.max_wanted_line, #self.doc.lines))
 end
 
+---Registers an object whose `on_insert(line, n)`, `on_remove(line, n)` and
+---`on_update(line, n)` methods are called after lines are inserted, removed
+---or have to be drawn again, the latter covering lines `line` to `line + n`.
+---Listeners are weakly referenced.
+---@param listener table
+function Highlighter:add_listener(listener)
+  self.listeners[listener] = true
+end
+
+---@param listener table
+function Highlighter:remove_listener(listener)
+  self.listeners[listener] = nil
+end
+
 function Highlighter:insert_notify(line, n)
   self:invalidate(line)
-  local blanks = { }
-  for i = 1, n do
-    blanks[i] = false
-  end
-  common.splice(self.lines, line, 0, blanks)
+  self.lines:insert(line, n, false)
+  self.evicted_lines:insert(line, n, false)
+  notify(self, "on_insert", line, n)
 end
 
 function Highlighter:remove_notify(line, n)
   self:invalidate(line)
-  common.splice(self.lines, line, n)
+  self.lines:remove(line, n)
+  self.evicted_lines:remove(line, n)
+  if self.evicted_lines[line] == evicted then
+    self.evicted_lines[line] = false
+  end
+  notify(self, "on_remove", line, n)
+end
+
+-- lines found while the file of the document is loading, after the others
+function Highlighter:load_notify(line, n)
+  self.lines:remove(line, n)
+  self.lines:insert(line, n, false)
+  self.evicted_lines:remove(line, n)
+  self.evicted_lines:insert(line, n, false)
 end
 
 function Highlighter:update_notify(line, n)
   -- plugins can hook here to be notified that lines have been retokenized
+  notify(self, "on_update", line, n)
 end
 
 
@@ -105,19 +412,41 @@ function Highlighter:tokenize_line(idx, state, resume)
   local res = {}
   res.init_state = state
   res.text = self.doc.lines[idx]
-  res.tokens, res.state, res.resume = tokenizer.tokenize(self.doc.syntax, res.text, state, resume)
+  -- long lines are only tokenized again around the edits
+  local old = self.lines[idx]
+  if not resume and old and old.tokens and old.init_state == state and old.text ~= res.text then
+    resume = { previous = old.tokens }
+  end
+  res.tokens, res.state, res.resume = tokenizer.tokenize(self.doc.syntax, res.text, state, resume, true)
+  res.used = core.frame_start
+  self.tokenized_lines = self.tokenized_lines + 1
   return res
 end
 
 
 function Highlighter:get_line(idx)
-  local line = self.lines[idx]
-  if not line or line.text ~= self.doc.lines[idx] then
-    local prev = self.lines[idx - 1]
-    line = self:tokenize_line(idx, prev and prev.state)
-    self.lines[idx] = line
+  local line = get_known_line(self, idx)
+  if not line or not line.tokens or line.text ~= self.doc.lines[idx] then
+    if line and idx < self.first_invalid_line then
+      -- evicted, tokenize it again from the closest line with a state
+      local state = line.init_state
+      if line == evicted then
+        state = get_state_before(self, idx)
+      end
+      line = self:tokenize_line(idx, state)
+      store_line(self, idx, line)
+      if line.resume then
+        self.first_invalid_line = idx
+      end
+    else
+      local prev = get_known_line(self, idx - 1)
+      line = self:tokenize_line(idx, prev and prev.state)
+      set_line(self, idx, line)
+    end
     self:update_notify(idx, 0)
+    check_eviction(self)
   end
+  line.used = core.frame_start
   set_max_wanted_lines(self, math.max(self.max_wanted_line, idx))
   return line
 end
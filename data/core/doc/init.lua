@@ -11,15 +11,6 @@ local Doc = Object:extend()
 
 function Doc:__tostring() return "Doc" end
 
-local function split_lines(text)
-  local res = {}
-  for line in (text .. "\n"):gmatch("(.-)\n") do
-    table.insert(res, line)
-  end
-  return res
-end
-
-
 function Doc:new(filename, abs_filename, new_file)
   self.new_file = new_file
   self:reset()
@@ -35,14 +26,15 @@ function Doc:new(filename, abs_filename, new_file)
 end
 
 function Doc:reset()
-  self.lines = { "\n" }
+  self.lines = textbuffer.new({ "\n" })
   self.selections = { 1, 1, 1, 1 }
   self.last_selection = 1
-  self.undo_stack = { idx = 1 }
-  self.redo_stack = { idx = 1 }
+  self.undo_stack = undolog.new()
+  self.redo_stack = undolog.new()
   self.clean_change_id = 1
   self.highlighter = Highlighter(self)
   self.overwrite = false
+  self.loading = false
   self:reset_syntax()
 end
 
@@ -66,37 +58,152 @@ function Doc:set_filename(filename, abs_filename)
   self:reset_syntax()
 end
 
-function Doc:load(filename)
-  local fp = assert(io.open(filename, "rb"))
-  self:reset()
-  self.lines = {}
-  local i = 1
-  for line in fp:lines() do
-    if line:byte(-1) == 13 then
-      line = line:sub(1, -2)
-      self.crlf = true
+local last_load_id = 0
+
+-- adds the lines of the file being loaded to the highlighter as they are
+-- found, calling `callback` once they all are; files opened without an id are
+-- done when this returns
+local function track_loading(self, id, callback)
+  local lines = self.lines
+  local known = 0
+  self.loading = true
+  local function update()
+    if self.lines ~= lines then
+      if id then core.active_loads[id] = nil end
+      return
+    end
+    local loading, _, _, crlf = lines:get_load_state()
+    local n = #lines
+    self.highlighter:load_notify(known + 1, n - known)
+    known = n
+    core.redraw = true
+    if not loading then
+      if id then core.active_loads[id] = nil end
+      if crlf then
+        self.crlf = true
+      end
+      self.loading = false
+      if callback then callback() end
     end
-    table.insert(self.lines, line .. "\n")
-    self.highlighter.lines[i] = false
-    i = i + 1
   end
-  if #self.lines == 0 then
-    table.insert(self.lines, "\n")
+  if id then core.active_loads[id] = update end
+  update()
+end
+
+---Loads the document from a file. Files of at least `config.large_file_size`
+---are loaded in the background, the document can't be edited until they are
+---and `callback` is called once they are; other files are loaded when this
+---returns.
+---@param filename string
+---@param callback? fun()
+function Doc:load(filename, callback)
+  local info = system.get_file_info(filename)
+  local lines, id
+  if info and info.size >= config.large_file_size * 1e6 then
+    last_load_id = last_load_id + 1
+    id = last_load_id
+    lines = assert(textbuffer.map(filename, id))
+  else
+    lines = assert(textbuffer.open(filename))
   end
-  fp:close()
+  self:reset()
+  self.lines = lines
+  track_loading(self, id, callback)
   self:reset_syntax()
 end
 
+---Returns the fraction of the file loaded so far, or nil if the document
+---isn't loading.
+---@return number?
+function Doc:get_load_progress()
+  if not self.loading then return nil end
+  local _, loaded, total = self.lines:get_load_state()
+  return total > 0 and loaded / total or 1
+end
+
+-- the edits turning the lines of the document into `lines`, replacing the
+-- lines of each hunk of their diff; the newline of the last line can't be
+-- removed, so a hunk reaching it is replaced from the end of the line before
+local function get_reload_edits(self, lines)
+  local hunks = self.lines:diff(lines)
+  local n, m = #self.lines, #lines
+  local edits = {}
+  for i = 1, #hunks, 4 do
+    local line1, count1, line2, count2 = table.unpack(hunks, i, i + 3)
+    local edit
+    if line1 + count1 <= n then
+      local text = count2 > 0 and lines:get_text(line2, 1, line2 + count2, 1) or ""
+      edit = { line1, 1, line1 + count1, 1, text }
+    else
+      local text = count2 > 0 and lines:get_text(line2, 1, m, #lines[m]) or ""
+      if line1 > 1 then
+        edit = { line1 - 1, math.huge, n, math.huge, count2 > 0 and "\n" .. text or "" }
+      else
+        edit = { 1, 1, n, math.huge, text }
+      end
+    end
+    table.move(edit, 1, 5, #edits + 1, edits)
+  end
+  return edits
+end
+
+---Reloads the document from its file. Only the lines that changed are
+---replaced, as an edit that can be undone, so that the selections and the
+---highlighting of the other lines are kept.
 function Doc:reload()
   if self.filename then
-    local sel = { self:get_selection() }
-    self:load(self.abs_filename)
+    local info = system.get_file_info(self.abs_filename)
+    if self.loading or not info or info.size >= config.large_file_size * 1e6 then
+      local sel = { self:get_selection() }
+      self:load(self.abs_filename, function()
+        self:set_selection(table.unpack(sel))
+      end)
+      self:clean()
+      return
+    end
+    local lines = assert(textbuffer.open(self.abs_filename))
+    self:apply_edits(get_reload_edits(self, lines))
+    self.crlf = select(4, lines:get_load_state())
     self:clean()
-    self:set_selection(table.unpack(sel))
+    self:reset_syntax()
+  end
+end
+
+-- applies the result of the current save once its file is written
+local function finish_save(self)
+  local saving = self.saving
+  self.saving = nil
+  core.active_saves[saving.id] = nil
+  local ok, err = saving.handle:wait()
+  if ok then
+    self:set_filename(saving.filename, saving.abs_filename)
+    self.new_file = false
+    -- the edits made while saving are not part of the file
+    if self.lines == saving.lines then
+      self.clean_change_id = saving.change_id
+    end
   end
+  return ok, err, saving.callback
 end
 
-function Doc:save(filename, abs_filename)
+local last_save_id = 0
+
+---Saves the document, by default to its current file.
+---
+---The lines are written by a thread to a temporary file that then replaces
+---the file. Without a callback, this waits for the file to be written and
+---errors if it failed; otherwise it returns immediately, the document can be
+---edited meanwhile, and the callback is called once the save is done.
+---Documents still loading can't be saved, which is reported as a failed save.
+---@param filename? string
+---@param abs_filename? string
+---@param callback? fun(ok: boolean?, err: string?)
+function Doc:save(filename, abs_filename, callback)
+  if self.loading then
+    local err = string.format("%s is still loading", self:get_name())
+    if callback then return callback(nil, err) end
+    error(err)
+  end
   if not filename then
     assert(self.filename, "no filename set to default to")
     filename = self.filename
@@ -105,30 +212,32 @@ function Doc:save(filename, abs_filename)
     assert(self.filename or abs_filename, "calling save on unnamed doc without absolute path")
   end
 
-  local fp
-  if PLATFORM == "Windows" then
-    -- On Windows, opening a hidden file with wb fails with a permission error.
-    -- To get around this, we must open the file as r+b and truncate.
-    -- Since r+b fails if file doesn't exist, fall back to wb.
-    fp = io.open(abs_filename, "r+b")
-    if fp then
-      system.ftruncate(fp)
-    else
-      -- file probably doesn't exist, create one
-      fp = assert (io.open(abs_filename, "wb"))
-    end
-  else
-    fp = assert (io.open(abs_filename, "wb"))
+  -- the saves of a document are done in order
+  if self.saving then
+    local ok, err, previous = finish_save(self)
+    if previous then previous(ok, err) end
   end
 
-  for _, line in ipairs(self.lines) do
-    if self.crlf then line = line:gsub("\n", "\r\n") end
-    fp:write(line)
+  last_save_id = last_save_id + 1
+  local id = last_save_id
+  self.saving = {
+    handle = assert(self.lines:save(abs_filename, self.crlf, callback and id)),
+    id = id,
+    lines = self.lines,
+    change_id = self:get_change_id(),
+    filename = filename,
+    abs_filename = abs_filename,
+    callback = callback
+  }
+  if not callback then
+    local ok, err = finish_save(self)
+    assert(ok, err)
+    return
+  end
+  core.active_saves[id] = function()
+    local ok, err = finish_save(self)
+    callback(ok, err)
   end
-  fp:close()
-  self:set_filename(filename, abs_filename)
-  self.new_file = false
-  self:clean()
 end
 
 function Doc:get_name()
@@ -156,7 +265,13 @@ function Doc:get_indent_info()
 end
 
 function Doc:get_change_id()
-  return self.undo_stack.idx
+  return self.undo_stack:get_change_id()
+end
+
+---Returns the bytes used by the undo and redo history of the document.
+---@return integer
+function Doc:get_undo_memory()
+  return self.undo_stack:get_memory() + self.redo_stack:get_memory()
 end
 
 local function sort_positions(line1, col1, line2, col2)
@@ -234,11 +349,15 @@ end
 
 function Doc:add_selection(line1, col1, line2, col2, swap)
   local l1, c1 = sort_positions(line1, col1, line2 or line1, col2 or col1)
-  local target = #self.selections / 4 + 1
-  for idx, tl1, tc1 in self:get_selections(true) do
+  -- insert before the first selection starting after it
+  local target, hi = 1, #self.selections / 4 + 1
+  while target < hi do
+    local mid = (target + hi) // 2
+    local tl1, tc1 = self:get_selection_idx(mid, true)
     if l1 < tl1 or l1 == tl1 and c1 < tc1 then
-      target = idx
-      break
+      hi = mid
+    else
+      target = mid + 1
     end
   end
   self:set_selections(target, line1, col1, line2, col2, swap, 0)
@@ -259,19 +378,33 @@ function Doc:set_selection(line1, col1, line2, col2, swap)
 end
 
 function Doc:merge_cursors(idx)
-  local table_index = idx and (idx - 1) * 4 + 1
-  for i = (table_index or (#self.selections - 3)), (table_index or 5), -4 do
+  local selections = self.selections
+  if idx then
+    local i = (idx - 1) * 4 + 1
     for j = 1, i - 4, 4 do
-      if self.selections[i] == self.selections[j] and
-          self.selections[i + 1] == self.selections[j + 1] then
-        common.splice(self.selections, i, 4)
-        if self.last_selection >= (i + 3) / 4 then
-          self.last_selection = self.last_selection - 1
-        end
+      if selections[i] == selections[j] and selections[i + 1] == selections[j + 1] then
+        self:remove_selection(idx)
         break
       end
     end
+    return
+  end
+  -- keep the first selection starting at each position, in a single pass
+  local seen, n, removed = {}, 0, 0
+  for i = 1, #selections, 4 do
+    local key = selections[i] * 0x100000000 + selections[i + 1]
+    if seen[key] then
+      if self.last_selection >= (i + 3) / 4 then removed = removed + 1 end
+    else
+      seen[key] = true
+      table.move(selections, i, i + 3, n + 1)
+      n = n + 4
+    end
   end
+  for i = #selections, n + 1, -1 do
+    selections[i] = nil
+  end
+  self.last_selection = self.last_selection - removed
 end
 
 local function selection_iterator(invariant, idx)
@@ -311,6 +444,9 @@ end
 
 local function position_offset_byte(self, line, col, offset)
   line, col = self:sanitize_position(line, col)
+  if not self.loading then
+    return self:sanitize_position(self.lines:get_position(self.lines:get_offset(line, col) + offset))
+  end
   col = col + offset
   while line > 1 and col < 1 do
     line = line - 1
@@ -359,6 +495,9 @@ function Doc:get_text(line1, col1, line2, col2, inclusive)
   if line1 == line2 then
     return self.lines[line1]:sub(col1, col2 - col2_offset)
   end
+  if not self.loading then
+    return self.lines:get_text(line1, col1, line2, col2 + 1 - col2_offset)
+  end
   local lines = { self.lines[line1]:sub(col1) }
   for i = line1 + 1, line2 - 1 do
     table.insert(lines, self.lines[i])
@@ -373,36 +512,35 @@ function Doc:get_char(line, col)
 end
 
 local function push_undo(undo_stack, time, type, ...)
-  undo_stack[undo_stack.idx] = { type = type, time = time, ... }
-  undo_stack[undo_stack.idx - config.max_undos] = nil
-  undo_stack.idx = undo_stack.idx + 1
+  undo_stack:set_limits(config.max_undos, (config.max_undo_memory or math.huge) * 1e6,
+    config.undo_merge_timeout)
+  undo_stack:push(type, time, ...)
 end
 
 
 local function pop_undo(self, undo_stack, redo_stack, modified)
   -- pop command
-  local cmd = undo_stack[undo_stack.idx - 1]
-  if not cmd then return end
-  undo_stack.idx = undo_stack.idx - 1
+  local kind, time, a, b, c, d = undo_stack:pop()
+  if not kind then return end
 
   -- handle command
-  if cmd.type == "insert" then
-    local line, col, text = table.unpack(cmd)
-    self:raw_insert(line, col, text, redo_stack, cmd.time)
-  elseif cmd.type == "remove" then
-    local line1, col1, line2, col2 = table.unpack(cmd)
-    self:raw_remove(line1, col1, line2, col2, redo_stack, cmd.time)
-  elseif cmd.type == "selection" then
-    self.selections = { table.unpack(cmd) }
+  if kind == "insert" then
+    self:raw_insert(a, b, c, redo_stack, time)
+  elseif kind == "remove" then
+    self:raw_remove(a, b, c, d, redo_stack, time)
+  elseif kind == "edits" then
+    self:raw_apply_edits(a, redo_stack, time)
+  elseif kind == "selection" then
+    self.selections = a
     self:sanitize_selection()
   end
 
-  modified = modified or (cmd.type ~= "selection")
+  modified = modified or (kind ~= "selection")
 
   -- if next undo command is within the merge timeout then treat as a single
   -- command and continue to execute it
-  local next = undo_stack[undo_stack.idx - 1]
-  if next and math.abs(cmd.time - next.time) < config.undo_merge_timeout then
+  local _, next_time = undo_stack:peek()
+  if next_time and math.abs(time - next_time) < config.undo_merge_timeout then
     return pop_undo(self, undo_stack, redo_stack, modified)
   end
 
@@ -414,13 +552,10 @@ end
 
 function Doc:raw_insert(line, col, text, undo_stack, time)
   -- split text into lines and merge with line at insertion point
-  local lines = split_lines(text)
+  local lines = textbuffer.split_lines(text)
   local len = #lines[#lines]
   local before = self.lines[line]:sub(1, col - 1)
   local after = self.lines[line]:sub(col)
-  for i = 1, #lines - 1 do
-    lines[i] = lines[i] .. "\n"
-  end
   lines[1] = before .. lines[1]
   lines[#lines] = lines[#lines] .. after
 
@@ -438,7 +573,7 @@ function Doc:raw_insert(line, col, text, undo_stack, time)
 
   -- push undo
   local line2, col2 = self:position_offset(line, col, #text)
-  push_undo(undo_stack, time, "selection", table.unpack(self.selections))
+  push_undo(undo_stack, time, "selection", self.selections)
   push_undo(undo_stack, time, "remove", line, col, line2, col2)
 
   -- update highlighter and assure selection is in bounds
@@ -449,7 +584,7 @@ end
 function Doc:raw_remove(line1, col1, line2, col2, undo_stack, time)
   -- push undo
   local text = self:get_text(line1, col1, line2, col2)
-  push_undo(undo_stack, time, "selection", table.unpack(self.selections))
+  push_undo(undo_stack, time, "selection", self.selections)
   push_undo(undo_stack, time, "insert", line1, col1, text)
 
   -- get line content before/after removed text
@@ -504,8 +639,84 @@ function Doc:raw_remove(line1, col1, line2, col2, undo_stack, time)
   self:sanitize_selection()
 end
 
+-- the order of the edits by start position, or nil if they are sorted;
+-- edits starting at the same position keep their order
+local function get_edits_order(edits)
+  local sorted = true
+  for i = 6, #edits, 5 do
+    if edits[i] < edits[i - 5] or edits[i] == edits[i - 5] and edits[i + 1] < edits[i - 4] then
+      sorted = false
+      break
+    end
+  end
+  if sorted then return nil end
+  local order = {}
+  for i = 1, #edits // 5 do order[i] = i end
+  table.sort(order, function(a, b)
+    local la, lb = edits[a * 5 - 4], edits[b * 5 - 4]
+    if la ~= lb then return la < lb end
+    local ca, cb = edits[a * 5 - 3], edits[b * 5 - 3]
+    if ca ~= cb then return ca < cb end
+    return a < b
+  end)
+  return order
+end
+
+---Applies edits given as a flat list of `line1, col1, line2, col2, text` in a
+---single pass over the lines, sorting them by position first. The selections
+---are moved like with separate edits, and a single undo record is pushed.
+---@return integer[] ranges the positions of the new texts, four per edit in
+---the order they were given
+---@return integer[] runs the first line, old and new line count of each group
+---of lines replaced
+function Doc:raw_apply_edits(edits, undo_stack, time)
+  local order = get_edits_order(edits)
+  if order then
+    local sorted = {}
+    for i, j in ipairs(order) do
+      table.move(edits, j * 5 - 4, j * 5, i * 5 - 4, sorted)
+    end
+    edits = sorted
+  end
+  push_undo(undo_stack, time, "selection", self.selections)
+  local removed, ranges, runs = self.lines:apply_edits(edits, self.selections)
+
+  -- the undo edits replace the new texts by the removed ones
+  local inverse = {}
+  for i = 1, #removed do
+    local k = i * 5 - 4
+    inverse[k], inverse[k + 1] = ranges[i * 4 - 3], ranges[i * 4 - 2]
+    inverse[k + 2], inverse[k + 3] = ranges[i * 4 - 1], ranges[i * 4]
+    inverse[k + 4] = removed[i]
+  end
+  push_undo(undo_stack, time, "edits", inverse)
+
+  -- each run of lines touched by the edits was replaced by new lines
+  for i = 1, #runs, 3 do
+    local line, old_count, new_count = runs[i], runs[i + 1], runs[i + 2]
+    if new_count >= old_count then
+      self.highlighter:insert_notify(line, new_count - old_count)
+    else
+      self.highlighter:remove_notify(line, old_count - new_count)
+    end
+  end
+  self:sanitize_selection()
+  if order then
+    local given = {}
+    for i, j in ipairs(order) do
+      table.move(ranges, i * 4 - 3, i * 4, j * 4 - 3, given)
+    end
+    ranges = given
+  end
+  return ranges, runs
+end
+
 function Doc:insert(line, col, text)
-  self.redo_stack = { idx = 1 }
+  if self.loading then
+    core.warn("Can't edit %s while it's loading", self:get_name())
+    return
+  end
+  self.redo_stack:clear()
   -- Reset the clean id when we're pushing something new before it
   if self:get_change_id() < self.clean_change_id then
     self.clean_change_id = -1
@@ -516,7 +727,14 @@ function Doc:insert(line, col, text)
 end
 
 function Doc:remove(line1, col1, line2, col2)
-  self.redo_stack = { idx = 1 }
+  if self.loading then
+    core.warn("Can't edit %s while it's loading", self:get_name())
+    return
+  end
+  self.redo_stack:clear()
+  if self:get_change_id() < self.clean_change_id then
+    self.clean_change_id = -1
+  end
   line1, col1 = self:sanitize_position(line1, col1)
   line2, col2 = self:sanitize_position(line2, col2)
   line1, col1, line2, col2 = sort_positions(line1, col1, line2, col2)
@@ -524,6 +742,28 @@ function Doc:remove(line1, col1, line2, col2)
   self:on_text_change("remove")
 end
 
+---Replaces the text between pairs of positions, given as a flat list of
+---`line1, col1, line2, col2, text`, the start of each range being before its
+---end. The edits are applied from the top, those starting at the same
+---position in the given order, and a range overlapping the one of a previous
+---edit only starts at its end. The edits are undone together.
+---@param edits (integer|string)[]
+---@return integer[]? ranges the positions of the new texts, four per edit
+function Doc:apply_edits(edits)
+  if self.loading then
+    core.warn("Can't edit %s while it's loading", self:get_name())
+    return
+  end
+  if #edits == 0 then return {} end
+  self.redo_stack:clear()
+  if self:get_change_id() < self.clean_change_id then
+    self.clean_change_id = -1
+  end
+  local ranges = self:raw_apply_edits(edits, self.undo_stack, system.get_time())
+  self:on_text_change("edit", edits, ranges)
+  return ranges
+end
+
 function Doc:undo()
   pop_undo(self, self.undo_stack, self.redo_stack, false)
 end
@@ -532,24 +772,31 @@ function Doc:redo()
   pop_undo(self, self.redo_stack, self.undo_stack, false)
 end
 
-function Doc:text_input(text, idx)
-  for sidx, line1, col1, line2, col2 in self:get_selections(true, idx or true) do
-    local had_selection = false
-    if line1 ~= line2 or col1 ~= col2 then
-      self:delete_to_cursor(sidx)
-      had_selection = true
-    end
+-- the text of all the cursors is replaced at once, then each cursor is moved
+-- after its new text
+local function replace_selections(self, idx, edits, indexes)
+  local ranges = self:apply_edits(edits)
+  if not ranges then return end
+  for i, sidx in ipairs(indexes) do
+    self:set_selections(sidx, ranges[i * 4 - 1], ranges[i * 4])
+  end
+  self:merge_cursors(idx)
+end
 
+function Doc:text_input(text, idx)
+  local edits, indexes = {}, {}
+  for sidx, line1, col1, line2, col2 in self:get_selections(true, idx) do
     if self.overwrite
-    and not had_selection
+    and line1 == line2 and col1 == col2
     and col1 < #self.lines[line1]
     and text:ulen() == 1 then
-      self:remove(line1, col1, translate.next_char(self, line1, col1))
+      line2, col2 = translate.next_char(self, line1, col1)
     end
-
-    self:insert(line1, col1, text)
-    self:move_to_cursor(sidx, #text)
+    local k = #edits
+    edits[k + 1], edits[k + 2], edits[k + 3], edits[k + 4], edits[k + 5] = line1, col1, line2, col2, text
+    indexes[#indexes + 1] = sidx
   end
+  replace_selections(self, idx, edits, indexes)
 end
 
 function Doc:ime_text_editing(text, start, length, idx)
@@ -577,14 +824,22 @@ function Doc:replace_cursor(idx, line1, col1, line2, col2, fn)
 end
 
 function Doc:replace(fn)
-  local has_selection, results = false, {}
+  local has_selection, results, edits = false, {}, {}
   for idx, line1, col1, line2, col2 in self:get_selections(true) do
     if line1 ~= line2 or col1 ~= col2 then
-      results[idx] = self:replace_cursor(idx, line1, col1, line2, col2, fn)
+      local old_text = self:get_text(line1, col1, line2, col2)
+      local new_text, res = fn(old_text)
+      if old_text ~= new_text then
+        local k = #edits
+        edits[k + 1], edits[k + 2], edits[k + 3], edits[k + 4], edits[k + 5] = line1, col1, line2, col2, new_text
+      end
+      results[idx] = res
       has_selection = true
     end
   end
-  if not has_selection then
+  if has_selection then
+    self:apply_edits(edits)
+  else
     self:set_selection(table.unpack(self.selections))
     results[1] = self:replace_cursor(1, 1, 1, #self.lines, #self.lines[#self.lines], fn)
   end
@@ -592,17 +847,16 @@ function Doc:replace(fn)
 end
 
 function Doc:delete_to_cursor(idx, ...)
+  local edits, indexes = {}, {}
   for sidx, line1, col1, line2, col2 in self:get_selections(true, idx) do
-    if line1 ~= line2 or col1 ~= col2 then
-      self:remove(line1, col1, line2, col2)
-    else
-      local l2, c2 = self:position_offset(line1, col1, ...)
-      self:remove(line1, col1, l2, c2)
-      line1, col1 = sort_positions(line1, col1, l2, c2)
+    if line1 == line2 and col1 == col2 then
+      line1, col1, line2, col2 = sort_positions(line1, col1, self:position_offset(line1, col1, ...))
     end
-    self:set_selections(sidx, line1, col1)
+    local k = #edits
+    edits[k + 1], edits[k + 2], edits[k + 3], edits[k + 4], edits[k + 5] = line1, col1, line2, col2, ""
+    indexes[#indexes + 1] = sidx
   end
-  self:merge_cursors(idx)
+  replace_selections(self, idx, edits, indexes)
 end
 
 function Doc:delete_to(...) return self:delete_to_cursor(nil, ...) end
@@ -687,8 +941,19 @@ function Doc:indent_text(unindent, line1, col1, line2, col2)
   return line1, col1 + #text, line1, col1 + #text
 end
 
--- For plugins to add custom actions of document change
-function Doc:on_text_change(type)
+---For plugins to add custom actions of document change.
+---
+---Typing, deleting and replacing text, with one or more cursors, apply their
+---changes as a batch of edits with Doc:apply_edits, which doesn't go through
+---Doc:insert, Doc:remove, Doc:raw_insert and Doc:raw_remove. Plugins that
+---override these to see the changes should override Doc:apply_edits or
+---Doc:raw_apply_edits too, or use this: for a batch, `type` is "edit",
+---`edits` the edits given to Doc:apply_edits, before they were applied, and
+---`ranges` the positions of their new texts.
+---@param type "insert"|"remove"|"edit"|"undo"
+---@param edits? (integer|string)[]
+---@param ranges? integer[]
+function Doc:on_text_change(type, edits, ranges)
 end
 
 -- For plugins to get notified when a document is closed
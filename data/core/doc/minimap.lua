@@ -0,0 +1,165 @@
+local style = require "core.style"
+local Object = require "core.object"
+
+---Downsampled "code shape" rendering of a whole document, colored by token
+---type. Lines are rasterized natively into a renderer.image and are only
+---re-rendered when the highlighter reports changes, so the whole minimap can
+---be drawn with a single renderer.draw_image call. The minimap listens to the
+---highlighter of the document, see Highlighter:add_listener.
+---@class core.doc.minimap : core.object
+---@field doc core.doc
+---@field highlighter core.doc.highlighter?
+---@field image renderer.image?
+local Minimap = Object:extend()
+
+function Minimap:__tostring() return "Minimap" end
+
+---@class core.doc.minimap.options
+---@field width? integer Width of the image in pixels.
+---@field char_width? number Horizontal pixels per character.
+---@field line_height? integer Vertical pixels per line.
+---@field char_height? integer Height of a character block, at most line_height.
+
+---@param doc core.doc
+---@param options? core.doc.minimap.options
+function Minimap:new(doc, options)
+  options = options or {}
+  self.doc = doc
+  self.width = options.width or 120
+  self.options = {
+    char_width = options.char_width or 1,
+    line_height = options.line_height or 2,
+    char_height = options.char_height,
+    tab_width = 4
+  }
+  self.image = nil
+  self.rendered_lines = 0
+  self.first_invalid_line = 1
+  self.last_invalid_line = math.huge
+end
+
+
+---@return integer
+function Minimap:get_line_height()
+  return self.options.line_height
+end
+
+
+---Marks the lines between `line1` and `line2` (inclusive) to be re-rendered.
+---@param line1 integer
+---@param line2 integer
+function Minimap:invalidate(line1, line2)
+  self.first_invalid_line = math.min(self.first_invalid_line, line1)
+  self.last_invalid_line = math.max(self.last_invalid_line, line2)
+end
+
+
+function Minimap:on_insert(line, n)
+  if self.image and n > 0 then
+    local lh = self.options.line_height
+    self.image:move_rows(line * lh, (line + n) * lh, (self.rendered_lines - line) * lh)
+    self.rendered_lines = self.rendered_lines + n
+  end
+  self:invalidate(line, line + n)
+end
+
+
+function Minimap:on_update(line, n)
+  self:invalidate(line, line + n)
+end
+
+
+function Minimap:on_remove(line, n)
+  if self.image and n > 0 then
+    local lh = self.options.line_height
+    self.image:move_rows((line + n) * lh, line * lh, (self.rendered_lines - line - n) * lh)
+    -- clear the rows that are no longer used by any line
+    self.image:fill_rect(0, (self.rendered_lines - n) * lh, self.width, n * lh, { 0, 0, 0, 0 })
+    self.rendered_lines = self.rendered_lines - n
+  end
+  self:invalidate(line, line)
+end
+
+
+local function get_line_tokens(self, idx)
+  local line = self.highlighter.lines[idx]
+  local text = self.doc.lines[idx]
+  -- lines that aren't tokenized yet, or whose tokens were evicted, are drawn
+  -- as normal text until the highlighter reports them through update_notify
+  if line and line.tokens and line.text == text and not line.resume then
+    return line.tokens
+  end
+  return { "normal", text }
+end
+
+
+---Renders the invalid lines, reallocating the image if the document grew.
+function Minimap:update()
+  local doc = self.doc
+  if self.highlighter ~= doc.highlighter then
+    if self.highlighter then self.highlighter:remove_listener(self) end
+    self.highlighter = doc.highlighter
+    self.highlighter:add_listener(self)
+    self:invalidate(1, math.huge)
+  end
+
+  local nlines = #doc.lines
+  if nlines > self.rendered_lines then
+    -- lines appended while the document is loading aren't notified
+    self:invalidate(self.rendered_lines + 1, nlines)
+  end
+  local lh = self.options.line_height
+  local image_height = self.image and select(2, self.image:get_size()) or 0
+  if nlines * lh > image_height then
+    -- leave room for a quarter more lines to amortize the full re-render
+    self.image = renderer.image.new(self.width, (nlines + math.max(64, nlines // 4)) * lh)
+    self:invalidate(1, math.huge)
+  end
+
+  local line1 = self.first_invalid_line
+  local line2 = math.min(self.last_invalid_line, nlines)
+  if line1 <= line2 then
+    local _, indent_size = doc:get_indent_info()
+    self.options.tab_width = indent_size
+    local lines = {}
+    for i = line1, line2 do
+      lines[#lines + 1] = get_line_tokens(self, i)
+    end
+    self.image:draw_code(lines, (line1 - 1) * lh, style.syntax, self.options)
+    if self.rendered_lines > nlines then
+      -- the document was reloaded with less lines
+      self.image:fill_rect(0, nlines * lh, self.width, (self.rendered_lines - nlines) * lh, { 0, 0, 0, 0 })
+    end
+  end
+  self.rendered_lines = nlines
+  self.first_invalid_line = math.huge
+  self.last_invalid_line = 0
+end
+
+
+---Stops listening to the highlighter and drops the image, for minimaps that
+---are replaced; the image isn't accounted by the garbage collector.
+function Minimap:release()
+  if self.highlighter then self.highlighter:remove_listener(self) end
+  self.highlighter = nil
+  self.image = nil
+end
+
+
+---Draws the minimap starting from `first_line`, covering `height` pixels.
+---@param x number
+---@param y number
+---@param first_line integer
+---@param height number
+function Minimap:draw(x, y, first_line, height)
+  self:update()
+  local lh = self.options.line_height
+  local src_y = (first_line - 1) * lh
+  local src_h = math.min(math.floor(height), self.rendered_lines * lh - src_y)
+  if src_h > 0 then
+    renderer.draw_image(self.image, x, y, self.width, src_h, 0, src_y, self.width, src_h)
+  end
+end
+
+
+return Minimap
@@ -64,6 +64,7 @@ function DocView:new(doc)
   self.doc = assert(doc)
   self.font = "code_font"
   self.last_x_offset = {}
+  self.x_checkpoints = setmetatable({}, { __mode = "k" })
   self.ime_selection = { from = 0, size = 0 }
   self.ime_status = false
   self.hovering_gutter = false
@@ -170,16 +171,206 @@ function DocView:get_visible_line_range()
 end
 
 
+-- Returns the x advance of a tab at the given x offset, mirroring the
+-- renderer's tab stop logic.
+local function get_tab_advance(x, cell_width, tab_width)
+  local adv = tab_width - math.fmod(x, tab_width)
+  if adv < cell_width then adv = adv + tab_width end
+  return adv
+end
+
+
+-- Lines longer than this are measured from x offset checkpoints placed every
+-- `checkpoint_bytes`, so that drawing, hit-testing and placing carets cost
+-- the visible width rather than the column.
+local checkpoint_bytes = 4096
+
+-- Returns whether the fonts were resized since the checkpoints were measured,
+-- as the scale plugin resizes them in place.
+local function are_fonts_resized(cp)
+  if cp.font:get_size() ~= cp.font_size then return true end
+  local n = 0
+  for type, font in pairs(style.syntax_fonts) do
+    if cp.syntax_font_sizes[type] ~= font:get_size() then return true end
+    n = n + 1
+  end
+  return n ~= cp.syntax_font_count
+end
+
+
+-- Returns the checkpoints of a long line. They're cached by the line tokens,
+-- which the highlighter replaces whenever the line is edited.
+local function get_x_checkpoints(self, line, tokens)
+  if #self.doc.lines[line] <= checkpoint_bytes then return nil end
+  tokens = tokens or self.doc.highlighter:get_line(line).tokens
+  local font = self:get_font()
+  local _, indent_size = self.doc:get_indent_info()
+  local cp = self.x_checkpoints[tokens]
+  if not cp or cp.font ~= font or cp.indent_size ~= indent_size or are_fonts_resized(cp) then
+    local syntax_font_sizes, syntax_font_count = {}, 0
+    for type, syntax_font in pairs(style.syntax_fonts) do
+      syntax_font_sizes[type] = syntax_font:get_size()
+      syntax_font_count = syntax_font_count + 1
+    end
+    cp = {
+      tokens = tokens, font = font, font_size = font:get_size(), indent_size = indent_size,
+      syntax_font_sizes = syntax_font_sizes, syntax_font_count = syntax_font_count,
+      tidx = { 1 }, offset = { 0 }, col = { 1 }, x = { 0 }
+    }
+    self.x_checkpoints[tokens] = cp
+  end
+  return cp
+end
+
+
+-- Measures the line until there's a checkpoint after `col` or `x`.
+local function extend_x_checkpoints(cp, col, x)
+  local tokens, default_font = cp.tokens, cp.font
+  default_font:set_tab_size(cp.indent_size)
+  local n = #cp.col
+  while not cp.done and ((col and cp.col[n] <= col) or (x and cp.x[n] <= x)) do
+    local tidx, offset = cp.tidx[n], cp.offset[n]
+    local column, xoffset = cp.col[n], cp.x[n]
+    local target = column + checkpoint_bytes
+    while true do
+      local type, text = tokens[tidx], tokens[tidx + 1]
+      if not type then
+        cp.done = true
+        break
+      end
+      local font = style.syntax_fonts[type] or default_font
+      if font ~= default_font then font:set_tab_size(cp.indent_size) end
+      if column + #text - offset < target then
+        local piece = offset > 0 and text:sub(offset + 1) or text
+        xoffset = xoffset + font:get_width(piece, {tab_offset = xoffset})
+        column = column + #piece
+        tidx, offset = tidx + 2, 0
+      else
+        local split = offset + target - column
+        -- don't split utf-8 characters
+        while split < #text and text:byte(split + 1) & 0xc0 == 0x80 do
+          split = split + 1
+        end
+        xoffset = xoffset + font:get_width(text:sub(offset + 1, split), {tab_offset = xoffset})
+        column = column + split - offset
+        if split == #text then
+          tidx, offset = tidx + 2, 0
+        else
+          offset = split
+        end
+        n = n + 1
+        cp.tidx[n], cp.offset[n], cp.col[n], cp.x[n] = tidx, offset, column, xoffset
+        break
+      end
+    end
+  end
+end
+
+
+local function find_x_checkpoint(list, value)
+  local lo, hi = 1, #list
+  while lo < hi do
+    local mid = (lo + hi + 1) // 2
+    if list[mid] <= value then lo = mid else hi = mid - 1 end
+  end
+  return lo
+end
+
+
+-- Returns the line tokens, followed by the token index, the offset in the
+-- token, the column and the x offset of the closest checkpoint before `col`
+-- or `x`, and the column of the next one. Short lines start from the beginning.
+local function get_x_checkpoint(self, line, col, x)
+  local tokens = self.doc.highlighter:get_line(line).tokens
+  local cp = get_x_checkpoints(self, line, tokens)
+  if not cp then return tokens, 1, 0, 1, 0, math.huge end
+  extend_x_checkpoints(cp, col, x)
+  local k = col and find_x_checkpoint(cp.col, col) or find_x_checkpoint(cp.x, x)
+  return tokens, cp.tidx[k], cp.offset[k], cp.col[k], cp.x[k], cp.col[k + 1] or math.huge
+end
+
+
+-- Returns the cell width of the font if the line can be measured
+-- arithmetically: the font is monospace, every token is drawn with it and
+-- the line only contains characters that are guaranteed to fit in a cell.
+function DocView:get_line_monospace_width(line)
+  local cp = get_x_checkpoints(self, line)
+  if cp and cp.cell_width ~= nil then
+    return cp.cell_width or nil
+  end
+  local default_font = self:get_font()
+  local cell_width = default_font:get_monospace_width()
+  if cell_width and self.doc.lines[line]:find("[%z\1-\8\14-\31\127-\255]") then
+    cell_width = nil
+  end
+  if cell_width then
+    for _, type in self.doc.highlighter:each_token(line) do
+      local font = style.syntax_fonts[type]
+      if font and font ~= default_font then
+        cell_width = nil
+        break
+      end
+    end
+  end
+  if cp then cp.cell_width = cell_width or false end
+  return cell_width
+end
+
+
+local function get_monospace_col_x_offset(text, col, cell_width, tab_width)
+  local xoffset, i = 0, 1
+  col = math.min(col, #text + 1)
+  while i < col do
+    local tab = text:find("\t", i, true)
+    if not tab or tab >= col then
+      return xoffset + (col - i) * cell_width
+    end
+    xoffset = xoffset + (tab - i) * cell_width
+    xoffset = xoffset + get_tab_advance(xoffset, cell_width, tab_width)
+    i = tab + 1
+  end
+  return xoffset
+end
+
+
+local function get_monospace_x_offset_col(text, x, cell_width, tab_width)
+  local xoffset, i = 0, 1
+  while i <= #text do
+    local tab = text:find("\t", i, true) or #text + 1
+    local n = tab - i
+    if n > 0 and xoffset + n * cell_width >= x then
+      local k = math.max(0, math.ceil((x - xoffset) / cell_width) - 1)
+      return (x <= xoffset + k * cell_width + cell_width / 2) and i + k or i + k + 1
+    end
+    xoffset = xoffset + n * cell_width
+    if tab > #text then break end
+    local w = get_tab_advance(xoffset, cell_width, tab_width)
+    if xoffset + w >= x then
+      return (x <= xoffset + (w / 2)) and tab or tab + 1
+    end
+    xoffset = xoffset + w
+    i = tab + 1
+  end
+  return #text
+end
+
+
 function DocView:get_col_x_offset(line, col)
   local default_font = self:get_font()
+  local cell_width = self:get_line_monospace_width(line)
+  if cell_width then
+    local _, indent_size = self.doc:get_indent_info()
+    return get_monospace_col_x_offset(self.doc.lines[line], col, cell_width, cell_width * indent_size)
+  end
   local _, indent_size = self.doc:get_indent_info()
   default_font:set_tab_size(indent_size)
-  local column = 1
-  local xoffset = 0
-  for _, type, text in self.doc.highlighter:each_token(line) do
+  local tokens, tidx, offset, column, xoffset, limit = get_x_checkpoint(self, line, col)
+  while tokens[tidx] and column < limit do
+    local type, text = tokens[tidx], tokens[tidx + 1]
     local font = style.syntax_fonts[type] or default_font
     if font ~= default_font then font:set_tab_size(indent_size) end
-    local length = #text
+    local length = math.min(#text - offset, limit - column)
+    if length < #text then text = text:sub(offset + 1, offset + length) end
     if column + length <= col then
       xoffset = xoffset + font:get_width(text, {tab_offset = xoffset})
       column = column + length
@@ -195,6 +386,7 @@ function DocView:get_col_x_offset(line, col)
         column = column + #char
       end
     end
+    tidx, offset = tidx + 2, 0
   end
 
   return xoffset
@@ -203,14 +395,22 @@ end
 
 function DocView:get_x_offset_col(line, x)
   local line_text = self.doc.lines[line]
+  local cell_width = self:get_line_monospace_width(line)
+  if cell_width then
+    local _, indent_size = self.doc:get_indent_info()
+    return get_monospace_x_offset_col(line_text, x, cell_width, cell_width * indent_size)
+  end
 
-  local xoffset, i = 0, 1
   local default_font = self:get_font()
   local _, indent_size = self.doc:get_indent_info()
   default_font:set_tab_size(indent_size)
-  for _, type, text in self.doc.highlighter:each_token(line) do
+  local tokens, tidx, offset, i, xoffset, limit = get_x_checkpoint(self, line, nil, x)
+  while tokens[tidx] and i < limit do
+    local type, text = tokens[tidx], tokens[tidx + 1]
     local font = style.syntax_fonts[type] or default_font
     if font ~= default_font then font:set_tab_size(indent_size) end
+    local length = math.min(#text - offset, limit - i)
+    if length < #text then text = text:sub(offset + 1, offset + length) end
     local width = font:get_width(text, {tab_offset = xoffset})
     -- Don't take the shortcut if the width matches x,
     -- because we need last_i which should be calculated using utf-8.
@@ -227,9 +427,10 @@ function DocView:get_x_offset_col(line, x)
         i = i + #char
       end
     end
+    tidx, offset = tidx + 2, 0
   end
 
-  return #line_text
+  return math.min(i, #line_text)
 end
 
 
@@ -447,19 +648,35 @@ function DocView:draw_line_text(line, x, y)
   local default_font = self:get_font()
   local tx, ty = x, y + self:get_line_text_y_offset()
   local last_token = nil
-  local tokens = self.doc.highlighter:get_line(line).tokens
+  local tokens, tidx, offset, column, xoffset, limit =
+    get_x_checkpoint(self, line, nil, self.position.x - x)
   local tokens_count = #tokens
   if string.sub(tokens[tokens_count], -1) == "\n" then
     last_token = tokens_count - 1
   end
   local start_tx = tx
-  for tidx, type, text in self.doc.highlighter:each_token(line) do
+  -- long lines start from the closest checkpoint left of the view
+  tx = tx + xoffset
+  while tokens[tidx] do
+    local type, text = tokens[tidx], tokens[tidx + 1]
     local color = style.syntax[type]
     local font = style.syntax_fonts[type] or default_font
+    local length = math.min(#text - offset, limit - column)
+    local last_piece = offset + length == #text
+    if length < #text then text = text:sub(offset + 1, offset + length) end
     -- do not render newline, fixes issue #1164
-    if tidx == last_token then text = text:sub(1, -2) end
+    if tidx == last_token and last_piece then text = text:sub(1, -2) end
     tx = renderer.draw_text(font, text, tx, ty, color, {tab_offset = tx - start_tx})
     if tx > self.position.x + self.size.x then break end
+    column = column + length
+    if last_piece then
+      tidx, offset = tidx + 2, 0
+    else
+      offset = offset + length
+    end
+    if column >= limit then
+      tokens, tidx, offset, column, xoffset, limit = get_x_checkpoint(self, line, column)
+    end
   end
   return self:get_line_height()
 end
@@ -323,6 +323,9 @@ function core.init()
   core.blink_start = system.get_time()
   core.blink_timer = core.blink_start
   core.active_file_dialogs = {}
+  core.active_tokenizer_jobs = {}
+  core.active_saves = {}
+  core.active_loads = {}
   core.redraw = true
   core.visited_files = {}
   core.restart_request = false
@@ -477,6 +480,11 @@ end
 
 
 function core.exit(quit_fn, force)
+  -- documents being saved are dirty until their file is written
+  while next(core.active_saves) do
+    local _, callback = next(core.active_saves)
+    callback()
+  end
   if force then
     core.delete_temp_files()
     while #core.projects > 0 do core.remove_project(core.projects[#core.projects], true) end
@@ -902,6 +910,18 @@ function core.on_event(type, ...)
       core.active_file_dialogs[id] = nil
       callback(status, result)
     end
+  elseif type == "tokenized" then
+    local callback = core.active_tokenizer_jobs[...]
+    -- jobs that were cancelled may still have pending events
+    if callback then callback() end
+  elseif type == "loaded" then
+    local callback = core.active_loads[...]
+    -- documents may have been reloaded since
+    if callback then callback() end
+  elseif type == "saved" then
+    local callback = core.active_saves[...]
+    -- saves that were waited for are already done
+    if callback then callback() end
   elseif type == "focuslost" then
     core.root_view:on_focus_lost(...)
   elseif type == "quit" then
@@ -320,6 +320,20 @@ function StatusView:register_docview_items()
     end
   })
 
+  self:add_item({
+    predicate = predicate_docview,
+    name = "doc:loading",
+    alignment = StatusView.Item.RIGHT,
+    get_item = function()
+      local progress = core.active_view.doc:get_load_progress()
+      if not progress then return {} end
+      return {
+        style.accent, string.format("Loading %d%%", progress * 100)
+      }
+    end,
+    separator = self.separator2
+  })
+
   self:add_item({
     predicate = predicate_docview,
     name = "doc:lines",
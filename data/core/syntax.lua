@@ -34,6 +34,108 @@ local function check_pattern(pattern_type, pattern)
   return ok --[[@as boolean]], err
 end
 
+
+-- Index of the syntaxes by the extension or basename their file patterns
+-- require, so that only the patterns of the syntaxes that could match have to
+-- be tried. Syntaxes with patterns that can't be indexed are always tried.
+local index
+
+-- returns the literal text a file pattern requires at the end of the path,
+-- and whether it must be preceded by a path separator or the start of the
+-- path, or nil if the pattern is not made of literal characters
+local function get_literal_suffix(pattern)
+  if type(pattern) ~= "string" or pattern:sub(-1) ~= "$" then return end
+  local body, whole = pattern:sub(1, -2), false
+  for _, prefix in ipairs({ "^", "[/\\]", "[\\/]" }) do
+    if body:sub(1, #prefix) == prefix then
+      body, whole = body:sub(#prefix + 1), true
+      break
+    end
+  end
+  local literal, i = {}, 1
+  while i <= #body do
+    local c = body:sub(i, i)
+    if c == "%" then
+      c = body:sub(i + 1, i + 1)
+      -- character classes, captures and "%$" at the end
+      if c == "" or c:find("%w") then return end
+      i = i + 1
+    elseif c:find("[%^%$%(%)%.%[%]%*%+%-%?]") then
+      return
+    end
+    literal[#literal + 1] = c
+    i = i + 1
+  end
+  return table.concat(literal), whole
+end
+
+local function add_to_index(map, key, i)
+  map[key] = map[key] or {}
+  table.insert(map[key], i)
+end
+
+local function index_syntax(i, t)
+  local files = type(t.files) == "string" and { t.files } or t.files or {}
+  for _, pattern in ipairs(files) do
+    local literal, whole = get_literal_suffix(pattern)
+    local dir, basename = (literal or ""):match("^(.-)([^/\\]*)$")
+    local extension = basename:match("%.([^%.]+)$")
+    if literal and (whole or dir ~= "") then
+      add_to_index(index.basenames, basename, i)
+    elseif literal and extension then
+      add_to_index(index.extensions, extension, i)
+    else
+      table.insert(index.others, i)
+      break
+    end
+  end
+  if t.headers then
+    table.insert(index.headers, i)
+  end
+  index.items[i] = { syntax = t, files = t.files, nfiles = type(t.files) == "table" and #t.files }
+end
+
+-- the index is rebuilt if the items or their files were changed in place
+local function update_index()
+  if index and #index.items == #syntax.items then
+    local valid = true
+    for i, item in ipairs(index.items) do
+      local t = syntax.items[i]
+      if item.syntax ~= t or item.files ~= t.files
+      or item.nfiles ~= (type(t.files) == "table" and #t.files) then
+        valid = false
+        break
+      end
+    end
+    if valid then return end
+  end
+  index = { extensions = {}, basenames = {}, others = {}, headers = {}, items = {} }
+  for i, t in ipairs(syntax.items) do
+    index_syntax(i, t)
+  end
+end
+
+-- returns the positions in syntax.items of the syntaxes that could match the
+-- filename, in ascending order
+local function get_candidates(filename)
+  local basename = filename:match("[^/\\]*$")
+  local extension = basename:match("%.([^%.]+)$")
+  local candidates, seen = {}, {}
+  for _, list in ipairs({
+    index.others, index.basenames[basename] or {}, extension and index.extensions[extension] or {}
+  }) do
+    for _, i in ipairs(list) do
+      if not seen[i] then
+        seen[i] = true
+        table.insert(candidates, i)
+      end
+    end
+  end
+  table.sort(candidates)
+  return candidates
+end
+
+
 function syntax.add(t)
   if type(t.space_handling) ~= "boolean" then t.space_handling = true end
 
@@ -74,14 +176,17 @@ function syntax.add(t)
   end
 
   table.insert(syntax.items, t)
+  if index and #index.items == #syntax.items - 1 then
+    index_syntax(#syntax.items, t)
+  end
 end
 
 
-local function find(string, field)
+local function find(string, field, candidates)
   local best_match = 0
   local best_syntax
-  for i = #syntax.items, 1, -1 do
-    local t = syntax.items[i]
+  for k = #candidates, 1, -1 do
+    local t = syntax.items[candidates[k]]
     local s, e = common.match_pattern(string, t[field] or {})
     if s and e - s > best_match then
       best_match = e - s
@@ -92,8 +197,9 @@ local function find(string, field)
 end
 
 function syntax.get(filename, header)
-  return (filename and find(filename, "files"))
-      or (header and find(header, "headers"))
+  update_index()
+  return (filename and find(filename, "files", get_candidates(filename)))
+      or (header and find(header, "headers", index.headers))
       or syntax.plain_text_syntax
 end
 
@@ -5,52 +5,6 @@ local config = require "core.config"
 local tokenizer = {}
 local bad_patterns = {}
 
-local function push_token(t, type, text)
-  if not text or #text == 0 then return end
-  type = type or "normal"
-  local prev_type = t[#t-1]
-  local prev_text = t[#t]
-  if prev_type and (prev_type == type or (prev_text:ufind("^%s*$") and type ~= "incomplete")) then
-    t[#t-1] = type
-    t[#t] = prev_text .. text
-  else
-    table.insert(t, type)
-    table.insert(t, text)
-  end
-end
-
-
-local function push_tokens(t, syn, pattern, full_text, find_results)
-  if #find_results > 2 then
-    -- We do some manipulation with find_results so that it's arranged
-    -- like this:
-    -- { start, end, i_1, i_2, i_3, …, i_last }
-    -- Each position spans characters from i_n to ((i_n+1) - 1), to form
-    -- consecutive spans of text.
-    --
-    -- Insert the start index at i_1 to make iterating easier
-    table.insert(find_results, 3, find_results[1])
-    -- Copy the ending index to the end of the table, so that an ending index
-    -- always follows a starting index after position 3 in the table.
-    table.insert(find_results, find_results[2] + 1)
-    -- Then, we just iterate over our modified table.
-    for i = 3, #find_results - 1 do
-      local start = find_results[i]
-      local fin = find_results[i + 1] - 1
-      local type = pattern.type[i - 2]
-        -- ↑ (i - 2) to convert from [3; n] to [1; n]
-      if fin >= start then
-        local text = full_text:usub(start, fin)
-        push_token(t, syn.symbols[text] or type, text)
-      end
-    end
-  else
-    local start, fin = find_results[1], find_results[2]
-    local text = full_text:usub(start, fin)
-    push_token(t, syn.symbols[text] or pattern.type, text)
-  end
-end
-
 -- State is a string of bytes, where the count of bytes represents the depth
 -- of the subsyntax we are currently in. Each individual byte represents the
 -- index of the pattern for the current subsyntax in relation to its parent
@@ -128,10 +82,13 @@ local function report_bad_pattern(log_fn, syntax, pattern_idx, msg, ...)
             syntax.name or "unnamed", ...)
 end
 
----@param incoming_syntax table
----@param text string
----@param state string
-function tokenizer.tokenize(incoming_syntax, text, state, resume)
+local function is_whitespace(text, s, e)
+  return text:sub(s, e):ufind("^%s*$") ~= nil
+end
+
+-- Positions are byte offsets of the text, so that the cost of tokenizing
+-- doesn't depend on how far into a long line we are.
+local function tokenize_lua(incoming_syntax, text, state, resume)
   local res
   local i = 1
 
@@ -141,19 +98,83 @@ function tokenizer.tokenize(incoming_syntax, text, state, resume)
     return { "normal", text }, state
   end
 
-  if resume then
+  -- packed tokens of the native tokenizer can't be resumed here
+  if resume and type(resume.res) == "table" then
     res = resume.res
     -- Remove "incomplete" tokens
     while res[#res-1] == "incomplete" do
       table.remove(res, #res)
       table.remove(res, #res)
     end
-    i = resume.i
+    i = resume.offset
     state = resume.state
   end
 
   res = res or {}
 
+  -- The last token is kept as a span of the text until a token of another
+  -- type is pushed, so that merging tokens doesn't concatenate strings.
+  local last_type, last_start, last_end, last_whitespace
+
+  local function flush_token()
+    if last_type then
+      table.insert(res, last_type)
+      table.insert(res, text:sub(last_start, last_end))
+      last_type = nil
+    end
+  end
+
+  local function push_token(type, s, e)
+    if e < s then return end
+    type = type or "normal"
+    if last_type and (last_type == type or (last_whitespace and type ~= "incomplete")) then
+      last_whitespace = last_whitespace and is_whitespace(text, s, e)
+      last_type, last_end = type, e
+    else
+      flush_token()
+      last_type, last_start, last_end = type, s, e
+      last_whitespace = is_whitespace(text, s, e)
+    end
+  end
+
+  local function push_tokens(syn, pattern, find_results)
+    if #find_results > 2 then
+      -- We do some manipulation with find_results so that it's arranged
+      -- like this:
+      -- { start, end, i_1, i_2, i_3, …, i_last }
+      -- Each position spans bytes from i_n to ((i_n+1) - 1), to form
+      -- consecutive spans of text.
+      --
+      -- Insert the start index at i_1 to make iterating easier
+      table.insert(find_results, 3, find_results[1])
+      -- Copy the ending index to the end of the table, so that an ending index
+      -- always follows a starting index after position 3 in the table.
+      table.insert(find_results, find_results[2] + 1)
+      -- Then, we just iterate over our modified table.
+      for i = 3, #find_results - 1 do
+        local start = find_results[i]
+        local fin = find_results[i + 1] - 1
+        local type = pattern.type[i - 2]
+          -- ↑ (i - 2) to convert from [3; n] to [1; n]
+        if fin >= start then
+          push_token(syn.symbols[text:sub(start, fin)] or type, start, fin)
+        end
+      end
+    else
+      local start, fin = find_results[1], find_results[2]
+      push_token(syn.symbols[text:sub(start, fin)] or pattern.type, start, fin)
+    end
+  end
+
+  -- Reopen the last resumed token, so that it can still be merged
+  local prev_text = res[#res]
+  if prev_text and i > #prev_text and text:sub(i - #prev_text, i - 1) == prev_text then
+    last_type, last_start, last_end = res[#res-1], i - #prev_text, i - 1
+    last_whitespace = is_whitespace(text, last_start, last_end)
+    table.remove(res, #res)
+    table.remove(res, #res)
+  end
+
   -- incoming_syntax    : the parent syntax of the file.
   -- state              : a string of bytes representing syntax state (see above)
 
@@ -199,6 +220,9 @@ function tokenizer.tokenize(incoming_syntax, text, state, resume)
       retrieve_syntax_state(incoming_syntax, state)
   end
 
+  -- regexes skip validating the whole line on every search if it's valid
+  local regex_options = text:ulen() and regex.NO_UTF_CHECK or 0
+
   local function find_text(text, p, offset, at_start, close)
     local target, res = p.pattern or p.regex, { 1, offset - 1 }
     local p_idx = close and 2 or 1
@@ -233,24 +257,26 @@ function tokenizer.tokenize(incoming_syntax, text, state, resume)
       if p.whole_line[p_idx] and next > 1 then
         return
       end
-      res = p.pattern and { text:ufind((at_start or p.whole_line[p_idx]) and "^" .. code or code, next) }
-        or { regex.find(code, text, text:ucharpos(next), (at_start or p.whole_line[p_idx]) and regex.ANCHORED or 0) }
-      if p.regex and #res > 0 then -- set correct utf8 len for regex result
-        local char_pos_1 = res[1] > next and string.ulen(text:sub(1, res[1])) or next
-        local char_pos_2 = string.ulen(text:sub(1, res[2]))
-        for i=3,#res do
-          res[i] = string.ulen(text:sub(1, res[i] - 1)) + 1
+      if p.pattern then
+        res = { text:ufind_offsets((at_start or p.whole_line[p_idx]) and "^" .. code or code, next) }
+      else
+        local options = regex_options | ((at_start or p.whole_line[p_idx]) and regex.ANCHORED or 0)
+        local offsets = { regex.find_offsets(code, text, next, options) }
+        res = { offsets[1], offsets[2] }
+        -- like position captures, only the start of each group is used
+        for i = 3, #offsets, 2 do
+          -- groups that didn't participate in the match point to the end
+          table.insert(res, offsets[i] < offsets[1] and #text + 1 or offsets[i])
         end
-        res[1] = char_pos_1
-        res[2] = char_pos_2
       end
       if not res[1] then return end
       if res[1] and target[3] then
         -- Check to see if the escaped character is there,
         -- and if it is not itself escaped.
+        local escape = target[3]:usub(1, 1)
         local count = 0
-        for i = res[1] - 1, 1, -1 do
-          if text:ubyte(i) ~= target[3]:ubyte() then break end
+        for i = res[1] - #escape, 1, -#escape do
+          if text:sub(i, i + #escape - 1) ~= escape then break end
           count = count + 1
         end
         if count % 2 == 0 then
@@ -265,19 +291,20 @@ function tokenizer.tokenize(incoming_syntax, text, state, resume)
     return table.unpack(res)
   end
 
-  local text_len = text:ulen()
+  local text_len = #text
   local start_time = system.get_time()
   local starting_i = i
   while i <= text_len do
-    -- Every 200 chars, check if we're out of time
+    -- Every 200 bytes, check if we're out of time
     if i - starting_i > 200 then
       starting_i = i
       if system.get_time() - start_time > 0.5 / config.fps then
         -- We're out of time
-        push_token(res, "incomplete", string.usub(text, i))
+        push_token("incomplete", i, text_len)
+        flush_token()
         return res, string.char(0), {
           res = res,
-          i = i,
+          offset = i,
           state = state
         }
       end
@@ -302,7 +329,7 @@ function tokenizer.tokenize(incoming_syntax, text, state, resume)
         -- treat the bit after as a token to be normally parsed
         -- (as it's the syntax delimiter).
         if ss and (s == nil or ss < s) then
-          push_token(res, token_type, text:usub(i, ss - 1))
+          push_token(token_type, i, ss - 1)
           i = ss
           cont = false
         end
@@ -313,14 +340,14 @@ function tokenizer.tokenize(incoming_syntax, text, state, resume)
         if s then
           -- Push remaining token before the end delimiter
           if s > i then
-            push_token(res, token_type, text:usub(i, s - 1))
+            push_token(token_type, i, s - 1)
           end
           -- Push the end delimiter
-          push_tokens(res, current_syntax, p, text, find_results)
+          push_tokens(current_syntax, p, find_results)
           set_subsyntax_pattern_idx(0)
           i = e + 1
         else
-          push_token(res, token_type, text:usub(i))
+          push_token(token_type, i, text_len)
           break
         end
       end
@@ -332,7 +359,7 @@ function tokenizer.tokenize(incoming_syntax, text, state, resume)
       local find_results = { find_text(text, subsyntax_info, i, true, true) }
       local s, e = find_results[1], find_results[2]
       if s then
-        push_tokens(res, current_syntax, subsyntax_info, text, find_results)
+        push_tokens(current_syntax, subsyntax_info, find_results)
         -- On finding unescaped delimiter, pop it.
         pop_subsyntax()
         i = e + 1
@@ -369,7 +396,7 @@ function tokenizer.tokenize(incoming_syntax, text, state, resume)
         end
 
         -- matched pattern; make and add tokens
-        push_tokens(res, current_syntax, p, text, find_results)
+        push_tokens(current_syntax, p, find_results)
         -- update state if this was a start|end pattern pair
         if type(p.pattern or p.regex) == "table" then
           -- If we have a subsyntax, push that onto the subsyntax stack.
@@ -389,15 +416,143 @@ function tokenizer.tokenize(incoming_syntax, text, state, resume)
 
     -- consume character if we didn't match
     if not matched then
-      push_token(res, "normal", text:usub(i, i))
-      i = i + 1
+      if i > text_len then break end
+      local next = text:find("[^\128-\191]", i + 1) or text_len + 1
+      push_token("normal", i, next - 1)
+      i = next
     end
   end
 
+  flush_token()
   return res, state
 end
 
 
+-- compiled versions of the syntaxes used by the native tokenizer, recompiled
+-- when patterns are added to a syntax after its first use; the syntaxes it
+-- can't compile, or using one that it can't, are mapped to their pattern
+-- count instead
+local native_syntaxes = setmetatable({}, { __mode = "k" })
+
+-- returns nil if the syntax has to be tokenized by the Lua tokenizer
+local function get_native_syntax(incoming_syntax)
+  local native = native_syntaxes[incoming_syntax]
+  if native == #incoming_syntax.patterns then return nil end
+  if type(native) ~= "userdata" or native:get_pattern_count() ~= #incoming_syntax.patterns then
+    local err
+    native, err = native_tokenizer.compile(incoming_syntax)
+    if not native then
+      core.warn("Using the Lua tokenizer for syntax %s: %s", incoming_syntax.name or "?", err)
+      native_syntaxes[incoming_syntax] = #incoming_syntax.patterns
+      return nil
+    end
+    native_syntaxes[incoming_syntax] = native
+    for n, p in ipairs(incoming_syntax.patterns) do
+      if p.syntax then
+        local subsyntax = get_native_syntax(
+          type(p.syntax) == "table" and p.syntax or syntax.get(p.syntax)
+        )
+        if not subsyntax then
+          -- the syntaxes compiled meanwhile may use this one
+          for other, compiled in pairs(native_syntaxes) do
+            if type(compiled) == "userdata" then native_syntaxes[other] = nil end
+          end
+          native_syntaxes[incoming_syntax] = #incoming_syntax.patterns
+          return nil
+        end
+        native:set_subsyntax(n, subsyntax)
+      end
+    end
+  end
+  return native
+end
+
+local function report_native_bad_pattern(is_error, syntax, pattern_idx, msg, ...)
+  report_bad_pattern(is_error and core.error or core.warn, syntax, pattern_idx, msg, ...)
+end
+
+---Tokenizes a line of text, starting from the given state.
+---When the time budget of the current frame runs out, the line is returned
+---with an "incomplete" token, alongside a value that can be passed as the
+---`resume` argument to continue tokenizing it later. Passing
+---`{ previous = tokens }` instead, with the packed tokens of another version
+---of the line from the same state, lets long lines be tokenized again only
+---around the changes.
+---@param incoming_syntax table
+---@param text string
+---@param state string
+---@param resume? table
+---@param packed? boolean Return a native_tokenizer.tokens list when available.
+---@return table|native_tokenizer.tokens tokens
+---@return string state
+---@return table? resume
+function tokenizer.tokenize(incoming_syntax, text, state, resume, packed)
+  local native = config.native_tokenizer and #incoming_syntax.patterns > 0
+    and get_native_syntax(incoming_syntax)
+  if not native then
+    return tokenize_lua(incoming_syntax, text, state, resume)
+  end
+  return native_tokenizer.tokenize(
+    native, text, state, resume,
+    0.5 / config.fps, report_native_bad_pattern, packed
+  )
+end
+
+
+-- running background jobs by id
+local jobs = {}
+local last_job_id = 0
+
+---Tokenizes consecutive lines on a background thread, starting from the given
+---state. Results are passed to `callback` as they arrive, as arrays of lines
+---in the format used by core.doc.highlighter, followed by whether the job is
+---done and an error message if it failed. The job stops early on the first
+---line whose state before it is the one given in `expected_states`.
+---Returns nil when tokenizing in the background is not available.
+---@param incoming_syntax table
+---@param lines string[]
+---@param state? string
+---@param expected_states (string|false)[]
+---@param callback fun(lines: table[], done: boolean, err?: string)
+---@return integer? job_id
+function tokenizer.start_job(incoming_syntax, lines, state, expected_states, callback)
+  local native = config.native_tokenizer and get_native_syntax(incoming_syntax)
+  if not native then return end
+  last_job_id = last_job_id + 1
+  local id = last_job_id
+  jobs[id] = native_tokenizer.start_job(
+    native, lines, state, expected_states, id
+  )
+  core.active_tokenizer_jobs[id] = function()
+    local results, done, err = jobs[id]:take_results()
+    if done then
+      jobs[id] = nil
+      core.active_tokenizer_jobs[id] = nil
+    end
+    callback(results, done, err)
+  end
+  return id
+end
+
+---Returns how many jobs can run at the same time, 0 when tokenizing in the
+---background is not available.
+---@return integer
+function tokenizer.get_worker_count()
+  if not config.native_tokenizer then return 0 end
+  return native_tokenizer.get_worker_count()
+end
+
+---Stops a job started with tokenizer.start_job, its callback won't be called
+---anymore.
+---@param id integer
+function tokenizer.cancel_job(id)
+  if jobs[id] then
+    jobs[id]:cancel()
+    jobs[id] = nil
+    core.active_tokenizer_jobs[id] = nil
+  end
+end
+
 local function iter(t, i)
   i = i + 2
   local type, text = t[i], t[i+1]
@@ -26,6 +26,7 @@ string.uwidthindex = utf8.widthindex
 string.utitle = utf8.title
 string.ufold = utf8.fold
 string.uncasecmp = utf8.ncasecmp
+string.ufind_offsets = utf8.find_offsets
 
 string.uoffset = utf8.offset
 string.ucodepoint = utf8.codepoint
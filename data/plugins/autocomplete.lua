@@ -1,4 +1,4 @@
--- mod-version:4
+-- mod-version:5
 local core = require "core"
 local common = require "core.common"
 local config = require "core.config"
@@ -713,6 +713,7 @@ end
 --
 local on_text_input = RootView.on_text_input
 local on_text_remove = Doc.remove
+local on_apply_edits = Doc.apply_edits
 local update = RootView.update
 local draw = RootView.draw
 
@@ -721,9 +722,7 @@ RootView.on_text_input = function(...)
   show_autocomplete()
 end
 
-Doc.remove = function(self, line1, col1, line2, col2)
-  on_text_remove(self, line1, col1, line2, col2)
-
+local function on_remove(line1, col1, line2)
   if triggered_manually and line1 == line2 then
     if last_col >= col1 then
       reset_suggestions()
@@ -733,6 +732,22 @@ Doc.remove = function(self, line1, col1, line2, col2)
   end
 end
 
+Doc.remove = function(self, line1, col1, line2, col2)
+  on_text_remove(self, line1, col1, line2, col2)
+  on_remove(line1, col1, line2)
+end
+
+-- text input and deletions at each cursor are applied as a batch of edits
+Doc.apply_edits = function(self, edits)
+  local ranges = on_apply_edits(self, edits)
+  for i = 1, #edits, 5 do
+    if edits[i] ~= edits[i + 2] or edits[i + 1] ~= edits[i + 3] then
+      on_remove(edits[i], edits[i + 1], edits[i + 2])
+    end
+  end
+  return ranges
+end
+
 RootView.update = function(...)
   update(...)
 
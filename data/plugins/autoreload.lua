@@ -1,4 +1,4 @@
--- mod-version:4
+-- mod-version:5
 local core = require "core"
 local config = require "core.config"
 local Doc = require "core.doc"
@@ -8,6 +8,7 @@ local dirwatch = require "core.dirwatch"
 
 config.plugins.autoreload = common.merge({
   always_show_nagview = false,
+  follow_appended_lines = true,
   config_spec = {
     name = "Autoreload",
     {
@@ -16,6 +17,13 @@ config.plugins.autoreload = common.merge({
       path = "always_show_nagview",
       type = "toggle",
       default = false
+    },
+    {
+      label = "Follow Appended Lines",
+      description = "Keeps the cursor at the end of files being appended to, like logs, if it was there.",
+      path = "follow_appended_lines",
+      type = "toggle",
+      default = true
     }
   }
 }, config.plugins.autoreload)
@@ -29,8 +37,92 @@ local function update_time(doc)
   times[doc] = info and info.modified
 end
 
+
+-- Files that are only appended to, like logs, aren't read again: the size of
+-- the file the document has, and its last bytes, are kept to check that they
+-- didn't change, and only the bytes after them are read.
+local tails = setmetatable({}, { __mode = "k" })
+local tail_size = 4096
+
+local function read_tail(doc, size)
+  local fp = io.open(doc.abs_filename, "rb")
+  if not fp then return nil end
+  fp:seek("set", math.max(0, size - tail_size))
+  local tail = fp:read(math.min(size, tail_size)) or ""
+  fp:close()
+  return tail
+end
+
+-- calls `fn` reading the file, the part it read being unknown if the size of
+-- the file changed meanwhile
+local function track_tail(doc, fn, ...)
+  local info = doc.abs_filename and system.get_file_info(doc.abs_filename)
+  local res = fn(doc, ...)
+  local after = doc.abs_filename and system.get_file_info(doc.abs_filename)
+  tails[doc] = nil
+  if info and after and info.size == after.size then
+    local tail = read_tail(doc, info.size)
+    -- the line after a carriage return at the end depends on what follows
+    if tail and #tail == math.min(info.size, tail_size) and tail:sub(-1) ~= "\r" then
+      tails[doc] = { size = info.size, tail = tail }
+    end
+  end
+  return res
+end
+
+local function scroll_to_end(doc)
+  local line = #doc.lines
+  local col = #doc.lines[line]
+  doc:set_selection(line, col)
+  for _, view in ipairs(core.root_view.root_node:get_children()) do
+    if view.doc == doc then view:scroll_to_make_visible(line, col) end
+  end
+end
+
+-- appends the bytes added at the end of the file, returns false if the rest
+-- of the file may have changed
+local function append_doc(doc)
+  local known = tails[doc]
+  local info = system.get_file_info(doc.abs_filename)
+  if not known or not info or info.size <= known.size or doc.loading or doc:is_dirty() then
+    return false
+  end
+  local fp = io.open(doc.abs_filename, "rb")
+  if not fp then return false end
+  fp:seek("set", known.size - #known.tail)
+  if (fp:read(#known.tail) or "") ~= known.tail then
+    fp:close()
+    return false
+  end
+  local text = fp:read(info.size - known.size) or ""
+  fp:close()
+  -- carriage returns at the end may be followed by a newline later
+  text = text:gsub("\r+$", "")
+  if (known.tail:sub(-1) .. text):find("\r\n", 1, true) then doc.crlf = true end
+
+  -- the last line of the document has a newline even if the file doesn't
+  local insert = text:gsub("\r\n", "\n"):gsub("\n$", "")
+  if #text > 0 and known.tail:sub(-1) == "\n" then insert = "\n" .. insert end
+  local line = #doc.lines
+  local col = #doc.lines[line]
+  local l1, c1, l2, c2 = doc:get_selection()
+  local at_end = #doc.selections == 4 and l1 == line and c1 == col and l2 == line and c2 == col
+  if #insert > 0 then
+    doc:insert(line, col, insert)
+    doc:clean()
+    if at_end and config.plugins.autoreload.follow_appended_lines then
+      scroll_to_end(doc)
+    end
+  end
+  tails[doc] = {
+    size = known.size + #text,
+    tail = (known.tail .. text):sub(-tail_size)
+  }
+  return true
+end
+
 local function reload_doc(doc)
-  doc:reload()
+  if not append_doc(doc) then doc:reload() end
   update_time(doc)
   core.redraw = true
   core.log_quiet("Auto-reloaded doc \"%s\"", doc.filename)
@@ -103,7 +195,8 @@ core.add_thread(function()
       for i, doc in ipairs(core.docs) do
         if doc.abs_filename == file then
           local info = system.get_file_info(doc.filename or "")
-          if info and times[doc] ~= info.modified then
+          -- the changes of the document's own saves are ignored
+          if info and times[doc] ~= info.modified and not doc.saving then
             if not doc:is_dirty() and not config.plugins.autoreload.always_show_nagview then
               reload_doc(doc)
             else
@@ -118,20 +211,41 @@ core.add_thread(function()
   end
 end)
 
--- patch `Doc.save|load` to store modified time
+-- patch `Doc.save|load|reload` to store modified time and the end of the file
 local load = Doc.load
+local reload = Doc.reload
 local save = Doc.save
 
 Doc.load = function(self, ...)
-  local res = load(self, ...)
+  local res = track_tail(self, load, ...)
   update_time(self)
   return res
 end
 
-Doc.save = function(self, ...)
-  local res = save(self, ...)
-  -- if starting with an unsaved document with a filename.
-  if not times[self] then watch:watch(self.abs_filename, true) end
+-- reloads only edit the lines that changed, without loading the file again
+Doc.reload = function(self, ...)
+  local res = track_tail(self, reload, ...)
   update_time(self)
   return res
 end
+
+local function saved(doc)
+  -- the file was replaced by a new one, which may need to be watched again
+  if times[doc] and visible[doc] then watch:watch(doc.abs_filename, false) end
+  -- if starting with an unsaved document with a filename.
+  if not times[doc] or visible[doc] then watch:watch(doc.abs_filename, true) end
+  update_time(doc)
+  track_tail(doc, function() end)
+end
+
+Doc.save = function(self, filename, abs_filename, callback)
+  if callback then
+    return save(self, filename, abs_filename, function(ok, err)
+      if ok then saved(self) end
+      callback(ok, err)
+    end)
+  end
+  local res = save(self, filename, abs_filename)
+  saved(self)
+  return res
+end
@@ -1,4 +1,4 @@
--- mod-version:4
+-- mod-version:5
 local core = require "core"
 local config = require "core.config"
 local command = require "core.command"
@@ -9,11 +9,22 @@ config.plugins.autorestart = common.merge({
   
 }, config.plugins.autorestart)
 
-local save = Doc.save
-Doc.save = function(self, ...)
-  local res = save(self, ...)
-  if self.abs_filename == USERDIR .. PATHSEP .. "init.lua" or self.abs_filename == core.root_project().path .. PATHSEP .. ".lite_project" then
+local function saved(doc)
+  if doc.abs_filename == USERDIR .. PATHSEP .. "init.lua" or doc.abs_filename == core.root_project().path .. PATHSEP .. ".lite_project" then
     command.perform("core:restart")
   end
+end
+
+local save = Doc.save
+Doc.save = function(self, filename, abs_filename, callback)
+  if callback then
+    -- restart once the file is written, the document is dirty until then
+    return save(self, filename, abs_filename, function(ok, err)
+      callback(ok, err)
+      if ok then saved(self) end
+    end)
+  end
+  local res = save(self, filename, abs_filename)
+  saved(self)
   return res
 end
@@ -1,4 +1,4 @@
--- mod-version:4
+-- mod-version:5
 
 local core = require "core"
 local style = require "core.style"
@@ -149,15 +149,10 @@ end
 local prev_insert_notify = Highlighter.insert_notify
 function Highlighter:insert_notify(line, n, ...)
   prev_insert_notify(self, line, n, ...)
-  if not ws_cache[self] then
-    ws_cache[self] = {}
-  end
-  local to = math.min(line + n, #self.doc.lines)
-  for i=#self.doc.lines+n,to,-1 do
-    ws_cache[self][i] = ws_cache[self][i - n]
-  end
-  for i=line,to do
-    ws_cache[self][i] = nil
+  local cache = ws_cache[self]
+  if cache then
+    cache.lines:insert(line, n, nil)
+    cache.lines[line + n] = nil
   end
 end
 
@@ -165,12 +160,10 @@ end
 local prev_remove_notify = Highlighter.remove_notify
 function Highlighter:remove_notify(line, n, ...)
   prev_remove_notify(self, line, n, ...)
-  if not ws_cache[self] then
-    ws_cache[self] = {}
-  end
-  local to = math.max(line + n, #self.doc.lines)
-  for i=line,to do
-    ws_cache[self][i] = ws_cache[self][i + n]
+  local cache = ws_cache[self]
+  if cache then
+    cache.lines:remove(line, n)
+    cache.lines[line] = nil
   end
 end
 
@@ -178,11 +171,11 @@ end
 local prev_update_notify = Highlighter.update_notify
 function Highlighter:update_notify(line, n, ...)
   prev_update_notify(self, line, n, ...)
-  if not ws_cache[self] then
-    ws_cache[self] = {}
-  end
-  for i=line,line+n do
-    ws_cache[self][i] = nil
+  local cache = ws_cache[self]
+  if cache then
+    for i=line,math.min(line+n, #cache.lines) do
+      cache.lines[i] = nil
+    end
   end
 end
 
@@ -215,14 +208,14 @@ function DocView:draw_line_text(idx, x, y)
     or ws_cache[self.doc.highlighter].font_size ~= font_size
     or ws_cache[self.doc.highlighter].indent_size ~= indent_size
   then
-    ws_cache[self.doc.highlighter] =
-      setmetatable(
-        { font = font, font_size = font_size, indent_size = indent_size },
-        { __mode = "k" }
-      )
+    ws_cache[self.doc.highlighter] = {
+      font = font, font_size = font_size, indent_size = indent_size,
+      lines = segarray.new()
+    }
   end
 
-  if not ws_cache[self.doc.highlighter][idx] then -- need to cache line
+  local lines = ws_cache[self.doc.highlighter].lines
+  if not lines[idx] then -- need to cache line
     local cache = {}
 
     local tx
@@ -290,7 +283,7 @@ function DocView:draw_line_text(idx, x, y)
         offset = e + 1
       end
     end
-    ws_cache[self.doc.highlighter][idx] = cache
+    lines[idx] = cache
   end
 
   -- draw from cache
@@ -298,7 +291,7 @@ function DocView:draw_line_text(idx, x, y)
   x1 = x1 + x
   x2 = x2 + x
   local ty = y + self:get_line_text_y_offset()
-  local cache = ws_cache[self.doc.highlighter][idx]
+  local cache = lines[idx]
   for i=1,#cache,4 do
     local tx = cache[i + 1] + x
     local tw = cache[i + 2]
@@ -1,4 +1,4 @@
--- mod-version:4
+-- mod-version:5
 local syntax = require "core.syntax"
 
 -- integer suffix combinations as a regex
@@ -1,4 +1,4 @@
--- mod-version:4
+-- mod-version:5
 local common = require "core.common"
 local command = require "core.command"
 local config = require "core.config"
@@ -1,4 +1,4 @@
--- mod-version:4 --priority:10
+-- mod-version:5 --priority:10
 local core = require "core"
 local common = require "core.common"
 local DocView = require "core.docview"
@@ -340,6 +340,28 @@ function Doc:raw_remove(line1, col1, line2, col2, undo_stack, time)
   end
 end
 
+local old_doc_apply_edits = Doc.raw_apply_edits
+function Doc:raw_apply_edits(edits, undo_stack, time)
+  local ranges, runs = old_doc_apply_edits(self, edits, undo_stack, time)
+  if open_files[self] then
+    for i,docview in ipairs(open_files[self]) do
+      if docview.wrapped_settings then
+        -- each update shifts all the breaks after it, rebuild them at once
+        -- when many lines were edited
+        if #runs > 3 * 64 then
+          LineWrapping.reconstruct_breaks(docview, docview.wrapped_settings.font, docview.wrapped_settings.width)
+        else
+          for j = 1, #runs, 3 do
+            local line, old_count, new_count = runs[j], runs[j + 1], runs[j + 2]
+            LineWrapping.update_breaks(docview, line, line + old_count - 1, new_count - old_count)
+          end
+        end
+      end
+    end
+  end
+  return ranges, runs
+end
+
 local old_doc_update = DocView.update
 function DocView:update()
   old_doc_update(self)
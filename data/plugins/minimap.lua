@@ -0,0 +1,165 @@
+-- mod-version:5
+local common = require "core.common"
+local command = require "core.command"
+local config = require "core.config"
+local style = require "core.style"
+local DocView = require "core.docview"
+local CommandView = require "core.commandview"
+local Minimap = require "core.doc.minimap"
+
+config.plugins.minimap = common.merge({
+  enabled = false,
+  -- width of the minimap in pixels, before scaling
+  width = 120,
+  -- vertical pixels per line, before scaling
+  line_height = 2,
+  -- horizontal pixels per character, before scaling
+  char_width = 1,
+  -- The config specification used by gui generators
+  config_spec = {
+    name = "Minimap",
+    {
+      label = "Enabled",
+      description = "Disable or enable drawing the minimap of documents.",
+      path = "enabled",
+      type = "toggle",
+      default = false
+    },
+    {
+      label = "Width",
+      description = "Width in pixels of the minimap.",
+      path = "width",
+      type = "number",
+      default = 120,
+      min = 16
+    },
+    {
+      label = "Line Height",
+      description = "Height in pixels of each line of the minimap.",
+      path = "line_height",
+      type = "number",
+      default = 2,
+      min = 1
+    },
+    {
+      label = "Character Width",
+      description = "Width in pixels of each character of the minimap.",
+      path = "char_width",
+      type = "number",
+      default = 1,
+      min = 0.5
+    },
+  }
+}, config.plugins.minimap)
+
+-- the minimap of each view, recreated when its options change
+local minimaps = setmetatable({}, { __mode = "k" })
+
+local function get_minimap(dv)
+  local conf = config.plugins.minimap
+  if not conf.enabled or dv:is(CommandView) then return end
+  local width = common.round(conf.width * SCALE)
+  local line_height = math.max(1, common.round(conf.line_height * SCALE))
+  local char_width = conf.char_width * SCALE
+  local minimap = minimaps[dv]
+  if not minimap or minimap.doc ~= dv.doc or minimap.width ~= width
+  or minimap.options.line_height ~= line_height
+  or minimap.options.char_width ~= char_width then
+    if minimap then minimap:release() end
+    minimap = Minimap(dv.doc, {
+      width = width, line_height = line_height, char_width = char_width
+    })
+    minimaps[dv] = minimap
+  end
+  return minimap
+end
+
+-- returns the area of the minimap, left of the scrollbar
+local function get_minimap_rect(dv, minimap)
+  local w = minimap.width
+  local x = dv.position.x + dv.size.x - style.scrollbar_size - w
+  return x, dv.position.y, w, dv.size.y
+end
+
+-- returns the first line shown in the minimap, which scrolls along with the
+-- view when the document is taller than it
+local function get_first_line(dv, minimap)
+  local lh = minimap:get_line_height()
+  local overflow = #dv.doc.lines - math.floor(dv.size.y / lh)
+  if overflow <= 0 then return 1 end
+  local scrollable = dv:get_scrollable_size() - dv.size.y
+  local percent = scrollable > 0 and common.clamp(dv.scroll.y / scrollable, 0, 1) or 0
+  return 1 + math.floor(overflow * percent)
+end
+
+local function overlaps(dv, minimap, x, y)
+  local mx, my, mw, mh = get_minimap_rect(dv, minimap)
+  return x >= mx and x < mx + mw and y >= my and y < my + mh
+end
+
+local function scroll_to_point(dv, minimap, y)
+  local _, my = get_minimap_rect(dv, minimap)
+  local line = get_first_line(dv, minimap) + math.floor((y - my) / minimap:get_line_height())
+  dv:scroll_to_line(common.clamp(line, 1, #dv.doc.lines), false, not config.animate_drag_scroll)
+end
+
+
+local draw_overlay = DocView.draw_overlay
+function DocView:draw_overlay(...)
+  draw_overlay(self, ...)
+  local minimap = get_minimap(self)
+  if not minimap then return end
+  local x, y, w, h = get_minimap_rect(self, minimap)
+  local first_line = get_first_line(self, minimap)
+  renderer.draw_rect(x, y, w, h, style.background)
+  minimap:draw(x, y, first_line, h)
+  -- highlight the lines visible in the view
+  local minline, maxline = self:get_visible_line_range()
+  local lh = minimap:get_line_height()
+  local c = style.scrollbar
+  renderer.draw_rect(x, y + (minline - first_line) * lh, w,
+    (maxline - minline + 1) * lh, { c[1], c[2], c[3], 0x30 })
+end
+
+
+local on_mouse_pressed = DocView.on_mouse_pressed
+function DocView:on_mouse_pressed(button, x, y, clicks)
+  local minimap = get_minimap(self)
+  if button == "left" and minimap and overlaps(self, minimap, x, y)
+  and not self:scrollbar_overlaps_point(x, y) then
+    self.minimap_dragging = true
+    scroll_to_point(self, minimap, y)
+    return true
+  end
+  return on_mouse_pressed(self, button, x, y, clicks)
+end
+
+
+local on_mouse_moved = DocView.on_mouse_moved
+function DocView:on_mouse_moved(x, y, ...)
+  local minimap = get_minimap(self)
+  if minimap and self.minimap_dragging then
+    scroll_to_point(self, minimap, y)
+    self.cursor = "arrow"
+    return true
+  end
+  local res = on_mouse_moved(self, x, y, ...)
+  if minimap and overlaps(self, minimap, x, y) then
+    self.cursor = "arrow"
+  end
+  return res
+end
+
+
+local on_mouse_released = DocView.on_mouse_released
+function DocView:on_mouse_released(...)
+  self.minimap_dragging = nil
+  return on_mouse_released(self, ...)
+end
+
+
+command.add(nil, {
+  ["minimap:toggle"] = function()
+    config.plugins.minimap.enabled = not config.plugins.minimap.enabled
+  end
+})
@@ -1,4 +1,4 @@
--- mod-version:4
+-- mod-version:5
 local core = require "core"
 local common = require "core.common"
 local keymap = require "core.keymap"
@@ -1,4 +1,4 @@
--- mod-version:4
+-- mod-version:5
 local common = require "core.common"
 local config = require "core.config"
 local command = require "core.command"
@@ -79,7 +79,7 @@ function trimwhitespace.trim_empty_end_lines(doc, raw_remove)
       if not raw_remove then
         doc:remove(l-1, math.huge, l, math.huge)
       else
-        table.remove(doc.lines, l)
+        common.splice(doc.lines, l, 1)
       end
     else
       break
@@ -0,0 +1,114 @@
+---@meta
+
+---
+---Native implementation of the syntax tokenizer, used by core.tokenizer.
+---It produces the same tokens and states as the Lua implementation.
+---@class native_tokenizer
+native_tokenizer = {}
+
+---
+---A syntax compiled for the native tokenizer.
+---@class native_tokenizer.syntax
+native_tokenizer.syntax = {}
+
+---
+---Compile the patterns of a syntax. Subsyntaxes are not resolved, they must
+---be set with `native_tokenizer.syntax:set_subsyntax`.
+---
+---@param syntax table A syntax as passed to core.syntax.add.
+---
+---@return native_tokenizer.syntax? syntax nil if it has more than 255
+---patterns, which the states can't refer to.
+---@return string? errmsg
+function native_tokenizer.compile(syntax) end
+
+---
+---Get the number of patterns of the syntax when it was compiled.
+---
+---@return integer
+function native_tokenizer.syntax:get_pattern_count() end
+
+---
+---Set the compiled syntax used by the pattern at index `n`.
+---
+---@param n integer
+---@param subsyntax native_tokenizer.syntax
+function native_tokenizer.syntax:set_subsyntax(n, subsyntax) end
+
+---
+---Tokens of a line packed into a userdata. It can be read like an array of
+---alternating token types and texts, with `#` and indexing, the texts being
+---created when accessed.
+---@class native_tokenizer.tokens
+native_tokenizer.tokens = {}
+
+---
+---Tokenize a line of text, starting from the given state.
+---
+---If tokenizing takes longer than `max_time`, the rest of the line is
+---returned as an "incomplete" token, alongside a value that can be passed
+---as `resume` to continue from there.
+---
+---When `resume` is `{ previous = tokens }`, with the packed tokens of another
+---version of the line tokenized from the same state, long lines are only
+---tokenized again around the part of the text that changed.
+---
+---@param syntax native_tokenizer.syntax
+---@param text string
+---@param state? string
+---@param resume? table
+---@param max_time? number Time limit in seconds, no limit if 0.
+---@param report? fun(is_error: boolean, syntax: table, pattern_idx: integer, msg: string, ...) Reports malformed patterns.
+---@param packed? boolean Return the tokens as a native_tokenizer.tokens.
+---
+---@return table|native_tokenizer.tokens tokens
+---@return string state
+---@return table? resume
+function native_tokenizer.tokenize(syntax, text, state, resume, max_time, report, packed) end
+
+---
+---Lines being tokenized on a worker thread.
+---@class native_tokenizer.job
+native_tokenizer.job = {}
+
+---
+---Tokenize consecutive lines on a worker thread, starting from the given
+---state. A "tokenized" event with the job id is sent when there are new
+---results to take. The job stops before the first line whose state would be
+---the one given in `expected_states`, as the following lines are up to date.
+---
+---Symbols added to the syntax after it was compiled are not used, and
+---malformed patterns are not reported.
+---
+---@param syntax native_tokenizer.syntax
+---@param lines string[]
+---@param state? string
+---@param expected_states (string|false)[] The state expected before each line, if known.
+---@param id integer Sent with the events of the job.
+---
+---@return native_tokenizer.job
+function native_tokenizer.start_job(syntax, lines, state, expected_states, id) end
+
+---
+---Get the number of worker threads that run the jobs, one per core up to a
+---limit. Jobs are run in the order they were started.
+---
+---@return integer
+function native_tokenizer.get_worker_count() end
+
+---
+---Take the lines tokenized since the last call, as tables with the fields
+---`text`, `init_state`, `tokens` and `state`. The tokens are packed, as
+---returned by native_tokenizer.tokenize.
+---
+---@return table[] lines
+---@return boolean done
+---@return string? error
+function native_tokenizer.job:take_results() end
+
+---
+---Stop the job, no more events are sent for it.
+function native_tokenizer.job:cancel() end
+
+
+return native_tokenizer
@@ -30,6 +30,12 @@ regex.NOTEMPTY = 0x00000004
 ---@type integer
 regex.NOTEMPTY_ATSTART = 0x00000008
 
+---Tell regex:cmatch() to skip validating the subject as UTF-8, which is
+---linear in the subject length. The subject must be known to be valid UTF-8,
+---otherwise the behavior is undefined.
+---@type integer
+regex.NO_UTF_CHECK = 0x40000000
+
 ---@alias regex.modifiers
 ---| "i"  # Case insesitive matching
 ---| "m"  # Multiline matching
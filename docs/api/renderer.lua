@@ -74,6 +74,14 @@ function renderer.font:set_tab_size(chars) end
 ---@return number
 function renderer.font:get_width(text) end
 
+---
+---Get the width in pixels of a single character cell if the font is
+---monospace for printable ASCII characters, so that the width of such text
+---can be computed arithmetically.
+---
+---@return number? width nil if the font is proportional
+function renderer.font:get_monospace_width() end
+
 ---
 ---Get the height in pixels that occupies a single character
 ---when rendered with this font.
@@ -100,6 +108,68 @@ function renderer.font:set_size(size) end
 ---@return string | table<integer, string>
 function renderer.font:get_path() end
 
+---
+---An RGBA bitmap that can be drawn with renderer.draw_image.
+---Unchanged images are not redrawn between frames.
+---@class renderer.image
+renderer.image = {}
+
+---
+---Create a new transparent image.
+---
+---@param width integer
+---@param height integer
+---
+---@return renderer.image
+function renderer.image.new(width, height) end
+
+---
+---Get the size of the image in pixels.
+---
+---@return integer width
+---@return integer height
+function renderer.image:get_size() end
+
+---
+---Replace the pixels of a region of the image, the whole image by default.
+---
+---@param pixels string Raw RGBA bytes, 4 per pixel, row by row.
+---@param x? integer
+---@param y? integer
+---@param width? integer
+---@param height? integer
+function renderer.image:set_pixels(pixels, x, y, width, height) end
+
+---
+---Fill a region of the image with a color, replacing the existing pixels.
+---
+---@param x? integer
+---@param y? integer
+---@param width? integer
+---@param height? integer
+---@param color renderer.color
+function renderer.image:fill_rect(x, y, width, height, color) end
+
+---
+---Move a range of rows to another position of the image, the rows that are
+---not overwritten keep their previous content.
+---
+---@param src_y integer
+---@param dst_y integer
+---@param count integer
+function renderer.image:move_rows(src_y, dst_y, count) end
+
+---
+---Rasterize tokenized lines as blocks of color, one block per non-whitespace
+---character, starting from row `y`. The rows covered by the lines are cleared
+---first. Used to render minimaps of documents.
+---
+---@param lines (table|native_tokenizer.tokens)[] Arrays of alternating token types and texts.
+---@param y integer
+---@param colors table<string, renderer.color> Colors by token type, like style.syntax.
+---@param options? { char_width: number, line_height: integer, char_height: integer, tab_width: integer }
+function renderer.image:draw_code(lines, y, colors, options) end
+
 ---
 ---Toggles drawing debugging rectangles on the currently rendered sections
 ---of the window to help troubleshoot the renderer.
@@ -156,5 +226,19 @@ function renderer.draw_rect(x, y, width, height, color) end
 ---@return number x
 function renderer.draw_text(font, text, x, y, color) end
 
+---
+---Draw an image, or a region of it, scaled to the given size.
+---
+---@param image renderer.image
+---@param x number
+---@param y number
+---@param width? number Defaults to the image width.
+---@param height? number Defaults to the image height.
+---@param src_x? integer
+---@param src_y? integer
+---@param src_width? integer
+---@param src_height? integer
+function renderer.draw_image(image, x, y, width, height, src_x, src_y, src_width, src_height) end
+
 
 return renderer
@@ -0,0 +1,52 @@
+---@meta
+
+---
+---Native arrays of values kept for each line of a document, like the
+---tokens of core.doc.highlighter.
+---@class segarray
+segarray = {}
+
+---
+---Values stored in blocks, inserting or removing elements takes a time
+---proportional to the number of blocks instead of the number of elements.
+---
+---It can be used like an array, with `#`, indexing, `ipairs` and `pairs`,
+---which skips the nil elements. Setting an element after the last one adds
+---nil elements before it, and setting the last element to nil removes the nil
+---elements at the end, so the length is the one of a table.
+---@class segarray.array
+segarray.array = {}
+
+---
+---Create an array of `n` times the given value.
+---
+---@param n? integer
+---@param value? any
+---
+---@return segarray.array
+function segarray.new(n, value) end
+
+---
+---Remove `remove` elements starting at `at`, and insert the given values in
+---their place, like common.splice.
+---
+---@param at integer
+---@param remove integer
+---@param values? any[]
+function segarray.array:splice(at, remove, values) end
+
+---
+---Insert `count` times the given value at `at`, adding nil elements before
+---them if `at` is after the end.
+---
+---@param at integer
+---@param count integer
+---@param value any
+function segarray.array:insert(at, count, value) end
+
+---
+---Remove up to `count` elements starting at `at`.
+---
+---@param at integer
+---@param count integer
+function segarray.array:remove(at, count) end
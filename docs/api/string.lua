@@ -25,6 +25,18 @@ function string.uchar(byte, ...) end
 ---@return ... captured
 function string.ufind(s, pattern, init, plain) end
 
+---Like find, but `init` and the returned positions, including position
+---captures, are byte offsets instead of character indices, so searching from
+---far into a long string doesn't need to walk it from the beginning.
+---@param s       string
+---@param pattern string
+---@param init?   integer Byte offset where to start searching.
+---@param plain?  boolean
+---@return integer start Byte offset of the first byte of the match.
+---@return integer end Byte offset of the last byte of the match.
+---@return ... captured
+function string.ufind_offsets(s, pattern, init, plain) end
+
 ---UTF-8 equivalent of string.gmatch
 ---@param s       string
 ---@param pattern string
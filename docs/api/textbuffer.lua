@@ -0,0 +1,218 @@
+---@meta
+
+---
+---Native storage and splitting of the lines of documents, used by core.doc.
+---@class textbuffer
+textbuffer = {}
+
+---
+---Lines stored as a piece table, editing them takes a logarithmic time in the
+---number of edits instead of a linear time in the number of lines.
+---
+---It can be used like an array of lines, with `#`, indexing, `ipairs` and the
+---table library, the lines being created as strings when accessed. Setting a
+---line replaces it, or appends it after the last line, and only the last line
+---can be removed by setting it to nil.
+---@class textbuffer.buffer
+textbuffer.buffer = {}
+
+---
+---Create a buffer holding a copy of the given lines.
+---
+---@param lines? string[]
+---
+---@return textbuffer.buffer
+function textbuffer.new(lines) end
+
+---
+---Statistics of the lines of a text.
+---@class textbuffer.linestats
+---@field lines integer
+---@field crlf integer Lines ending with a carriage return.
+---@field invalid_utf8 integer Lines that aren't valid UTF-8.
+
+---
+---Create a buffer from the text of a file, split in lines ending with a
+---newline. The carriage return before the end of each line is removed.
+---
+---@param text string
+---
+---@return textbuffer.buffer
+---@return textbuffer.linestats stats
+function textbuffer.load(text) end
+
+---
+---Split text in lines, each keeping its newline, so the last one is empty
+---when the text ends with a newline.
+---
+---@param text string
+---
+---@return string[] lines
+---@return textbuffer.linestats stats
+function textbuffer.split_lines(text) end
+
+---
+---Create a buffer from a file, its lines being changed like with
+---`textbuffer.load`.
+---
+---The file is read by a background thread. Without `id`, this returns once
+---the whole file is read. Otherwise it returns once the first lines are read,
+---files read at once being then loaded, and "loaded" events are sent with
+---`id` while the file is read, the next one only after
+---`buffer:get_load_state` was called. Until all the lines are read, the
+---buffer only contains the lines read so far and it can't be edited.
+---
+---@param path string
+---@param id? integer
+---
+---@return textbuffer.buffer? buffer
+---@return string? errmsg
+function textbuffer.open(path, id) end
+
+---
+---Create a buffer from a file mapped in memory, its lines being read from
+---the file when accessed, with the same changes as `textbuffer.load`.
+---
+---The lines are found by a background thread, like with `textbuffer.open`.
+---
+---Replacing the file, like `buffer:save` does, is fine. If it's truncated
+---while mapped, the lines past its new end read as NUL bytes until the buffer
+---is replaced, and it can't be saved or detached. Files are read like with
+---`textbuffer.open` when too many are mapped. On Windows mapped files can't be
+---truncated.
+---
+---@param path string
+---@param id? integer
+---
+---@return textbuffer.buffer? buffer
+---@return string? errmsg
+function textbuffer.map(path, id) end
+
+---
+---Remove `remove` lines starting at line `at`, and insert the given lines
+---in their place, like common.splice.
+---
+---@param at integer
+---@param remove integer
+---@param lines? string[]
+function textbuffer.buffer:splice(at, remove, lines) end
+
+---
+---Get the progress of loading the lines of a file.
+---
+---@return boolean loading
+---@return integer loaded_bytes
+---@return integer total_bytes
+---@return boolean crlf If a carriage return was removed from the lines found.
+function textbuffer.buffer:get_load_state() end
+
+---
+---Get the byte offset of a position in the text of the buffer, 1 being the
+---first byte. The column is clamped to the line, or just after it.
+---
+---The functions using offsets take a logarithmic time in the number of
+---edits, and can't be used while the buffer is loading.
+---
+---@param line integer
+---@param col integer
+---
+---@return integer offset
+function textbuffer.buffer:get_offset(line, col) end
+
+---
+---Get the position of the byte at an offset, which is clamped to the text.
+---
+---@param offset integer
+---
+---@return integer line
+---@return integer col
+function textbuffer.buffer:get_position(offset) end
+
+---
+---Get the text between two positions, the last one being excluded.
+---
+---@param line1 integer
+---@param col1 integer
+---@param line2 integer
+---@param col2 integer
+---
+---@return string
+function textbuffer.buffer:get_text(line1, col1, line2, col2) end
+
+---
+---Replace ranges of text in a single pass, the edits being a flat list of
+---`line1, col1, line2, col2, text` sorted by position. The edits on the same
+---lines are applied together, so each group of lines is only replaced once.
+---Errors if an edit starts before the previous one, a range starting inside
+---the previous one starts at its end instead.
+---
+---The positions of the flat list of `line, col` in `positions`, like the
+---selections of a document, are moved in place: those in a replaced range go
+---to the start of its new text, the others follow the text around them.
+---
+---@param edits (integer|string)[]
+---@param positions? integer[]
+---
+---@return string[] removed The text replaced by each edit.
+---@return integer[] ranges The positions of the new texts, four per edit.
+---@return integer[] runs The first line, old and new line count of each group
+---of lines replaced, which are applied from the top.
+function textbuffer.buffer:apply_edits(edits, positions) end
+
+---
+---Find the lines that differ from those of another buffer, which is waited
+---for if it's still loading. The lines are compared without their line
+---ending, and the hunks are a flat list of `line, count, other_line,
+---other_count`, the lines replaced in this buffer and their replacement in
+---the other one.
+---
+---The diff is the shortest one, unless finding it takes too long, in which
+---case the rest of the lines are left in large hunks.
+---
+---@param other textbuffer.buffer
+---
+---@return integer[] hunks
+function textbuffer.buffer:diff(other) end
+
+---
+---Get the size of the text of the buffer in bytes.
+---
+---@return integer
+function textbuffer.buffer:get_size() end
+
+---
+---Copy the text of a mapped file in memory, so that the file can be written.
+---Waits for all the lines to be found. Does nothing if no file is mapped.
+function textbuffer.buffer:detach() end
+
+---
+---Write the lines to a file from a background thread, with CRLF line endings
+---if `crlf` is true. The lines are written to a temporary file that replaces
+---the file once complete, or to the file itself if no file can be created in
+---its directory. The buffer can be edited while it's saved, the file will
+---contain the lines it had when this was called.
+---
+---If `id` is given, a "saved" event is sent with it once the save is done.
+---
+---@param path string
+---@param crlf? boolean
+---@param id? integer
+---
+---@return textbuffer.save? save
+---@return string? errmsg
+function textbuffer.buffer:save(path, crlf, id) end
+
+---
+---A save started with `buffer:save`.
+---@class textbuffer.save
+textbuffer.save = {}
+
+---
+---Wait for the file to be written.
+---
+---@return boolean? ok
+---@return string? errmsg
+function textbuffer.save:wait() end
+
+
+return textbuffer
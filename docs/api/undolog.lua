@@ -0,0 +1,81 @@
+---@meta
+
+---
+---Native undo and redo stacks, used by core.doc.
+---@class undolog
+undolog = {}
+
+---
+---A stack of undo records stored compactly in a single block of memory.
+---
+---Selections pushed within the merge timeout of the previous record are not
+---stored, as only the oldest selection of records undone together is
+---restored. The oldest records are forgotten when the limits are exceeded.
+---@class undolog.log
+undolog.log = {}
+
+---@alias undolog.type
+---| "insert"
+---| "remove"
+---| "selection"
+---| "edits"
+
+---
+---Create an empty log without limits.
+---
+---@return undolog.log
+function undolog.new() end
+
+---
+---Set the maximum number of records, the maximum bytes they use and the
+---timeout within which selections are merged with the previous record.
+---
+---@param max_count? number
+---@param max_bytes? number
+---@param merge_timeout? number
+function undolog.log:set_limits(max_count, max_bytes, merge_timeout) end
+
+---
+---Push a record: `"insert"` takes a line, a column and the text to insert,
+---`"remove"` the start and end positions of the text to remove,
+---`"selection"` a flat table of positions and `"edits"` a flat table of
+---`line1, col1, line2, col2, text` like `buffer:apply_edits`.
+---
+---@param type undolog.type
+---@param time number
+---@param ... any
+function undolog.log:push(type, time, ...) end
+
+---
+---Pop the last record, returning its type, time and the values it was pushed
+---with. Returns nothing if the log is empty.
+---
+---@return undolog.type? type
+---@return number? time
+---@return any ...
+function undolog.log:pop() end
+
+---
+---Get the type and time of the last record, without popping it.
+---
+---@return undolog.type? type
+---@return number? time
+function undolog.log:peek() end
+
+---
+---Remove all the records.
+function undolog.log:clear() end
+
+---
+---Get an identifier of the document state, incremented by each edit pushed
+---and decremented by each edit popped.
+---
+---@return integer
+function undolog.log:get_change_id() end
+
+---
+---Get the bytes used by the records, and the bytes allocated.
+---
+---@return integer used
+---@return integer allocated
+function undolog.log:get_memory() end
@@ -0,0 +1,420 @@
+-- Headless benchmark of core.tokenizer and core.doc.highlighter.
+--
+-- It replaces the editor as the runtime of the lite-xl executable, so that
+-- the native tokenizer is available, but no window is created:
+--
+--   LITE_USERDIR=scripts/tokenizer-benchmark LITE_XL_RUNTIME=tokenizer-benchmark \
+--     lite-xl [--output=results.json] [--filter=pattern] [--repeat=3] [--lines=20000]
+--
+-- The corpus is made of the sources of this repository for each language,
+-- and of sources generated from a fixed seed, so that runs can be compared.
+local core = require "core"
+local common = require "core.common"
+local config = require "core.config"
+local syntax = require "core.syntax"
+local tokenizer = require "core.tokenizer"
+local Highlighter = require "core.doc.highlighter"
+
+local benchmark = {}
+
+local languages = { "c", "cpp", "css", "html", "js", "lua", "md", "python", "xml" }
+
+-- checked-in sources of each language, relative to the repository root
+local checked_in = {
+  c = { "src", "%.[ch]$" },
+  cpp = { "src", "%.cpp$" },
+  html = { "resources", "%.html$" },
+  js = { ".", "%.json$" },
+  lua = { "data", "%.lua$" },
+  md = { ".", "%.md$" },
+  python = { "resources", "%.py$" },
+  xml = { "resources", "%.svg$" },
+}
+
+local extensions = {
+  c = ".c", cpp = ".cpp", css = ".css", html = ".html", js = ".js",
+  lua = ".lua", md = ".md", python = ".py", xml = ".xml"
+}
+
+-- lines used to generate the sources of each language, "$id", "$num" and
+-- "$str" are replaced with random identifiers, numbers and words
+local snippets = {
+  c = {
+    "#include <$id.h>", "static int $id(const char *$id, size_t $id) {",
+    "  for (int i = 0; i < $num; i++) $id[i] = $id(i, $num);",
+    "  if ($id && $id->$id != NULL) return $id($id, \"$str\");",
+    "  /* $str $str $str */", "  // $str $str", "  $id = ($id_t *) malloc($num * sizeof(*$id));",
+    "#define $id($id) (($id) * $num)", "}", "  switch ($id) { case $num: break; default: return -1; }",
+    "  printf(\"%d %s\\n\", $id, \"$str\");", "typedef struct { int $id; float $id; } $id_t;",
+  },
+  cpp = {
+    "#include <$id>", "namespace $id {", "template <typename T> class $id : public $id<T> {",
+    "  std::vector<std::string> $id = { \"$str\", \"$str\" };", "  auto $id = [&](int $id) { return $id * $num; };",
+    "  virtual ~$id() override = default;", "  // $str $str", "  /* $str */", "};", "}",
+    "  if (auto $id = $id.find($num); $id != $id.end()) { $id->second++; }",
+    "  static constexpr double $id = $num.5e-3;",
+  },
+  css = {
+    ".$id > .$id:hover, #$id {", "  color: #$numabc;", "  margin: $numpx $numem 0 auto;",
+    "  font-family: \"$str\", sans-serif;", "  background: url(\"$str.png\") no-repeat;",
+    "}", "/* $str $str */", "@media (max-width: $numpx) {", "  transition: all .$nums ease-in-out;",
+    "  --$id: calc($num% - $numpx);",
+  },
+  html = {
+    "<div class=\"$id\" id=\"$id\">", "  <p>$str $str <b>$str</b> $str</p>", "</div>",
+    "<a href=\"https://$id.org/$id\" title='$str'>$str</a>", "<!-- $str $str -->",
+    "<input type=\"text\" name=\"$id\" value=\"$num\" disabled>", "<ul><li>$str</li><li>$str</li></ul>",
+    "<script>var $id = $num; function $id() { return \"$str\"; }</script>",
+    "<style>.$id { color: red; margin: $numpx; }</style>", "<img src=\"$id.png\" alt=\"$str\" />",
+  },
+  js = {
+    "const $id = require(\"$str\");", "function $id($id, $id) {", "  return $id.map(($id) => $id * $num);",
+    "  let $id = `$str ${$id} $str`;", "  if ($id === null || $id !== undefined) throw new Error('$str');",
+    "  // $str $str", "  /* $str */", "}", "export default class $id extends $id {",
+    "  const $id = /[a-z]+$num/g.test(\"$str\");", "  $id.$id = { $id: $num, $id: \"$str\", $id: [1, 2, $num] };",
+    "  async $id() { await $id.$id(0x$numff); }",
+  },
+  lua = {
+    "local $id = require \"$str\"", "function $id.$id($id, ...)", "  for i, $id in ipairs($id) do",
+    "  if $id == nil or $id.$id ~= $num then", "    return $id:$id(\"$str\", '$str')", "  end", "end",
+    "  -- $str $str", "  --[[ $str ]]", "  local $id = { $id = $num, [\"$str\"] = true }",
+    "  $id = $id .. [[$str]] .. #$id", "  while $id < $num.5 do $id = $id + 1 end",
+  },
+  md = {
+    "# $str $str", "## $str", "$str *$str* **$str** $str `$id` $str.", "- $str [$str](https://$id.org)",
+    "1. $str $str", "> $str $str", "```lua", "local $id = $num", "```", "```html",
+    "<div class=\"$id\"><script>var $id = $num;</script><style>.$id { margin: $numpx; }</style></div>",
+    "| $str | $str |", "$str ___$str___ _$str_ $str",
+  },
+  python = {
+    "import $id", "from $id import $id, $id", "class $id($id):", "    def $id(self, $id, *args, **kwargs):",
+    "        return [$id for $id in $id if $id > $num]", "        # $str $str", "        \"\"\"$str $str\"\"\"",
+    "        $id = f\"$str {$id} $str\"", "    @property", "        raise ValueError('$str')",
+    "        with open(\"$str\") as $id: pass", "        $id = {'$id': $num, \"$id\": None}",
+  },
+  xml = {
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>", "<$id $id=\"$str\" $id='$num'>", "</$id>",
+    "  <$id>$str $str</$id>", "  <!-- $str $str -->", "  <![CDATA[ $str < $str ]]>",
+    "  <$id:$id xmlns:$id=\"http://$id.org/$id\"/>", "  <$id attr=\"&amp;$str&lt;\">$num</$id>",
+  },
+}
+
+-- markers of line comments, generated long lines can't have them
+local line_comments = {
+  c = "//", cpp = "//", js = "//", lua = "%-%-", md = "```", python = "#", css = "/%*", html = "<!%-%-"
+}
+
+local seed = 1
+local function random(n)
+  seed = (seed * 1103515245 + 12345) % 2147483648
+  return seed // 65536 % n + 1
+end
+
+local words = { "alpha", "beta", "gamma", "delta", "value", "item", "count", "name", "data", "node" }
+
+local function random_line(language)
+  local line = snippets[language][random(#snippets[language])]
+  return (line:gsub("%$(%a+)", function(kind)
+    if kind == "id" then
+      return words[random(#words)] .. random(100)
+    elseif kind == "num" then
+      return tostring(random(10000))
+    elseif kind == "str" then
+      return words[random(#words)]
+    end
+  end))
+end
+
+local function generate_lines(language, n)
+  seed = #language
+  local lines = {}
+  for i = 1, n do
+    lines[i] = string.rep("  ", random(4) - 1) .. random_line(language)
+  end
+  return lines
+end
+
+-- lines of about `line_size` bytes, like minified sources
+local function generate_long_lines(language, n, line_size)
+  seed = #language + 100
+  local lines, parts, size = {}, {}, 0
+  while #lines < n do
+    local line = random_line(language)
+    if not line:find(line_comments[language] or "\0") then
+      table.insert(parts, line)
+      size = size + #line + 1
+      if size >= line_size then
+        table.insert(lines, table.concat(parts, " "))
+        parts, size = {}, 0
+      end
+    end
+  end
+  return lines
+end
+
+-- unterminated delimiters, long runs of escapes, words and whitespace
+local function generate_pathological_lines(n)
+  seed = 7
+  local openers = { '"', "'", "`", "/*", "--[[", "<!--", '"""', "```", "<![CDATA[", "${", "[[" }
+  local lines = {}
+  for i = 1, n do
+    local kind = random(6)
+    if kind == 1 then
+      lines[i] = openers[random(#openers)] .. string.rep("x ", random(1000))
+    elseif kind == 2 then
+      lines[i] = '"' .. string.rep("\\", random(1000)) .. '"'
+    elseif kind == 3 then
+      lines[i] = string.rep("a", random(4000))
+    elseif kind == 4 then
+      lines[i] = string.rep(" ", random(2000)) .. "x = 1"
+    elseif kind == 5 then
+      local depth = random(500)
+      lines[i] = string.rep("(", depth) .. string.rep("[{", depth) .. string.rep(")", depth)
+    else
+      local parts = {}
+      for j = 1, random(200) do parts[j] = openers[random(#openers)] end
+      lines[i] = table.concat(parts, " ")
+    end
+  end
+  return lines
+end
+
+-- markdown with HTML blocks embedding scripts and styles
+local function generate_nested_lines(n)
+  seed = 11
+  local lines = {}
+  while #lines < n do
+    table.insert(lines, "## " .. random_line("md"))
+    table.insert(lines, "```html")
+    for _ = 1, random(5) do table.insert(lines, random_line("html")) end
+    table.insert(lines, "<script>")
+    for _ = 1, random(10) do table.insert(lines, random_line("js")) end
+    table.insert(lines, "</script>")
+    table.insert(lines, "<style>")
+    for _ = 1, random(10) do table.insert(lines, random_line("css")) end
+    table.insert(lines, "</style>")
+    table.insert(lines, "```")
+  end
+  return lines
+end
+
+local function find_files(dir, pattern, files)
+  for _, name in ipairs(system.list_dir(dir) or {}) do
+    local path = dir .. PATHSEP .. name
+    local info = system.get_file_info(path)
+    if info and info.type == "dir" and not name:match("^[%._]") and name ~= "subprojects" then
+      find_files(path, pattern, files)
+    elseif info and info.type == "file" and name:find(pattern) then
+      table.insert(files, path)
+    end
+  end
+  return files
+end
+
+local function read_lines(files)
+  local lines = {}
+  table.sort(files)
+  for _, path in ipairs(files) do
+    local fp = io.open(path, "rb")
+    if fp then
+      for line in fp:lines() do
+        table.insert(lines, line:gsub("\r$", "") .. "\n")
+      end
+      fp:close()
+    end
+  end
+  return lines
+end
+
+local function add_newlines(lines)
+  for i, line in ipairs(lines) do lines[i] = line .. "\n" end
+  return lines
+end
+
+local function get_scenarios(root, nlines)
+  local scenarios = {}
+  local function add(name, language, lines)
+    if #lines > 0 then
+      table.insert(scenarios, { name = name, language = language, lines = lines })
+    end
+  end
+  for _, language in ipairs(languages) do
+    local source = checked_in[language]
+    if source then
+      add(language .. "/checked-in", language,
+        read_lines(find_files(root .. PATHSEP .. source[1], source[2], {})))
+    end
+    add(language .. "/generated", language, add_newlines(generate_lines(language, nlines)))
+    add(language .. "/long-lines", language, add_newlines(generate_long_lines(language, 4, 256 * 1024)))
+    add(language .. "/pathological", language, add_newlines(generate_pathological_lines(nlines // 10)))
+  end
+  add("nested/md-html-js-css", "md", add_newlines(generate_nested_lines(nlines)))
+  return scenarios
+end
+
+
+local function tokenize_all(syn, lines, sample)
+  local state
+  for i, text in ipairs(lines) do
+    local _, new_state, resume = tokenizer.tokenize(syn, text, state, nil, true)
+    while resume do
+      _, new_state, resume = tokenizer.tokenize(syn, text, state, resume, true)
+    end
+    state = new_state
+    if i % 64 == 0 then sample() end
+  end
+end
+
+-- runs the highlighting threads and delivers the results of the background
+-- jobs until the whole document is highlighted
+local function highlight_all(syn, lines, sample)
+  local doc = { lines = lines, syntax = syn, get_name = function() return "benchmark" end }
+  local highlighter = Highlighter(doc)
+  highlighter:get_line(#lines)
+  while highlighter.first_invalid_line <= #lines do
+    core.frame_start = system.get_time()
+    for key, thread in pairs(core.threads) do
+      assert(coroutine.resume(thread.cr))
+      if coroutine.status(thread.cr) == "dead" then core.threads[key] = nil end
+    end
+    for type, id in system.poll_event do
+      if type == "tokenized" and core.active_tokenizer_jobs[id] then
+        core.active_tokenizer_jobs[id]()
+      end
+    end
+    sample()
+    if highlighter.job_id then system.wait_event(0.001) end
+  end
+  highlighter:soft_reset()
+  core.threads = setmetatable({}, { __mode = "k" })
+end
+
+local modes = {
+  { name = "native", native = true, run = tokenize_all },
+  { name = "lua", native = false, run = tokenize_all },
+  { name = "highlighter", native = true, run = highlight_all },
+}
+
+local function measure(scenario, mode, repeats)
+  local syn = syntax.get("benchmark" .. extensions[scenario.language])
+  config.native_tokenizer = mode.native
+  local bytes = 0
+  for _, line in ipairs(scenario.lines) do bytes = bytes + #line end
+
+  -- Lua heap allocated by a run, with the collector stopped
+  collectgarbage("collect")
+  collectgarbage("stop")
+  local before = collectgarbage("count")
+  mode.run(syn, scenario.lines, function() end)
+  local allocated = (collectgarbage("count") - before) * 1024
+  collectgarbage("restart")
+
+  local best, peak = math.huge, 0
+  local function sample() peak = math.max(peak, collectgarbage("count")) end
+  for _ = 1, repeats do
+    collectgarbage("collect")
+    local start = system.get_time()
+    mode.run(syn, scenario.lines, sample)
+    best = math.min(best, system.get_time() - start)
+    sample()
+  end
+  return {
+    scenario = scenario.name,
+    language = scenario.language,
+    mode = mode.name,
+    lines = #scenario.lines,
+    bytes = bytes,
+    seconds = best,
+    lines_per_second = #scenario.lines / best,
+    bytes_per_second = bytes / best,
+    allocated_bytes = math.floor(allocated),
+    peak_heap_bytes = math.floor(peak * 1024),
+  }
+end
+
+
+local function encode_json(value, indent)
+  indent = indent or ""
+  local t = type(value)
+  if t == "table" then
+    local inner, parts = indent .. "  ", {}
+    if #value > 0 then
+      for _, v in ipairs(value) do
+        table.insert(parts, inner .. encode_json(v, inner))
+      end
+      return "[\n" .. table.concat(parts, ",\n") .. "\n" .. indent .. "]"
+    end
+    local keys = {}
+    for k in pairs(value) do table.insert(keys, k) end
+    table.sort(keys)
+    for _, k in ipairs(keys) do
+      table.insert(parts, inner .. encode_json(k) .. ": " .. encode_json(value[k], inner))
+    end
+    return "{\n" .. table.concat(parts, ",\n") .. "\n" .. indent .. "}"
+  elseif t == "string" then
+    return '"' .. value:gsub('[%c"\\]', function(c)
+      return string.format("\\u%04x", c:byte())
+    end) .. '"'
+  elseif t == "number" then
+    return math.type(value) == "integer" and tostring(value) or string.format("%.6g", value)
+  end
+  return tostring(value)
+end
+
+local function parse_args()
+  local options = { ["repeat"] = "3", lines = "20000", filter = "" }
+  for i = 2, #ARGS do
+    local key, value = ARGS[i]:match("^%-%-([%w%-]+)=(.*)$")
+    if not key then
+      error(string.format("unknown argument %q, expected --option=value", ARGS[i]))
+    end
+    options[key] = value
+  end
+  return options
+end
+
+
+function benchmark.init()
+  core.frame_start = 0
+  core.threads = setmetatable({}, { __mode = "k" })
+  core.active_tokenizer_jobs = {}
+  core.log_items = {}
+  for _, language in ipairs(languages) do
+    require("plugins.language_" .. language)
+  end
+end
+
+function benchmark.run()
+  local options = parse_args()
+  local script_dir = debug.getinfo(1, "S").source:match("^@(.*)[/\\]") or "."
+  local root = options.root or (script_dir .. PATHSEP .. ".." .. PATHSEP .. "..")
+  local results = {}
+  for _, scenario in ipairs(get_scenarios(root, tonumber(options.lines))) do
+    if scenario.name:find(options.filter) then
+      for _, mode in ipairs(modes) do
+        local result = measure(scenario, mode, tonumber(options["repeat"]))
+        table.insert(results, result)
+        print(string.format("%-28s %-12s %10.0f lines/s %8.2f MB/s %10d KB allocated",
+          result.scenario, result.mode, result.lines_per_second,
+          result.bytes_per_second / 1e6, result.allocated_bytes // 1024))
+      end
+    end
+  end
+
+  if options.output then
+    local fp = assert(io.open(options.output, "wb"))
+    fp:write(encode_json({
+      version = VERSION,
+      date = os.date("!%Y-%m-%dT%H:%M:%SZ"),
+      platform = PLATFORM,
+      arch = ARCH,
+      workers = tokenizer.get_worker_count(),
+      options = options,
+      results = results,
+    }), "\n")
+    fp:close()
+  end
+  os.exit(0)
+end
+
+return benchmark
@@ -7,15 +7,23 @@ int luaopen_regex(lua_State *L);
 int luaopen_process(lua_State *L);
 int luaopen_dirmonitor(lua_State* L);
 int luaopen_utf8extra(lua_State* L);
+int luaopen_native_tokenizer(lua_State* L);
+int luaopen_textbuffer(lua_State* L);
+int luaopen_undolog(lua_State* L);
+int luaopen_segarray(lua_State* L);
 
 static const luaL_Reg libs[] = {
-  { "system",     luaopen_system     },
-  { "renderer",   luaopen_renderer   },
-  { "renwindow",  luaopen_renwindow  },
-  { "regex",      luaopen_regex      },
-  { "process",    luaopen_process    },
-  { "dirmonitor", luaopen_dirmonitor },
-  { "utf8extra",  luaopen_utf8extra  },
+  { "system",           luaopen_system           },
+  { "renderer",         luaopen_renderer         },
+  { "renwindow",        luaopen_renwindow        },
+  { "regex",            luaopen_regex            },
+  { "process",          luaopen_process          },
+  { "dirmonitor",       luaopen_dirmonitor       },
+  { "utf8extra",        luaopen_utf8extra        },
+  { "native_tokenizer", luaopen_native_tokenizer },
+  { "textbuffer",       luaopen_textbuffer       },
+  { "undolog",          luaopen_undolog          },
+  { "segarray",         luaopen_segarray         },
   { NULL, NULL }
 };
 
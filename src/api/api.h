@@ -6,10 +6,18 @@
 #include <lualib.h>
 
 #define API_TYPE_FONT "Font"
+#define API_TYPE_IMAGE "Image"
 #define API_TYPE_PROCESS "Process"
 #define API_TYPE_DIRMONITOR "Dirmonitor"
 #define API_TYPE_NATIVE_PLUGIN "NativePlugin"
 #define API_TYPE_RENWINDOW "RenWindow"
+#define API_TYPE_NATIVE_SYNTAX "NativeSyntax"
+#define API_TYPE_TOKENIZER_JOB "TokenizerJob"
+#define API_TYPE_TOKEN_LIST "TokenList"
+#define API_TYPE_TEXT_BUFFER "TextBuffer"
+#define API_TYPE_TEXT_BUFFER_SAVE "TextBufferSave"
+#define API_TYPE_UNDO_LOG "UndoLog"
+#define API_TYPE_SEG_ARRAY "SegArray"
 
 #define API_CONSTANT_DEFINE(L, idx, key, n) (lua_pushnumber(L, n), lua_setfield(L, idx - 1, key))
 
@@ -382,5 +382,7 @@ int luaopen_regex(lua_State *L) {
   lua_setfield(L, -2, "NOTEMPTY");
   lua_pushinteger(L, PCRE2_NOTEMPTY_ATSTART);
   lua_setfield(L, -2, "NOTEMPTY_ATSTART");
+  lua_pushinteger(L, PCRE2_NO_UTF_CHECK);
+  lua_setfield(L, -2, "NO_UTF_CHECK");
   return 1;
 }
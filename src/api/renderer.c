@@ -9,7 +9,7 @@
 #endif
 #include "lua.h"
 
-// a reference index to a table that stores the fonts
+// a reference index to a table that stores the fonts and images used in the current frame
 static int RENDERER_FONT_REF = LUA_NOREF;
 
 static int font_get_options(
@@ -227,6 +227,16 @@ static int f_font_get_width(lua_State *L) {
   return 1;
 }
 
+static int f_font_get_monospace_width(lua_State *L) {
+  RenFont* fonts[FONT_FALLBACK_MAX]; font_retrieve(L, fonts, 1);
+  float width = ren_font_group_get_monospace_width(fonts);
+  if (width > 0)
+    lua_pushnumber(L, width);
+  else
+    lua_pushnil(L);
+  return 1;
+}
+
 static int f_font_get_height(lua_State *L) {
   RenFont* fonts[FONT_FALLBACK_MAX]; font_retrieve(L, fonts, 1);
   lua_pushnumber(L, ren_font_group_get_height(fonts));
@@ -299,6 +309,182 @@ static RenColor checkcolor(lua_State *L, int idx, int def) {
 }
 
 
+static int f_image_new(lua_State *L) {
+  int width = luaL_checkinteger(L, 1);
+  int height = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, width > 0, 1, "width must be positive");
+  luaL_argcheck(L, height > 0, 2, "height must be positive");
+  RenImage **image = lua_newuserdata(L, sizeof(RenImage*));
+  *image = ren_image_new(width, height);
+  if (!*image)
+    return luaL_error(L, "failed to create image: %s", SDL_GetError());
+  luaL_setmetatable(L, API_TYPE_IMAGE);
+  return 1;
+}
+
+static int f_image_gc(lua_State *L) {
+  RenImage **self = luaL_checkudata(L, 1, API_TYPE_IMAGE);
+  if (*self) ren_image_free(*self);
+  *self = NULL;
+  return 0;
+}
+
+static int f_image_get_size(lua_State *L) {
+  RenImage *image = *(RenImage**)luaL_checkudata(L, 1, API_TYPE_IMAGE);
+  int w, h;
+  ren_image_get_size(image, &w, &h);
+  lua_pushinteger(L, w);
+  lua_pushinteger(L, h);
+  return 2;
+}
+
+static RenRect checkimagerect(lua_State *L, RenImage *image, int idx) {
+  int w, h;
+  ren_image_get_size(image, &w, &h);
+  RenRect rect;
+  rect.x = luaL_optinteger(L, idx, 0);
+  rect.y = luaL_optinteger(L, idx + 1, 0);
+  rect.width = luaL_optinteger(L, idx + 2, w - rect.x);
+  rect.height = luaL_optinteger(L, idx + 3, h - rect.y);
+  return rect;
+}
+
+static int f_image_set_pixels(lua_State *L) {
+  RenImage *image = *(RenImage**)luaL_checkudata(L, 1, API_TYPE_IMAGE);
+  size_t len;
+  const char *pixels = luaL_checklstring(L, 2, &len);
+  RenRect rect = checkimagerect(L, image, 3);
+  if (rect.width <= 0 || rect.height <= 0) return 0;
+  luaL_argcheck(L, len >= (size_t) rect.width * rect.height * 4, 2, "not enough pixel data for the given size");
+  ren_image_set_pixels(image, rect, (const uint8_t *) pixels, rect.width * 4);
+  return 0;
+}
+
+static int f_image_fill_rect(lua_State *L) {
+  RenImage *image = *(RenImage**)luaL_checkudata(L, 1, API_TYPE_IMAGE);
+  RenRect rect = checkimagerect(L, image, 2);
+  RenColor color = checkcolor(L, 6, 0);
+  ren_image_fill_rect(image, rect, color);
+  return 0;
+}
+
+
+static int f_image_move_rows(lua_State *L) {
+  RenImage *image = *(RenImage**)luaL_checkudata(L, 1, API_TYPE_IMAGE);
+  int src_y = luaL_checkinteger(L, 2);
+  int dst_y = luaL_checkinteger(L, 3);
+  int count = luaL_checkinteger(L, 4);
+  ren_image_move_rows(image, src_y, dst_y, count);
+  return 0;
+}
+
+#define CODE_COLOR_CACHE_SIZE 32
+
+typedef struct {
+  const char *type;
+  uint32_t pixel;
+} CodeColor;
+
+static uint32_t code_get_color(lua_State *L, RenImage *image, int colors_idx, const char *type, CodeColor *cache, int *cache_len) {
+  // token types are short strings, so the same type always has the same pointer
+  for (int i = 0; i < *cache_len; i++) {
+    if (cache[i].type == type) return cache[i].pixel;
+  }
+  RenColor color = { 0 };
+  if (lua_getfield(L, colors_idx, type) != LUA_TTABLE) {
+    lua_pop(L, 1);
+    lua_getfield(L, colors_idx, "normal");
+  }
+  if (lua_istable(L, -1))
+    color = checkcolor(L, lua_absindex(L, -1), 0);
+  lua_pop(L, 1);
+  uint32_t pixel = ren_image_map_color(image, color);
+  if (*cache_len < CODE_COLOR_CACHE_SIZE)
+    cache[(*cache_len)++] = (CodeColor) { type, pixel };
+  return pixel;
+}
+
+// Rasterizes highlighted lines into a downsampled "code shape": every
+// non-whitespace character becomes a char_width x char_height block colored
+// after its token type. Each line is given as an array of alternating
+// type/text tokens, or anything indexable like one such as the packed tokens
+// of the native tokenizer, and covers line_height rows starting at y.
+static int f_image_draw_code(lua_State *L) {
+  RenImage *image = *(RenImage**)luaL_checkudata(L, 1, API_TYPE_IMAGE);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  int y = luaL_checkinteger(L, 3);
+  luaL_checktype(L, 4, LUA_TTABLE);
+  double char_width = 1;
+  int line_height = 2, char_height = 1, tab_width = 4;
+  if (lua_istable(L, 5)) {
+    lua_getfield(L, 5, "char_width");
+    char_width = luaL_optnumber(L, -1, char_width);
+    lua_getfield(L, 5, "line_height");
+    line_height = luaL_optinteger(L, -1, line_height);
+    lua_getfield(L, 5, "char_height");
+    char_height = luaL_optinteger(L, -1, line_height > 1 ? line_height - 1 : 1);
+    lua_getfield(L, 5, "tab_width");
+    tab_width = luaL_optinteger(L, -1, tab_width);
+    lua_pop(L, 4);
+  }
+  luaL_argcheck(L, char_width > 0 && line_height > 0 && tab_width > 0, 5, "invalid options");
+  char_height = char_height < 1 ? 1 : (char_height > line_height ? line_height : char_height);
+
+  CodeColor cache[CODE_COLOR_CACHE_SIZE];
+  int cache_len = 0;
+  int width, height, pitch;
+  ren_image_get_size(image, &width, &height);
+  uint32_t *pixels = ren_image_lock_pixels(image, &pitch);
+  int nlines = luaL_len(L, 2);
+  ren_image_unlock_pixels(image, y, nlines * line_height);
+  for (int i = 1; i <= nlines; i++, y += line_height) {
+    if (y + line_height <= 0) continue;
+    if (y >= height) break;
+    for (int row = SDL_max(y, 0); row < SDL_min(y + line_height, height); row++)
+      memset(&pixels[row * pitch], 0, width * sizeof(uint32_t));
+    int line_type = lua_rawgeti(L, 2, i);
+    if (line_type != LUA_TTABLE && line_type != LUA_TUSERDATA) {
+      lua_pop(L, 1);
+      continue;
+    }
+    int ntokens = luaL_len(L, -1);
+    size_t col = 0;
+    for (int t = 1; t < ntokens; t += 2) {
+      lua_geti(L, -1, t);
+      lua_geti(L, -2, t + 1);
+      const char *type = lua_tostring(L, -2);
+      size_t len = 0;
+      const char *text = lua_tolstring(L, -1, &len);
+      if (!type || !text) {
+        lua_pop(L, 2);
+        continue;
+      }
+      uint32_t pixel = code_get_color(L, image, 4, type, cache, &cache_len);
+      for (size_t j = 0; j < len && col * char_width < width; j++) {
+        unsigned char c = text[j];
+        if ((c & 0xC0) == 0x80) continue; // utf-8 continuation byte
+        if (c == '\t') {
+          col = (col / tab_width + 1) * tab_width;
+          continue;
+        }
+        if (c != ' ' && c != '\n' && c != '\r') {
+          int x1 = col * char_width, x2 = (col + 1) * char_width;
+          if (x2 <= x1) x2 = x1 + 1;
+          if (x2 > width) x2 = width;
+          for (int row = SDL_max(y, 0); row < SDL_min(y + char_height, height); row++) {
+            for (int x = x1; x < x2; x++)
+              pixels[row * pitch + x] = pixel;
+          }
+        }
+        col++;
+      }
+      lua_pop(L, 2);
+    }
+    lua_pop(L, 1);
+  }
+  return 0;
+}
+
 static int f_show_debug(lua_State *L) {
   luaL_checkany(L, 1);
   rencache_show_debug(lua_toboolean(L, 1));
@@ -394,6 +580,32 @@ static int f_draw_text(lua_State *L) {
   return 1;
 }
 
+static int f_draw_image(lua_State *L) {
+  RenImage *image = *(RenImage**)luaL_checkudata(L, 1, API_TYPE_IMAGE);
+
+  // stores a reference to this image to the reference table
+  lua_rawgeti(L, LUA_REGISTRYINDEX, RENDERER_FONT_REF);
+  if (lua_istable(L, -1))
+  {
+    lua_pushvalue(L, 1);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, -3);
+  } else {
+    fprintf(stderr, "warning: failed to reference count images\n");
+  }
+  lua_pop(L, 1);
+
+  int w, h;
+  ren_image_get_size(image, &w, &h);
+  lua_Number x = luaL_checknumber(L, 2);
+  lua_Number y = luaL_checknumber(L, 3);
+  lua_Number dw = luaL_optnumber(L, 4, w);
+  lua_Number dh = luaL_optnumber(L, 5, h);
+  RenRect src = checkimagerect(L, image, 6);
+  rencache_draw_image(ren_get_target_window(), image, src, rect_to_grid(x, y, dw, dh));
+  return 0;
+}
+
 static const luaL_Reg lib[] = {
   { "show_debug",         f_show_debug         },
   { "get_size",           f_get_size           },
@@ -402,20 +614,33 @@ static const luaL_Reg lib[] = {
   { "set_clip_rect",      f_set_clip_rect      },
   { "draw_rect",          f_draw_rect          },
   { "draw_text",          f_draw_text          },
+  { "draw_image",         f_draw_image         },
   { NULL,                 NULL                 }
 };
 
 static const luaL_Reg fontLib[] = {
-  { "__gc",               f_font_gc                 },
-  { "load",               f_font_load               },
-  { "copy",               f_font_copy               },
-  { "group",              f_font_group              },
-  { "set_tab_size",       f_font_set_tab_size       },
-  { "get_width",          f_font_get_width          },
-  { "get_height",         f_font_get_height         },
-  { "get_size",           f_font_get_size           },
-  { "set_size",           f_font_set_size           },
-  { "get_path",           f_font_get_path           },
+  { "__gc",                f_font_gc                  },
+  { "load",                f_font_load                },
+  { "copy",                f_font_copy                },
+  { "group",               f_font_group               },
+  { "set_tab_size",        f_font_set_tab_size        },
+  { "get_width",           f_font_get_width           },
+  { "get_monospace_width", f_font_get_monospace_width },
+  { "get_height",          f_font_get_height          },
+  { "get_size",            f_font_get_size            },
+  { "set_size",            f_font_set_size            },
+  { "get_path",            f_font_get_path            },
+  { NULL, NULL }
+};
+
+static const luaL_Reg imageLib[] = {
+  { "__gc",               f_image_gc                },
+  { "new",                f_image_new               },
+  { "get_size",           f_image_get_size          },
+  { "set_pixels",         f_image_set_pixels        },
+  { "fill_rect",          f_image_fill_rect         },
+  { "move_rows",          f_image_move_rows         },
+  { "draw_code",          f_image_draw_code         },
   { NULL, NULL }
 };
 
@@ -430,5 +655,10 @@ int luaopen_renderer(lua_State *L) {
   lua_pushvalue(L, -1);
   lua_setfield(L, -2, "__index");
   lua_setfield(L, -2, "font");
+  luaL_newmetatable(L, API_TYPE_IMAGE);
+  luaL_setfuncs(L, imageLib, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  lua_setfield(L, -2, "image");
   return 1;
 }
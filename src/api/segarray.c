@@ -0,0 +1,458 @@
+#include "api.h"
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Arrays of values kept for each line of a document.
+ *
+ * The elements are stored in blocks of at most BLOCK_SIZE, found by a binary
+ * search on the index of the first element of each block, so inserting or
+ * removing elements only moves the elements of the blocks edited and the
+ * indexes of the blocks after them, instead of the whole tail of the array.
+ *
+ * Blocks hold references to the values, which are kept in a table in the
+ * uservalue of the array. nil, false and true are stored in the references
+ * themselves, as lines are usually reset to one of them. */
+
+#define BLOCK_SIZE 512
+
+#define REF_NIL 0
+#define REF_FALSE 1
+#define REF_TRUE 2
+#define FIRST_REF 3
+
+typedef struct {
+  int n;
+  uint32_t refs[BLOCK_SIZE];
+} Block;
+
+typedef struct {
+  Block **blocks;
+  size_t *starts; /* index of the first element of each block, and the length */
+  size_t nblocks, blocks_capacity;
+  size_t last_block; /* block of the last element accessed */
+  uint32_t *free_refs;
+  size_t nfree, free_capacity;
+  uint32_t next_ref;
+} SegArray;
+
+
+static bool grow(void **ptr, size_t *capacity, size_t needed, size_t size) {
+  if (needed <= *capacity) return true;
+  size_t capacity2 = *capacity ? *capacity : 16;
+  while (capacity2 < needed) capacity2 *= 2;
+  void *ptr2 = realloc(*ptr, capacity2 * size);
+  if (!ptr2) return false;
+  *ptr = ptr2;
+  *capacity = capacity2;
+  return true;
+}
+
+static size_t get_length(SegArray *A) {
+  return A->nblocks ? A->starts[A->nblocks] : 0;
+}
+
+/* the block of the element `i`, which must be in the array */
+static size_t find_block(SegArray *A, size_t i) {
+  size_t b = A->last_block;
+  if (b < A->nblocks && A->starts[b] <= i && i < A->starts[b + 1])
+    return b;
+  size_t lo = 0, hi = A->nblocks - 1;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo + 1) / 2;
+    if (A->starts[mid] <= i)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  A->last_block = lo;
+  return lo;
+}
+
+static void update_starts(SegArray *A, size_t from) {
+  size_t start = from > 0 ? A->starts[from - 1] + A->blocks[from - 1]->n : 0;
+  for (size_t b = from; b < A->nblocks; b++) {
+    A->starts[b] = start;
+    start += A->blocks[b]->n;
+  }
+  A->starts[A->nblocks] = start;
+}
+
+/* makes room for `n` more blocks */
+static void reserve_blocks(lua_State *L, SegArray *A, size_t n) {
+  size_t capacity = A->blocks_capacity;
+  if (!grow((void **) &A->blocks, &capacity, A->nblocks + n, sizeof(Block *)))
+    luaL_error(L, "Unable to allocate the array");
+  if (capacity > A->blocks_capacity) {
+    size_t *starts = realloc(A->starts, (capacity + 1) * sizeof(size_t));
+    if (!starts) luaL_error(L, "Unable to allocate the array");
+    A->starts = starts;
+    A->blocks_capacity = capacity;
+  }
+}
+
+static void remove_block(SegArray *A, size_t at) {
+  free(A->blocks[at]);
+  memmove(A->blocks + at, A->blocks + at + 1, (A->nblocks - at - 1) * sizeof(Block *));
+  A->nblocks--;
+}
+
+/* removes the empty blocks from `first` to `end` excluded, and merges the
+   ones fitting in a single block */
+static void compact_blocks(SegArray *A, size_t first, size_t end) {
+  size_t b = first;
+  while (b < end && b < A->nblocks) {
+    Block *block = A->blocks[b];
+    if (block->n == 0) {
+      remove_block(A, b);
+      end--;
+    } else if (b + 1 < end && b + 1 < A->nblocks && block->n + A->blocks[b + 1]->n <= BLOCK_SIZE) {
+      Block *next = A->blocks[b + 1];
+      memcpy(block->refs + block->n, next->refs, next->n * sizeof(uint32_t));
+      block->n += next->n;
+      remove_block(A, b + 1);
+      end--;
+    } else {
+      b++;
+    }
+  }
+}
+
+
+/* References */
+
+/* the table of values is at the top of the stack */
+static uint32_t new_ref(lua_State *L, SegArray *A, int idx) {
+  if (lua_isnil(L, idx)) return REF_NIL;
+  if (lua_isboolean(L, idx)) return lua_toboolean(L, idx) ? REF_TRUE : REF_FALSE;
+  uint32_t ref;
+  if (A->nfree > 0) {
+    ref = A->free_refs[--A->nfree];
+  } else {
+    if (A->next_ref == UINT32_MAX)
+      luaL_error(L, "too many values in the array");
+    ref = A->next_ref++;
+  }
+  lua_pushvalue(L, idx);
+  lua_rawseti(L, -2, ref);
+  return ref;
+}
+
+/* the space for the reference must have been reserved */
+static void free_ref(lua_State *L, SegArray *A, uint32_t ref) {
+  if (ref < FIRST_REF) return;
+  lua_pushnil(L);
+  lua_rawseti(L, -2, ref);
+  A->free_refs[A->nfree++] = ref;
+}
+
+static void reserve_free_refs(lua_State *L, SegArray *A, size_t n) {
+  if (!grow((void **) &A->free_refs, &A->free_capacity, A->nfree + n, sizeof(uint32_t)))
+    luaL_error(L, "Unable to allocate the array");
+}
+
+static void push_ref(lua_State *L, uint32_t ref) {
+  if (ref == REF_NIL)
+    lua_pushnil(L);
+  else if (ref < FIRST_REF)
+    lua_pushboolean(L, ref == REF_TRUE);
+  else
+    lua_rawgeti(L, -1, ref);
+}
+
+
+/* Editing */
+
+/* removes `n` elements from `at`, both clamped to the array */
+static void remove_elements(lua_State *L, SegArray *A, size_t at, size_t n) {
+  size_t len = get_length(A);
+  if (at >= len || n == 0) return;
+  if (n > len - at) n = len - at;
+  reserve_free_refs(L, A, n);
+  size_t b = find_block(A, at), first = b;
+  size_t offset = at - A->starts[b];
+  while (n > 0) {
+    Block *block = A->blocks[b];
+    size_t k = block->n - offset < n ? block->n - offset : n;
+    for (size_t j = offset; j < offset + k; j++)
+      free_ref(L, A, block->refs[j]);
+    memmove(block->refs + offset, block->refs + offset + k, (block->n - offset - k) * sizeof(uint32_t));
+    block->n -= k;
+    n -= k;
+    b++, offset = 0;
+  }
+  /* the blocks emptied, and the ones left around the removal */
+  first = first > 0 ? first - 1 : 0;
+  compact_blocks(A, first, b + 1);
+  A->last_block = 0;
+  update_starts(A, first);
+}
+
+/* pushes the reference of the element `j` inserted by insert_elements */
+static uint32_t inserted_ref(lua_State *L, SegArray *A, size_t j, int idx, bool fill) {
+  if (fill) return new_ref(L, A, idx);
+  lua_rawgeti(L, idx, j + 1);
+  lua_insert(L, -2);
+  uint32_t ref = new_ref(L, A, -2);
+  lua_remove(L, -2);
+  return ref;
+}
+
+/* inserts `n` elements at `at`, which is at most the length: the values of
+   the table at `idx`, or `n` times the value at `idx` if `fill`; the table of
+   values is at the top of the stack */
+static void insert_elements(lua_State *L, SegArray *A, size_t at, size_t n, int idx, bool fill) {
+  if (n == 0) return;
+  size_t len = get_length(A);
+  size_t b = 0, offset = 0;
+  Block *block = NULL;
+  if (A->nblocks > 0) {
+    b = at == len ? A->nblocks - 1 : find_block(A, at);
+    offset = at - A->starts[b];
+    block = A->blocks[b];
+  }
+
+  if (block && block->n + n <= BLOCK_SIZE) {
+    memmove(block->refs + offset + n, block->refs + offset, (block->n - offset) * sizeof(uint32_t));
+    for (size_t j = 0; j < n; j++)
+      block->refs[offset + j] = inserted_ref(L, A, j, idx, fill);
+    block->n += n;
+    update_starts(A, b);
+    return;
+  }
+
+  /* new blocks for the elements, and one for the part of the block after
+     them */
+  size_t nnew = (n + BLOCK_SIZE - 1) / BLOCK_SIZE + 1;
+  reserve_blocks(L, A, nnew);
+  size_t first = block ? b + 1 : 0;
+  for (size_t k = 0; k < nnew; k++) {
+    Block *new_block = malloc(sizeof(Block));
+    if (!new_block) {
+      compact_blocks(A, first, first + k);
+      update_starts(A, 0);
+      luaL_error(L, "Unable to allocate the array");
+    }
+    new_block->n = 0;
+    memmove(A->blocks + first + k + 1, A->blocks + first + k, (A->nblocks - first - k) * sizeof(Block *));
+    A->blocks[first + k] = new_block;
+    A->nblocks++;
+  }
+  Block *rest = A->blocks[first + nnew - 1];
+  if (block) {
+    rest->n = block->n - offset;
+    memcpy(rest->refs, block->refs + offset, rest->n * sizeof(uint32_t));
+    block->n = offset;
+  }
+  size_t k = first;
+  for (size_t j = 0; j < n; j++) {
+    if (A->blocks[k]->n == BLOCK_SIZE) k++;
+    A->blocks[k]->refs[A->blocks[k]->n++] = inserted_ref(L, A, j, idx, fill);
+  }
+  /* the parts of the block split may be small */
+  first = block ? b : 0;
+  compact_blocks(A, first, first + nnew + 1);
+  A->last_block = 0;
+  update_starts(A, first);
+}
+
+
+/* Lua interface */
+
+/* pushes the table of values after the `nargs` arguments */
+static SegArray *check_array(lua_State *L, int nargs) {
+  SegArray *A = luaL_checkudata(L, 1, API_TYPE_SEG_ARRAY);
+  lua_settop(L, nargs);
+  lua_getiuservalue(L, 1, 1);
+  return A;
+}
+
+static int f_new(lua_State *L) {
+  lua_Integer n = luaL_optinteger(L, 1, 0);
+  luaL_argcheck(L, n >= 0, 1, "non-negative value expected");
+  lua_settop(L, 2);
+  SegArray *A = lua_newuserdatauv(L, sizeof(SegArray), 1);
+  memset(A, 0, sizeof(SegArray));
+  luaL_setmetatable(L, API_TYPE_SEG_ARRAY);
+  A->next_ref = FIRST_REF;
+  lua_newtable(L);
+  lua_pushvalue(L, -1);
+  lua_setiuservalue(L, -3, 1);
+  insert_elements(L, A, 0, n, 2, true);
+  lua_pop(L, 1);
+  return 1;
+}
+
+static int f_array_index(lua_State *L) {
+  SegArray *A = luaL_checkudata(L, 1, API_TYPE_SEG_ARRAY);
+  int isnum;
+  lua_Integer i = lua_tointegerx(L, 2, &isnum);
+  if (!isnum) {
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    return 1;
+  }
+  if (i < 1 || (lua_Unsigned) i > get_length(A)) {
+    lua_pushnil(L);
+    return 1;
+  }
+  size_t b = find_block(A, i - 1);
+  lua_getiuservalue(L, 1, 1);
+  push_ref(L, A->blocks[b]->refs[i - 1 - A->starts[b]]);
+  return 1;
+}
+
+/* setting an element after the end adds nils before it, and setting the last
+   one to nil removes the nils at the end, like the length of a table */
+static int f_array_newindex(lua_State *L) {
+  SegArray *A = check_array(L, 3);
+  lua_Integer i = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, i >= 1, 2, "index out of bounds");
+  size_t len = get_length(A);
+  if ((lua_Unsigned) i > len) {
+    if (lua_isnil(L, 3)) return 0;
+    lua_pushnil(L);
+    lua_insert(L, -2);
+    insert_elements(L, A, len, i - 1 - len, -2, true);
+    insert_elements(L, A, i - 1, 1, 3, true);
+    return 0;
+  }
+  size_t b = find_block(A, i - 1);
+  uint32_t *ref = &A->blocks[b]->refs[i - 1 - A->starts[b]];
+  reserve_free_refs(L, A, 1);
+  free_ref(L, A, *ref);
+  *ref = REF_NIL;
+  *ref = new_ref(L, A, 3);
+  if (*ref == REF_NIL && (lua_Unsigned) i == len) {
+    size_t j = len;
+    while (j > 0) {
+      b = find_block(A, j - 1);
+      if (A->blocks[b]->refs[j - 1 - A->starts[b]] != REF_NIL) break;
+      j--;
+    }
+    remove_elements(L, A, j, len - j);
+  }
+  return 0;
+}
+
+static int f_array_len(lua_State *L) {
+  SegArray *A = luaL_checkudata(L, 1, API_TYPE_SEG_ARRAY);
+  lua_pushinteger(L, get_length(A));
+  return 1;
+}
+
+static int array_next(lua_State *L) {
+  SegArray *A = luaL_checkudata(L, 1, API_TYPE_SEG_ARRAY);
+  lua_Integer i = luaL_checkinteger(L, 2);
+  lua_getiuservalue(L, 1, 1);
+  for (; i >= 0 && (lua_Unsigned) i < get_length(A); i++) {
+    size_t b = find_block(A, i);
+    uint32_t ref = A->blocks[b]->refs[i - A->starts[b]];
+    if (ref != REF_NIL) {
+      push_ref(L, ref);
+      lua_pushinteger(L, i + 1);
+      lua_insert(L, -2);
+      return 2;
+    }
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+static int f_array_pairs(lua_State *L) {
+  luaL_checkudata(L, 1, API_TYPE_SEG_ARRAY);
+  lua_pushcfunction(L, array_next);
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, 0);
+  return 3;
+}
+
+static int f_array_gc(lua_State *L) {
+  SegArray *A = luaL_checkudata(L, 1, API_TYPE_SEG_ARRAY);
+  for (size_t b = 0; b < A->nblocks; b++)
+    free(A->blocks[b]);
+  free(A->blocks);
+  free(A->starts);
+  free(A->free_refs);
+  memset(A, 0, sizeof(SegArray));
+  return 0;
+}
+
+static int f_array_splice(lua_State *L) {
+  SegArray *A = luaL_checkudata(L, 1, API_TYPE_SEG_ARRAY);
+  size_t len = get_length(A);
+  lua_Integer at = luaL_checkinteger(L, 2);
+  lua_Integer remove = luaL_checkinteger(L, 3);
+  luaL_argcheck(L, at >= 1 && (lua_Unsigned) at <= len + 1, 2, "position out of bounds");
+  luaL_argcheck(L, remove >= 0, 3, "non-negative value expected");
+  if (!lua_isnoneornil(L, 4)) luaL_checktype(L, 4, LUA_TTABLE);
+  lua_settop(L, 4);
+  lua_getiuservalue(L, 1, 1);
+  remove_elements(L, A, at - 1, remove);
+  if (!lua_isnil(L, 4))
+    insert_elements(L, A, at - 1, luaL_len(L, 4), 4, false);
+  return 0;
+}
+
+/* inserting after the end adds nils before the elements */
+static int f_array_insert(lua_State *L) {
+  SegArray *A = check_array(L, 4);
+  lua_Integer at = luaL_checkinteger(L, 2);
+  lua_Integer count = luaL_checkinteger(L, 3);
+  luaL_argcheck(L, at >= 1, 2, "position out of bounds");
+  luaL_argcheck(L, count >= 0, 3, "non-negative value expected");
+  size_t len = get_length(A);
+  if ((lua_Unsigned) at > len + 1) {
+    lua_pushnil(L);
+    lua_insert(L, -2);
+    insert_elements(L, A, len, at - 1 - len, -2, true);
+  }
+  insert_elements(L, A, at - 1, count, 4, true);
+  return 0;
+}
+
+static int f_array_remove(lua_State *L) {
+  SegArray *A = check_array(L, 3);
+  lua_Integer at = luaL_checkinteger(L, 2);
+  lua_Integer count = luaL_checkinteger(L, 3);
+  luaL_argcheck(L, at >= 1, 2, "position out of bounds");
+  luaL_argcheck(L, count >= 0, 3, "non-negative value expected");
+  remove_elements(L, A, at - 1, count);
+  return 0;
+}
+
+
+static const luaL_Reg arrayLib[] = {
+  { "__newindex", f_array_newindex },
+  { "__len",      f_array_len      },
+  { "__pairs",    f_array_pairs    },
+  { "__gc",       f_array_gc       },
+  { NULL, NULL }
+};
+
+static const luaL_Reg arrayMethods[] = {
+  { "splice", f_array_splice },
+  { "insert", f_array_insert },
+  { "remove", f_array_remove },
+  { NULL, NULL }
+};
+
+static const luaL_Reg lib[] = {
+  { "new", f_new },
+  { NULL, NULL }
+};
+
+int luaopen_segarray(lua_State *L) {
+  luaL_newmetatable(L, API_TYPE_SEG_ARRAY);
+  luaL_setfuncs(L, arrayLib, 0);
+  /* integer keys are elements, the others are methods */
+  luaL_newlib(L, arrayMethods);
+  lua_pushcclosure(L, f_array_index, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newlib(L, lib);
+  return 1;
+}
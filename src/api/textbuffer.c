@@ -0,0 +1,2340 @@
+#include "api.h"
+#include "custom_events.h"
+
+#include <SDL3/SDL.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+  #include <windows.h>
+  #include <io.h>
+  #include <fcntl.h>
+  #include "../utfconv.h"
+#else
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/mman.h>
+  #include <signal.h>
+#endif
+
+/* Lines of a document, stored as a piece table.
+ *
+ * The text is kept in two stores: the text the buffer was created with, and
+ * an append-only store where the inserted lines are added. Each store keeps
+ * the offset where each of its lines starts, so a piece is just a run of
+ * consecutive lines of a store, and editing never moves the text of the other
+ * lines. The pieces are the nodes of a treap ordered by position in the
+ * buffer, each node counting the lines and bytes of its subtree, so that
+ * finding a line or a byte offset and splicing lines take a logarithmic time
+ * in the number of pieces.
+ *
+ * The buffer can be used like an array of lines from Lua. The lines are
+ * created as strings when accessed, and the recently accessed ones are cached
+ * in the uservalue of the buffer until the next edit, so that comparing them
+ * with previous accesses is cheap.
+ *
+ * As every edit adds the new version of its lines to the store of inserted
+ * lines, it is compacted when most of it is no longer used by any piece.
+ *
+ * Files are read by a loader thread, which adds their lines to the original
+ * store in batches; the lines found so far can be read while it runs, but the
+ * buffer can only be edited once it's done. Large files can be mapped in
+ * memory instead, the original store then uses the mapping as its text, the
+ * loader only finds the offsets of its lines, and they are only normalized
+ * when they are pushed to Lua.
+ *
+ * Saving takes a snapshot of the pieces, copying the inserted lines as their
+ * store can change, and writes it from a thread to a temporary file that then
+ * replaces the original one, so that the buffer can be edited meanwhile. */
+
+#define ORIGINAL 0
+#define ADDED 1
+
+/* from utf8.c */
+int utf8extra_isvalid(const char *s, const char *e);
+
+/* piece 0 is not used, it's the empty tree */
+#define NIL 0
+
+/* lines cached before starting a new cache */
+#define MAX_CACHED_LINES 4096
+
+/* minimum size of the added store before compacting it */
+#define MIN_COMPACT_SIZE (1 << 20)
+
+typedef struct {
+  char *text;
+  size_t len, capacity;
+  size_t *starts; /* offset of each line, followed by len */
+  size_t nlines, lines_capacity;
+  bool mapped; /* text of a mapped file, with the line endings of the file */
+  /* for mapped files, the lines ending with a carriage return, and how many
+     there are before each word, NULL if there are none */
+  uint64_t *cr_lines;
+  size_t *cr_before;
+} Store;
+
+typedef struct {
+  SDL_Thread *thread;
+  SDL_Mutex *mutex; /* protects the lines of the store and the fields below */
+  SDL_Condition *batch_done;
+  SDL_AtomicInt done, cancel, event_pending;
+  Store *store;
+  FILE *fp; /* file read in the store, NULL if the store is mapped */
+  size_t loaded, total; /* bytes of the file */
+  bool crlf, failed, notify;
+  lua_Integer id;
+  char error[256];
+} Loader;
+
+typedef struct {
+  int left, right;
+  unsigned priority;
+  int store;
+  size_t first, count; /* lines of the store */
+  size_t lines, bytes; /* lines and bytes of the subtree */
+} Piece;
+
+typedef struct {
+  Store stores[2];
+  Piece *pieces;
+  int npieces, pieces_capacity;
+  int free_pieces, nfree; /* linked through their left child */
+  int root;
+  size_t added_used; /* bytes of the added store used by pieces */
+  unsigned seed;
+  int cached;
+  int last_piece; /* piece of the last line found, and its first line */
+  size_t last_piece_start;
+  Loader *loader;
+  int saves; /* saves using the original store */
+  bool crlf;
+} TextBuffer;
+
+
+static bool grow(void **ptr, size_t *capacity, size_t needed, size_t size) {
+  if (needed <= *capacity) return true;
+  size_t capacity2 = *capacity ? *capacity : 16;
+  while (capacity2 < needed) capacity2 *= 2;
+  void *ptr2 = SDL_realloc(*ptr, capacity2 * size);
+  if (!ptr2) return false;
+  *ptr = ptr2;
+  *capacity = capacity2;
+  return true;
+}
+
+static bool store_init(Store *S) {
+  memset(S, 0, sizeof(Store));
+  if (!grow((void **) &S->starts, &S->lines_capacity, 1, sizeof(size_t)))
+    return false;
+  S->starts[0] = 0;
+  return true;
+}
+
+/* makes room for `nlines` more lines of `len` bytes */
+static bool store_reserve(Store *S, size_t nlines, size_t len) {
+  return grow((void **) &S->text, &S->capacity, S->len + len, 1)
+    && grow((void **) &S->starts, &S->lines_capacity, S->nlines + nlines + 1, sizeof(size_t));
+}
+
+/* the space must have been reserved */
+static void store_push(Store *S, const char *text, size_t len) {
+  memcpy(S->text + S->len, text, len);
+  S->len += len;
+  S->starts[++S->nlines] = S->len;
+}
+
+#ifndef _WIN32
+/* Mapped files can be truncated by other programs, reading the pages past
+ * their new end then raises SIGBUS. The pages of the mappings are replaced by
+ * zeroed ones instead, so the lines read as NUL bytes until the document is
+ * reloaded, and the mapping is marked as truncated so that it isn't saved.
+ * Windows doesn't allow truncating mapped files. */
+
+#define MAX_GUARDED_MAPPINGS 64
+
+typedef struct {
+  void *text; /* NULL if the slot is free */
+  size_t len;
+  SDL_AtomicInt truncated;
+} GuardedMapping;
+
+static GuardedMapping guarded_mappings[MAX_GUARDED_MAPPINGS];
+static struct sigaction previous_sigbus;
+static size_t page_size;
+
+static GuardedMapping *find_guarded_mapping(const char *addr) {
+  for (int i = 0; i < MAX_GUARDED_MAPPINGS; i++) {
+    const char *text = SDL_GetAtomicPointer(&guarded_mappings[i].text);
+    if (text && addr >= text && addr < text + guarded_mappings[i].len)
+      return &guarded_mappings[i];
+  }
+  return NULL;
+}
+
+static void handle_sigbus(int sig, siginfo_t *info, void *context) {
+  (void) sig;
+  (void) context;
+  GuardedMapping *m = find_guarded_mapping(info->si_addr);
+  if (m) {
+    void *page = (void *) ((uintptr_t) info->si_addr & ~(uintptr_t) (page_size - 1));
+    if (mmap(page, page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+      SDL_SetAtomicInt(&m->truncated, 1);
+      return;
+    }
+  }
+  /* not a truncated mapping, the fault happens again with the previous
+     handler */
+  sigaction(SIGBUS, &previous_sigbus, NULL);
+}
+
+/* returns false if no more mappings can be guarded */
+static bool guard_mapping(char *text, size_t len) {
+  if (page_size == 0) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = handle_sigbus;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    page_size = sysconf(_SC_PAGESIZE);
+    if (sigaction(SIGBUS, &action, &previous_sigbus) != 0) {
+      page_size = 0;
+      return false;
+    }
+  }
+  for (int i = 0; i < MAX_GUARDED_MAPPINGS; i++) {
+    GuardedMapping *m = &guarded_mappings[i];
+    if (!SDL_GetAtomicPointer(&m->text)) {
+      m->len = len;
+      SDL_SetAtomicInt(&m->truncated, 0);
+      SDL_SetAtomicPointer(&m->text, text);
+      return true;
+    }
+  }
+  return false;
+}
+#endif
+
+static bool is_mapping_truncated(Store *S) {
+#ifdef _WIN32
+  (void) S;
+  return false;
+#else
+  GuardedMapping *m = S->mapped ? find_guarded_mapping(S->text) : NULL;
+  return m && SDL_GetAtomicInt(&m->truncated);
+#endif
+}
+
+static void unmap_file(char *text, size_t len) {
+#ifdef _WIN32
+  UnmapViewOfFile(text);
+#else
+  GuardedMapping *m = find_guarded_mapping(text);
+  if (m) SDL_SetAtomicPointer(&m->text, NULL);
+  munmap(text, len);
+#endif
+}
+
+static void store_free(Store *S) {
+  if (!S->mapped)
+    SDL_free(S->text);
+  else if (S->text)
+    unmap_file(S->text, S->len);
+  SDL_free(S->starts);
+  SDL_free(S->cr_lines);
+  SDL_free(S->cr_before);
+  memset(S, 0, sizeof(Store));
+}
+
+
+/* Pieces */
+
+#define P(B, i) ((B)->pieces[i])
+
+static size_t piece_bytes(TextBuffer *B, int i) {
+  Store *S = &B->stores[P(B, i).store];
+  return S->starts[P(B, i).first + P(B, i).count] - S->starts[P(B, i).first];
+}
+
+static size_t popcount64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcountll(x);
+#else
+  x = x - ((x >> 1) & UINT64_C(0x5555555555555555));
+  x = (x & UINT64_C(0x3333333333333333)) + ((x >> 2) & UINT64_C(0x3333333333333333));
+  x = (x + (x >> 4)) & UINT64_C(0x0f0f0f0f0f0f0f0f);
+  return (x * UINT64_C(0x0101010101010101)) >> 56;
+#endif
+}
+
+/* lines of a mapped file ending with a carriage return before `line` */
+static size_t count_cr_lines(Store *S, size_t line) {
+  if (!S->cr_lines) return 0;
+  size_t word = line / 64, bit = line % 64;
+  uint64_t mask = bit ? S->cr_lines[word] & ((UINT64_C(1) << bit) - 1) : 0;
+  return S->cr_before[word] + popcount64(mask);
+}
+
+/* bytes of the lines once pushed to Lua, as the lines of mapped files lose
+   their carriage return and the last one may get a newline */
+static size_t store_bytes(Store *S, size_t first, size_t count) {
+  size_t bytes = S->starts[first + count] - S->starts[first];
+  if (!S->mapped || count == 0)
+    return bytes;
+  bytes -= count_cr_lines(S, first + count) - count_cr_lines(S, first);
+  if (first + count == S->nlines && S->text[S->len - 1] != '\n')
+    bytes++;
+  return bytes;
+}
+
+static void update(TextBuffer *B, int i) {
+  Piece *p = &P(B, i);
+  p->lines = P(B, p->left).lines + p->count + P(B, p->right).lines;
+  p->bytes = P(B, p->left).bytes + store_bytes(&B->stores[p->store], p->first, p->count)
+    + P(B, p->right).bytes;
+}
+
+/* makes sure `n` pieces can be created without reallocating */
+static bool reserve_pieces(TextBuffer *B, int n) {
+  int available = B->pieces_capacity - B->npieces + B->nfree;
+  if (available >= n) return true;
+  size_t capacity = B->pieces_capacity;
+  if (!grow((void **) &B->pieces, &capacity, B->pieces_capacity + n - available, sizeof(Piece)))
+    return false;
+  B->pieces_capacity = capacity;
+  return true;
+}
+
+static int new_piece(TextBuffer *B, int store, size_t first, size_t count, unsigned priority) {
+  int i = B->free_pieces;
+  if (i != NIL) {
+    B->free_pieces = P(B, i).left;
+    B->nfree--;
+  } else
+    i = B->npieces++;
+  P(B, i) = (Piece) {
+    .left = NIL, .right = NIL, .priority = priority,
+    .store = store, .first = first, .count = count,
+    .lines = 0, .bytes = 0 /* set by update */
+  };
+  update(B, i);
+  return i;
+}
+
+static unsigned random_priority(TextBuffer *B) {
+  B->seed ^= B->seed << 13;
+  B->seed ^= B->seed >> 17;
+  B->seed ^= B->seed << 5;
+  return B->seed;
+}
+
+static void free_pieces(TextBuffer *B, int i) {
+  if (i == NIL) return;
+  free_pieces(B, P(B, i).left);
+  free_pieces(B, P(B, i).right);
+  if (P(B, i).store == ADDED)
+    B->added_used -= piece_bytes(B, i);
+  P(B, i).left = B->free_pieces;
+  B->free_pieces = i;
+  B->nfree++;
+}
+
+/* splits the tree `i` into its first `k` lines and the rest, splitting the
+   piece where the position falls; needs one piece reserved */
+static void split(TextBuffer *B, int i, size_t k, int *left, int *right) {
+  if (i == NIL) {
+    *left = *right = NIL;
+    return;
+  }
+  size_t before = P(B, P(B, i).left).lines;
+  if (k <= before) {
+    split(B, P(B, i).left, k, left, &P(B, i).left);
+    update(B, i);
+    *right = i;
+  } else if (k >= before + P(B, i).count) {
+    split(B, P(B, i).right, k - before - P(B, i).count, &P(B, i).right, right);
+    update(B, i);
+    *left = i;
+  } else {
+    /* the second half takes the priority of the piece, so that it can be
+       the parent of its right subtree */
+    size_t n = k - before;
+    int rest = new_piece(B, P(B, i).store, P(B, i).first + n, P(B, i).count - n, P(B, i).priority);
+    P(B, rest).right = P(B, i).right;
+    update(B, rest);
+    P(B, i).count = n;
+    P(B, i).right = NIL;
+    update(B, i);
+    *left = i;
+    *right = rest;
+  }
+}
+
+static int merge(TextBuffer *B, int left, int right) {
+  if (left == NIL) return right;
+  if (right == NIL) return left;
+  if (P(B, left).priority > P(B, right).priority) {
+    int merged = merge(B, P(B, left).right, right);
+    P(B, left).right = merged;
+    update(B, left);
+    return left;
+  }
+  int merged = merge(B, left, P(B, right).left);
+  P(B, right).left = merged;
+  update(B, right);
+  return right;
+}
+
+/* copies the lines still used to a new added store */
+static void compact_pieces(TextBuffer *B, int i, Store *S) {
+  if (i == NIL) return;
+  compact_pieces(B, P(B, i).left, S);
+  Piece *p = &P(B, i);
+  if (p->store == ADDED) {
+    Store *old = &B->stores[ADDED];
+    size_t first = S->nlines;
+    for (size_t j = p->first; j < p->first + p->count; j++)
+      store_push(S, old->text + old->starts[j], old->starts[j + 1] - old->starts[j]);
+    p->first = first;
+  }
+  compact_pieces(B, P(B, i).right, S);
+}
+
+static size_t count_added_lines(TextBuffer *B, int i) {
+  if (i == NIL) return 0;
+  return (P(B, i).store == ADDED ? P(B, i).count : 0)
+    + count_added_lines(B, P(B, i).left) + count_added_lines(B, P(B, i).right);
+}
+
+static void compact(TextBuffer *B) {
+  Store S;
+  if (!store_init(&S) || !store_reserve(&S, count_added_lines(B, B->root), B->added_used)) {
+    /* not compacting is not an error */
+    store_free(&S);
+    return;
+  }
+  compact_pieces(B, B->root, &S);
+  store_free(&B->stores[ADDED]);
+  B->stores[ADDED] = S;
+}
+
+
+/* Loading files */
+
+#define LOADER_BATCH 65536
+
+/* bytes read from a file at once */
+#define LOADER_READ_SIZE (1 << 22)
+
+static void notify_loader(Loader *loader) {
+  /* the event is only sent again once get_load_state was called */
+  if (loader->notify && SDL_SetAtomicInt(&loader->event_pending, 1) == 0) {
+    CustomEvent event;
+    SDL_zero(event);
+    event.data1 = (void *) (intptr_t) loader->id;
+    push_custom_event("loaded", &event);
+  }
+}
+
+/* adds the lines found to the store, the last batch ending the loading */
+static void publish_lines(Loader *loader, const size_t *batch, size_t n, size_t loaded, bool crlf, bool done) {
+  Store *S = loader->store;
+  if (loader->failed) return;
+  SDL_LockMutex(loader->mutex);
+  if (grow((void **) &S->starts, &S->lines_capacity, S->nlines + n + 1, sizeof(size_t))) {
+    memcpy(S->starts + S->nlines + 1, batch, n * sizeof(size_t));
+    S->nlines += n;
+    if (!S->mapped) S->len = S->starts[S->nlines];
+    loader->loaded = loaded;
+    loader->crlf = crlf;
+  } else {
+    SDL_strlcpy(loader->error, "Unable to allocate the text buffer", sizeof(loader->error));
+    loader->failed = done = true;
+  }
+  if (done) SDL_SetAtomicInt(&loader->done, 1);
+  SDL_SignalCondition(loader->batch_done);
+  SDL_UnlockMutex(loader->mutex);
+  notify_loader(loader);
+}
+
+/* marks the lines ending with a carriage return, so that the length of
+   the lines once normalized can be known without reading them */
+static bool mark_cr_line(Store *S, size_t line, size_t *capacity) {
+  size_t words = *capacity;
+  if (!grow((void **) &S->cr_lines, capacity, line / 64 + 1, sizeof(uint64_t)))
+    return false;
+  memset(S->cr_lines + words, 0, (*capacity - words) * sizeof(uint64_t));
+  S->cr_lines[line / 64] |= UINT64_C(1) << (line % 64);
+  return true;
+}
+
+static bool count_cr_words(Store *S, size_t nlines, size_t *capacity) {
+  size_t words = *capacity, nwords = nlines / 64 + 1;
+  if (!grow((void **) &S->cr_lines, capacity, nwords, sizeof(uint64_t)))
+    return false;
+  memset(S->cr_lines + words, 0, (*capacity - words) * sizeof(uint64_t));
+  S->cr_before = SDL_malloc(nwords * sizeof(size_t));
+  if (!S->cr_before)
+    return false;
+  size_t count = 0;
+  for (size_t i = 0; i < nwords; i++) {
+    S->cr_before[i] = count;
+    count += popcount64(S->cr_lines[i]);
+  }
+  return true;
+}
+
+/* finds the lines of a mapped file */
+static void index_lines(Loader *loader, size_t *batch) {
+  Store *S = loader->store;
+  const char *text = S->text, *end = S->text + S->len, *p = text;
+  size_t line = 0, cr_capacity = 0;
+  bool crlf = false;
+  while (!SDL_GetAtomicInt(&loader->cancel) && !loader->failed) {
+    size_t n = 0;
+    while (p < end && n < LOADER_BATCH) {
+      const char *nl = memchr(p, '\n', end - p);
+      const char *e = nl ? nl : end;
+      if (e > p && e[-1] == '\r') {
+        crlf = true;
+        if (!mark_cr_line(S, line, &cr_capacity)) {
+          SDL_strlcpy(loader->error, "Unable to allocate the text buffer", sizeof(loader->error));
+          return;
+        }
+      }
+      p = nl ? nl + 1 : end;
+      batch[n++] = p - text;
+      line++;
+    }
+    /* the store is only read from other threads once it's loaded */
+    if (p == end && S->cr_lines && !count_cr_words(S, line, &cr_capacity)) {
+      SDL_strlcpy(loader->error, "Unable to allocate the text buffer", sizeof(loader->error));
+      return;
+    }
+    publish_lines(loader, batch, n, p - text, crlf, p == end);
+    if (p == end) return;
+  }
+}
+
+/* reads a file in the store, normalizing its lines like textbuffer.load; as
+   the lines only get shorter, they are moved in place in the text read, which
+   was allocated for the whole file */
+static void read_lines(Loader *loader, size_t *batch) {
+  Store *S = loader->store;
+  char *text = S->text;
+  size_t size = S->capacity - 1, read = 0, scan = 0, len = 0, n = 0;
+  bool crlf = false, eof = false;
+  while (!eof && !SDL_GetAtomicInt(&loader->cancel) && !loader->failed) {
+    size_t wanted = SDL_min(LOADER_READ_SIZE, size - read);
+    size_t got = wanted > 0 ? fread(text + read, 1, wanted, loader->fp) : 0;
+    if (got < wanted && ferror(loader->fp)) {
+      SDL_snprintf(loader->error, sizeof(loader->error), "Unable to read the file: %s", strerror(errno));
+      return;
+    }
+    read += got;
+    eof = got < wanted || read == size;
+
+    char *nl;
+    while ((nl = memchr(text + scan, '\n', read - scan))) {
+      size_t line_len = nl - (text + scan);
+      if (line_len > 0 && text[scan + line_len - 1] == '\r') {
+        line_len--;
+        crlf = true;
+      }
+      memmove(text + len, text + scan, line_len);
+      len += line_len;
+      text[len++] = '\n';
+      scan = nl - text + 1;
+      batch[n++] = len;
+      if (n == LOADER_BATCH) {
+        publish_lines(loader, batch, n, scan, crlf, false);
+        n = 0;
+      }
+    }
+    if (eof && (scan < read || S->nlines + n == 0)) {
+      /* the last line doesn't end with a newline, or the file is empty */
+      size_t line_len = read - scan;
+      if (line_len > 0 && text[scan + line_len - 1] == '\r') {
+        line_len--;
+        crlf = true;
+      }
+      memmove(text + len, text + scan, line_len);
+      len += line_len;
+      text[len++] = '\n';
+      scan = read;
+      batch[n++] = len;
+    }
+    if (n > 0 || eof) {
+      publish_lines(loader, batch, n, scan, crlf, eof);
+      n = 0;
+    }
+  }
+}
+
+static int loader_thread(void *data) {
+  Loader *loader = data;
+  size_t *batch = SDL_malloc(LOADER_BATCH * sizeof(size_t));
+  if (!batch)
+    SDL_strlcpy(loader->error, "Unable to allocate the text buffer", sizeof(loader->error));
+  else if (loader->fp)
+    read_lines(loader, batch);
+  else
+    index_lines(loader, batch);
+  SDL_free(batch);
+  if (!SDL_GetAtomicInt(&loader->done)) {
+    /* cancelled or failed */
+    SDL_LockMutex(loader->mutex);
+    loader->failed = true;
+    SDL_SetAtomicInt(&loader->done, 1);
+    SDL_SignalCondition(loader->batch_done);
+    SDL_UnlockMutex(loader->mutex);
+    notify_loader(loader);
+  }
+  return 0;
+}
+
+static void set_original_lines(TextBuffer *B);
+
+static void stop_loader(TextBuffer *B) {
+  Loader *loader = B->loader;
+  SDL_WaitThread(loader->thread, NULL);
+  if (loader->fp) fclose(loader->fp);
+  SDL_DestroyCondition(loader->batch_done);
+  SDL_DestroyMutex(loader->mutex);
+  B->crlf = loader->crlf;
+  B->loader = NULL;
+  SDL_free(loader);
+}
+
+/* the lines of the original store are added to the tree once they are all
+   known, as it can only be edited after that; returns false with the error
+   pushed if the loader failed */
+static bool finish_loader(lua_State *L, TextBuffer *B, bool wait) {
+  if (!B->loader || (!wait && !SDL_GetAtomicInt(&B->loader->done)))
+    return true;
+  bool failed = B->loader->failed;
+  if (failed)
+    lua_pushstring(L, B->loader->error);
+  stop_loader(B);
+  set_original_lines(B);
+  return !failed;
+}
+
+static void check_loader(lua_State *L, TextBuffer *B, bool wait) {
+  if (!finish_loader(L, B, wait))
+    lua_error(L);
+}
+
+/* copies the text of the mapped file normalizing its lines */
+static bool detach(TextBuffer *B) {
+  Store *S = &B->stores[ORIGINAL];
+  if (!S->mapped) return true;
+  char *text = SDL_malloc(S->len + 1);
+  if (!text) return false;
+  size_t len = 0;
+  for (size_t i = 0; i < S->nlines; i++) {
+    const char *line = S->text + S->starts[i];
+    size_t line_len = S->starts[i + 1] - S->starts[i];
+    if (line_len > 0 && line[line_len - 1] == '\n') line_len--;
+    if (line_len > 0 && line[line_len - 1] == '\r') line_len--;
+    S->starts[i] = len;
+    memcpy(text + len, line, line_len);
+    len += line_len;
+    text[len++] = '\n';
+  }
+  S->starts[S->nlines] = len;
+  unmap_file(S->text, S->len);
+  S->text = text;
+  S->len = S->capacity = len;
+  S->mapped = false;
+  SDL_free(S->cr_lines);
+  SDL_free(S->cr_before);
+  S->cr_lines = NULL;
+  S->cr_before = NULL;
+  return true;
+}
+
+
+/* Saving */
+
+/* size of the writes, lines longer than this are written directly */
+#define SAVE_CHUNK (1 << 20)
+
+typedef struct {
+  const char *text;
+  size_t len;
+  bool mapped;
+} Segment;
+
+typedef struct {
+  SDL_Thread *thread;
+  Segment *segments;
+  int nsegments;
+  char *added; /* copy of the inserted lines of the snapshot */
+  FILE *fp;
+  char *path, *temp_path; /* no temporary file when writing in place */
+  bool crlf, notify;
+  lua_Integer id;
+  TextBuffer *buffer;
+  bool failed;
+  char error[256];
+} Saver;
+
+typedef struct {
+  FILE *fp;
+  char *chunk;
+  size_t len;
+  bool failed;
+} Writer;
+
+static void writer_flush(Writer *W) {
+  if (W->len > 0 && !W->failed && fwrite(W->chunk, 1, W->len, W->fp) != W->len)
+    W->failed = true;
+  W->len = 0;
+}
+
+static void writer_push(Writer *W, const char *text, size_t len) {
+  if (len >= SAVE_CHUNK) {
+    writer_flush(W);
+    if (!W->failed && fwrite(text, 1, len, W->fp) != len)
+      W->failed = true;
+    return;
+  }
+  if (W->len + len > SAVE_CHUNK)
+    writer_flush(W);
+  memcpy(W->chunk + W->len, text, len);
+  W->len += len;
+}
+
+/* the lines of mapped segments are normalized the same way as in push_text */
+static void write_segment(Writer *W, const Segment *seg, bool crlf) {
+  const char *p = seg->text, *end = seg->text + seg->len;
+  if (!crlf && !seg->mapped) {
+    writer_push(W, p, seg->len);
+    return;
+  }
+  while (p < end && !W->failed) {
+    const char *nl = memchr(p, '\n', end - p);
+    const char *e = nl ? nl : end;
+    if (seg->mapped && e > p && e[-1] == '\r')
+      e--;
+    writer_push(W, p, e - p);
+    if (nl || seg->mapped)
+      writer_push(W, crlf ? "\r\n" : "\n", crlf ? 2 : 1);
+    p = nl ? nl + 1 : end;
+  }
+}
+
+static void set_save_error(Saver *saver, const char *path) {
+  if (saver->failed) return;
+  saver->failed = true;
+#ifdef _WIN32
+  SDL_snprintf(saver->error, sizeof(saver->error), "%s: error %d", path, (int) GetLastError());
+#else
+  SDL_snprintf(saver->error, sizeof(saver->error), "%s: %s", path, strerror(errno));
+#endif
+}
+
+static bool sync_file(FILE *fp) {
+#ifdef _WIN32
+  return FlushFileBuffers((HANDLE) _get_osfhandle(_fileno(fp)));
+#else
+  return fsync(fileno(fp)) == 0;
+#endif
+}
+
+static void remove_file(const char *path) {
+#ifdef _WIN32
+  LPWSTR wpath = utfconv_utf8towc(path);
+  if (wpath) DeleteFileW(wpath);
+  SDL_free(wpath);
+#else
+  unlink(path);
+#endif
+}
+
+/* replaces the file at `path` by the one at `temp_path` in a single step */
+static bool replace_file(const char *temp_path, const char *path) {
+#ifdef _WIN32
+  LPWSTR wtemp = utfconv_utf8towc(temp_path), wpath = utfconv_utf8towc(path);
+  /* ReplaceFileW keeps the attributes of the replaced file, but it must exist */
+  bool ok = wtemp && wpath
+    && (ReplaceFileW(wpath, wtemp, NULL, REPLACE_FILE_IGNORE_MERGE_ERRORS, NULL, NULL)
+        || (GetLastError() == ERROR_FILE_NOT_FOUND
+            && MoveFileExW(wtemp, wpath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)));
+  SDL_free(wtemp);
+  SDL_free(wpath);
+  return ok;
+#else
+  if (rename(temp_path, path) != 0)
+    return false;
+  /* make the rename itself durable */
+  const char *sep = strrchr(path, '/');
+  char *dir = sep ? SDL_strndup(path, sep == path ? 1 : sep - path) : SDL_strdup(".");
+  int fd = dir ? open(dir, O_RDONLY) : -1;
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+  SDL_free(dir);
+  return true;
+#endif
+}
+
+static int saver_thread(void *data) {
+  Saver *saver = data;
+  const char *written = saver->temp_path ? saver->temp_path : saver->path;
+  Writer W = { saver->fp, SDL_malloc(SAVE_CHUNK), 0, false };
+  if (!W.chunk) {
+    saver->failed = true;
+    SDL_strlcpy(saver->error, "Unable to allocate the save buffer", sizeof(saver->error));
+  }
+  for (int i = 0; i < saver->nsegments && W.chunk && !W.failed; i++)
+    write_segment(&W, &saver->segments[i], saver->crlf);
+  if (W.chunk) writer_flush(&W);
+  if (W.failed || fflush(saver->fp) != 0 || !sync_file(saver->fp))
+    set_save_error(saver, written);
+  if (fclose(saver->fp) != 0)
+    set_save_error(saver, written);
+  saver->fp = NULL;
+  if (saver->temp_path) {
+    if (!saver->failed && !replace_file(saver->temp_path, saver->path))
+      set_save_error(saver, saver->path);
+    if (saver->failed)
+      remove_file(saver->temp_path);
+  }
+  SDL_free(W.chunk);
+
+  if (saver->notify) {
+    CustomEvent event;
+    SDL_zero(event);
+    event.data1 = (void *) (intptr_t) saver->id;
+    push_custom_event("saved", &event);
+  }
+  return 0;
+}
+
+/* creates a new file next to `path`, with the same permissions */
+static FILE *open_temp_file(const char *path, char **temp_path) {
+  size_t len = strlen(path) + 8;
+  char *temp = SDL_malloc(len);
+  if (!temp) return NULL;
+  FILE *fp = NULL;
+#ifdef _WIN32
+  for (int tries = 0; tries < 16 && !fp; tries++) {
+    SDL_snprintf(temp, len, "%s.%06x", path, (unsigned) SDL_rand_bits() & 0xffffff);
+    LPWSTR wtemp = utfconv_utf8towc(temp);
+    HANDLE file = wtemp ? CreateFileW(wtemp, GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL)
+                        : INVALID_HANDLE_VALUE;
+    SDL_free(wtemp);
+    if (file == INVALID_HANDLE_VALUE) {
+      if (GetLastError() == ERROR_FILE_EXISTS) continue;
+      break;
+    }
+    int fd = _open_osfhandle((intptr_t) file, _O_BINARY);
+    fp = fd >= 0 ? _fdopen(fd, "wb") : NULL;
+    if (!fp) {
+      if (fd >= 0) _close(fd); else CloseHandle(file);
+      remove_file(temp);
+      break;
+    }
+  }
+#else
+  SDL_snprintf(temp, len, "%s.XXXXXX", path);
+  int fd = mkstemp(temp);
+  if (fd >= 0) {
+    struct stat st;
+    if (stat(path, &st) == 0) {
+      /* keeping the owner is only possible for privileged users */
+      if (fchown(fd, st.st_uid, st.st_gid) != 0) {}
+      fchmod(fd, st.st_mode & 07777);
+    } else {
+      mode_t mask = umask(0);
+      umask(mask);
+      fchmod(fd, 0666 & ~mask);
+    }
+    fp = fdopen(fd, "wb");
+    if (!fp) {
+      close(fd);
+      unlink(temp);
+    }
+  }
+#endif
+  if (!fp) {
+    SDL_free(temp);
+    return NULL;
+  }
+  *temp_path = temp;
+  return fp;
+}
+
+/* used when no file can be created next to `path` */
+static FILE *open_in_place(const char *path) {
+#ifdef _WIN32
+  LPWSTR wpath = utfconv_utf8towc(path);
+  if (!wpath) return NULL;
+  /* opening a hidden file with wb fails, so it's opened with r+b and
+     truncated, falling back to wb when it doesn't exist */
+  FILE *fp = _wfopen(wpath, L"r+b");
+  if (fp && _chsize(_fileno(fp), 0) != 0) {
+    fclose(fp);
+    fp = NULL;
+  } else if (!fp) {
+    fp = _wfopen(wpath, L"wb");
+  }
+  SDL_free(wpath);
+  return fp;
+#else
+  return fopen(path, "wb");
+#endif
+}
+
+/* adds the pieces of the tree `i` to the snapshot in order */
+static void snapshot_pieces(TextBuffer *B, int i, Saver *saver, size_t *added_len) {
+  if (i == NIL) return;
+  snapshot_pieces(B, P(B, i).left, saver, added_len);
+  Store *S = &B->stores[P(B, i).store];
+  const char *text = S->text + S->starts[P(B, i).first];
+  size_t len = piece_bytes(B, i);
+  if (P(B, i).store == ADDED) {
+    memcpy(saver->added + *added_len, text, len);
+    text = saver->added + *added_len;
+    *added_len += len;
+  }
+  saver->segments[saver->nsegments++] = (Segment) { text, len, S->mapped };
+  snapshot_pieces(B, P(B, i).right, saver, added_len);
+}
+
+static void free_saver(Saver *saver) {
+  SDL_free(saver->segments);
+  SDL_free(saver->added);
+  SDL_free(saver->path);
+  SDL_free(saver->temp_path);
+  saver->segments = NULL;
+  saver->added = saver->path = saver->temp_path = NULL;
+}
+
+/* waits for the thread and releases the snapshot */
+static void finish_saver(Saver *saver) {
+  SDL_WaitThread(saver->thread, NULL);
+  saver->thread = NULL;
+  saver->buffer->saves--;
+  free_saver(saver);
+}
+
+
+/* Offsets */
+
+/* finds the piece of line `i`, the first line of the piece and the bytes
+   before it */
+static int find_line(TextBuffer *B, size_t i, size_t *piece_line, size_t *piece_offset) {
+  int piece = B->root;
+  size_t line = 0, offset = 0;
+  for (;;) {
+    Piece *p = &P(B, piece);
+    size_t before = P(B, p->left).lines;
+    if (i < line + before) {
+      piece = p->left;
+    } else if (i < line + before + p->count) {
+      *piece_line = line + before;
+      *piece_offset = offset + P(B, p->left).bytes;
+      return piece;
+    } else {
+      line += before + p->count;
+      offset += P(B, p->left).bytes + store_bytes(&B->stores[p->store], p->first, p->count);
+      piece = p->right;
+    }
+  }
+}
+
+static size_t get_line_length(TextBuffer *B, size_t i) {
+  size_t piece_line, piece_offset;
+  int piece = find_line(B, i, &piece_line, &piece_offset);
+  return store_bytes(&B->stores[P(B, piece).store], P(B, piece).first + i - piece_line, 1);
+}
+
+/* bytes before line `i` */
+static size_t get_line_offset(TextBuffer *B, size_t i) {
+  if (i >= P(B, B->root).lines)
+    return P(B, B->root).bytes;
+  size_t piece_line, piece_offset;
+  int piece = find_line(B, i, &piece_line, &piece_offset);
+  return piece_offset + store_bytes(&B->stores[P(B, piece).store], P(B, piece).first, i - piece_line);
+}
+
+/* finds the line and column of the byte at `offset`, which must be in the
+   buffer */
+static size_t find_offset(TextBuffer *B, size_t offset, size_t *col) {
+  int piece = B->root;
+  size_t line = 0;
+  for (;;) {
+    Piece *p = &P(B, piece);
+    Store *S = &B->stores[p->store];
+    size_t before = P(B, p->left).bytes, bytes = store_bytes(S, p->first, p->count);
+    if (offset < before) {
+      piece = p->left;
+      continue;
+    }
+    offset -= before;
+    line += P(B, p->left).lines;
+    if (offset >= bytes) {
+      offset -= bytes;
+      line += p->count;
+      piece = p->right;
+      continue;
+    }
+    /* the first line of the piece ending after the offset */
+    size_t lo = 0, hi = p->count - 1;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (store_bytes(S, p->first, mid + 1) > offset)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+    *col = offset - store_bytes(S, p->first, lo);
+    return line + lo;
+  }
+}
+
+typedef struct {
+  char *out;
+  size_t line1, col1, line2, col2; /* col2 excluded */
+} TextRange;
+
+/* copies the part of line `j` of the store between the columns */
+static char *copy_line(Store *S, size_t j, size_t col1, size_t col2, char *out) {
+  const char *text = S->text + S->starts[j];
+  if (!S->mapped) {
+    memcpy(out, text + col1, col2 - col1);
+    return out + col2 - col1;
+  }
+  size_t len = S->starts[j + 1] - S->starts[j];
+  if (len > 0 && text[len - 1] == '\n') len--;
+  if (len > 0 && text[len - 1] == '\r') len--;
+  /* the newline is after the text */
+  size_t end = SDL_min(col2, len);
+  if (col1 < end) {
+    memcpy(out, text + col1, end - col1);
+    out += end - col1;
+  }
+  if (col1 <= len && col2 > len)
+    *out++ = '\n';
+  return out;
+}
+
+/* copies the text of the range in the tree `i`, its first line being `line` */
+static void copy_range(TextBuffer *B, int i, size_t line, TextRange *R) {
+  if (i == NIL) return;
+  Piece *p = &P(B, i);
+  size_t first = line + P(B, p->left).lines, last = first + p->count - 1;
+  if (R->line1 < first)
+    copy_range(B, p->left, line, R);
+  size_t a = SDL_max(first, R->line1), b = SDL_min(last, R->line2);
+  Store *S = &B->stores[p->store];
+  if (a <= b && !S->mapped) {
+    /* the lines of a piece are contiguous */
+    size_t start = S->starts[p->first + a - first] + (a == R->line1 ? R->col1 : 0);
+    size_t end = b == R->line2 ? S->starts[p->first + b - first] + R->col2 : S->starts[p->first + b - first + 1];
+    memcpy(R->out, S->text + start, end - start);
+    R->out += end - start;
+  } else {
+    for (size_t j = a; j <= b; j++) {
+      size_t col1 = j == R->line1 ? R->col1 : 0;
+      size_t col2 = j == R->line2 ? R->col2 : store_bytes(S, p->first + j - first, 1);
+      R->out = copy_line(S, p->first + j - first, col1, col2, R->out);
+    }
+  }
+  if (R->line2 > last)
+    copy_range(B, p->right, last + 1, R);
+}
+
+
+/* Splitting text */
+
+typedef struct {
+  size_t lines, crlf, invalid_utf8;
+} LineStats;
+
+static bool is_valid_utf8(const char *s, const char *e) {
+  /* most text is ASCII, which is checked a word at a time */
+  while (e - s >= (ptrdiff_t) sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, s, sizeof(word));
+    if (word & 0x8080808080808080ull) break;
+    s += sizeof(word);
+  }
+  return utf8extra_isvalid(s, e);
+}
+
+static size_t count_lines(const char *text, const char *end) {
+  size_t n = 0;
+  for (const char *p = text; p < end; n++) {
+    const char *nl = memchr(p, '\n', end - p);
+    p = nl ? nl + 1 : end;
+  }
+  return n;
+}
+
+/* updates the stats with the line from `s` to `e`, excluding the newline */
+static void add_line_stats(LineStats *stats, const char *s, const char *e) {
+  stats->lines++;
+  if (e > s && e[-1] == '\r')
+    stats->crlf++;
+  if (!is_valid_utf8(s, e))
+    stats->invalid_utf8++;
+}
+
+static void push_line_stats(lua_State *L, LineStats *stats) {
+  lua_createtable(L, 0, 3);
+  lua_pushinteger(L, stats->lines);
+  lua_setfield(L, -2, "lines");
+  lua_pushinteger(L, stats->crlf);
+  lua_setfield(L, -2, "crlf");
+  lua_pushinteger(L, stats->invalid_utf8);
+  lua_setfield(L, -2, "invalid_utf8");
+}
+
+
+/* Diffing */
+
+/* steps of the diff search before the rest of a hunk is left as it is */
+#define MAX_DIFF_COST (1 << 26)
+
+typedef struct {
+  const char *text;
+  size_t len; /* without the line ending */
+  size_t hash;
+} DiffLine;
+
+typedef struct {
+  uint32_t *a, *b; /* lines as identifiers, equal lines having the same one */
+  ptrdiff_t *v1, *v2; /* furthest paths of the search, forward and backward */
+  size_t cost;
+  size_t *hunks; /* start and count in `a`, start and count in `b` */
+  size_t nhunks, hunks_capacity;
+  bool failed;
+} Diff;
+
+static size_t hash_line(const char *text, size_t len) {
+  size_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char) text[i]) * 16777619u;
+  return h;
+}
+
+/* gets the lines of the tree `i` in order */
+static void get_diff_lines(TextBuffer *B, int i, DiffLine *out, size_t *n) {
+  if (i == NIL) return;
+  Piece *p = &P(B, i);
+  get_diff_lines(B, p->left, out, n);
+  Store *S = &B->stores[p->store];
+  for (size_t j = p->first; j < p->first + p->count; j++) {
+    const char *text = S->text + S->starts[j];
+    size_t len = S->starts[j + 1] - S->starts[j];
+    if (len > 0 && text[len - 1] == '\n') len--;
+    if (S->mapped && len > 0 && text[len - 1] == '\r') len--;
+    out[*n].text = text;
+    out[*n].len = len;
+    out[*n].hash = hash_line(text, len);
+    (*n)++;
+  }
+  get_diff_lines(B, p->right, out, n);
+}
+
+static bool same_line(const DiffLine *a, const DiffLine *b) {
+  return a->hash == b->hash && a->len == b->len && memcmp(a->text, b->text, a->len) == 0;
+}
+
+/* numbers the lines of both sides, so that they are compared as integers */
+static bool number_lines(Diff *D, const DiffLine *a, size_t na, const DiffLine *b, size_t nb) {
+  size_t capacity = 16;
+  while (capacity < (na + nb) * 2) capacity *= 2;
+  size_t mask = capacity - 1;
+  const DiffLine **table = SDL_calloc(capacity, sizeof(DiffLine *));
+  uint32_t *ids = SDL_malloc(capacity * sizeof(uint32_t));
+  if (!table || !ids) {
+    SDL_free(table);
+    SDL_free(ids);
+    return false;
+  }
+  uint32_t next_id = 0;
+  for (size_t i = 0; i < na + nb; i++) {
+    const DiffLine *line = i < na ? &a[i] : &b[i - na];
+    size_t j = line->hash & mask;
+    while (table[j] && !same_line(table[j], line))
+      j = (j + 1) & mask;
+    if (!table[j]) {
+      table[j] = line;
+      ids[j] = next_id++;
+    }
+    if (i < na)
+      D->a[i] = ids[j];
+    else
+      D->b[i - na] = ids[j];
+  }
+  SDL_free(table);
+  SDL_free(ids);
+  return true;
+}
+
+static void add_hunk(Diff *D, size_t a, size_t na, size_t b, size_t nb) {
+  if (na == 0 && nb == 0) return;
+  if (D->nhunks > 0) {
+    size_t *last = &D->hunks[(D->nhunks - 1) * 4];
+    if (last[0] + last[1] == a && last[2] + last[3] == b) {
+      last[1] += na;
+      last[3] += nb;
+      return;
+    }
+  }
+  if (!grow((void **) &D->hunks, &D->hunks_capacity, (D->nhunks + 1) * 4, sizeof(size_t))) {
+    D->failed = true;
+    return;
+  }
+  size_t *hunk = &D->hunks[D->nhunks++ * 4];
+  hunk[0] = a, hunk[1] = na, hunk[2] = b, hunk[3] = nb;
+}
+
+/* finds a point of a shortest edit script of the lines `a` to `a + n` and
+   `b` to `b + m`, from the middle snake of the search from both ends (see
+   "An O(ND) Difference Algorithm and Its Variations", Myers 1986) */
+static bool bisect(Diff *D, size_t a, ptrdiff_t n, size_t b, ptrdiff_t m, ptrdiff_t *split_x, ptrdiff_t *split_y) {
+  const uint32_t *A = D->a + a, *B = D->b + b;
+  ptrdiff_t max_d = (n + m + 1) / 2, offset = max_d + 1, delta = n - m;
+  ptrdiff_t *v1 = D->v1, *v2 = D->v2;
+  for (ptrdiff_t i = 0; i < 2 * max_d + 3; i++)
+    v1[i] = v2[i] = -1;
+  v1[offset + 1] = v2[offset + 1] = 0;
+  bool front = delta % 2 != 0;
+  /* diagonals leaving the grid are skipped */
+  ptrdiff_t k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+  for (ptrdiff_t d = 0; d < max_d; d++) {
+    if (D->cost > MAX_DIFF_COST) return false;
+    for (ptrdiff_t k = -d + k1start; k <= d - k1end; k += 2) {
+      ptrdiff_t x = k == -d || (k != d && v1[offset + k - 1] < v1[offset + k + 1])
+        ? v1[offset + k + 1] : v1[offset + k - 1] + 1;
+      ptrdiff_t y = x - k, x0 = x;
+      while (x < n && y < m && A[x] == B[y]) x++, y++;
+      D->cost += x - x0 + 1;
+      v1[offset + k] = x;
+      if (x > n) {
+        k1end += 2;
+      } else if (y > m) {
+        k1start += 2;
+      } else if (front) {
+        ptrdiff_t k2 = offset + delta - k;
+        if (k2 >= 0 && k2 < 2 * max_d + 3 && v2[k2] != -1 && x >= n - v2[k2]) {
+          *split_x = x, *split_y = y;
+          return true;
+        }
+      }
+    }
+    for (ptrdiff_t k = -d + k2start; k <= d - k2end; k += 2) {
+      ptrdiff_t x = k == -d || (k != d && v2[offset + k - 1] < v2[offset + k + 1])
+        ? v2[offset + k + 1] : v2[offset + k - 1] + 1;
+      ptrdiff_t y = x - k, x0 = x;
+      while (x < n && y < m && A[n - x - 1] == B[m - y - 1]) x++, y++;
+      D->cost += x - x0 + 1;
+      v2[offset + k] = x;
+      if (x > n) {
+        k2end += 2;
+      } else if (y > m) {
+        k2start += 2;
+      } else if (!front) {
+        ptrdiff_t k1 = offset + delta - k;
+        if (k1 >= 0 && k1 < 2 * max_d + 3 && v1[k1] != -1 && v1[k1] >= n - x) {
+          *split_x = v1[k1], *split_y = v1[k1] - (k1 - offset);
+          return true;
+        }
+      }
+    }
+  }
+  return false;
+}
+
+static void diff_range(Diff *D, size_t a1, size_t a2, size_t b1, size_t b2) {
+  while (a1 < a2 && b1 < b2 && D->a[a1] == D->b[b1]) a1++, b1++;
+  while (a1 < a2 && b1 < b2 && D->a[a2 - 1] == D->b[b2 - 1]) a2--, b2--;
+  ptrdiff_t x, y;
+  if (a1 == a2 || b1 == b2 || !bisect(D, a1, a2 - a1, b1, b2 - b1, &x, &y)) {
+    /* nothing in common, or the search took too long */
+    add_hunk(D, a1, a2 - a1, b1, b2 - b1);
+    return;
+  }
+  diff_range(D, a1, a1 + x, b1, b1 + y);
+  diff_range(D, a1 + x, a2, b1 + y, b2);
+}
+
+/* finds the hunks of lines of `A` replaced by lines of `B`, comparing the
+   lines without their line ending */
+static bool diff_buffers(TextBuffer *A, TextBuffer *B, Diff *D) {
+  size_t na = P(A, A->root).lines, nb = P(B, B->root).lines, n = 0;
+  DiffLine *a = SDL_malloc((na + nb) * sizeof(DiffLine)), *b = a + na;
+  if (!a) return false;
+  get_diff_lines(A, A->root, a, &n);
+  n = 0;
+  get_diff_lines(B, B->root, b, &n);
+
+  /* most changes are small, so the common lines at both ends are skipped
+     before numbering the lines */
+  size_t prefix = 0, suffix = 0;
+  while (prefix < na && prefix < nb && same_line(&a[prefix], &b[prefix]))
+    prefix++;
+  while (suffix < na - prefix && suffix < nb - prefix
+         && same_line(&a[na - suffix - 1], &b[nb - suffix - 1]))
+    suffix++;
+  size_t ma = na - prefix - suffix, mb = nb - prefix - suffix;
+  if (ma == 0 || mb == 0) {
+    add_hunk(D, prefix, ma, prefix, mb);
+    SDL_free(a);
+    return !D->failed;
+  }
+
+  D->a = SDL_malloc((ma + mb) * sizeof(uint32_t));
+  D->v1 = SDL_malloc((ma + mb + 4) * 2 * sizeof(ptrdiff_t));
+  bool ok = D->a && D->v1;
+  if (ok) {
+    D->b = D->a + ma;
+    D->v2 = D->v1 + ma + mb + 4;
+    ok = number_lines(D, a + prefix, ma, b + prefix, mb);
+  }
+  SDL_free(a);
+  if (ok) {
+    diff_range(D, 0, ma, 0, mb);
+    for (size_t i = 0; i < D->nhunks; i++) {
+      D->hunks[i * 4] += prefix;
+      D->hunks[i * 4 + 2] += prefix;
+    }
+  }
+  SDL_free(D->a);
+  SDL_free(D->v1);
+  return ok && !D->failed;
+}
+
+
+/* Lua interface */
+
+static TextBuffer *new_buffer(lua_State *L) {
+  TextBuffer *B = lua_newuserdatauv(L, sizeof(TextBuffer), 1);
+  memset(B, 0, sizeof(TextBuffer));
+  luaL_setmetatable(L, API_TYPE_TEXT_BUFFER);
+  lua_newtable(L);
+  lua_setiuservalue(L, -2, 1);
+  B->seed = 2463534242u;
+  if (!store_init(&B->stores[ORIGINAL]) || !store_init(&B->stores[ADDED])
+      || !reserve_pieces(B, 2))
+    luaL_error(L, "Unable to allocate the text buffer");
+  memset(&P(B, NIL), 0, sizeof(Piece));
+  B->npieces = 1;
+  return B;
+}
+
+/* replaces the tree with a single piece of all the original lines */
+static void set_original_lines(TextBuffer *B) {
+  size_t n = B->stores[ORIGINAL].nlines;
+  B->root = n > 0 ? new_piece(B, ORIGINAL, 0, n, random_priority(B)) : NIL;
+}
+
+static void push_text(lua_State *L, Store *S, size_t start, size_t end) {
+  const char *text = S->text + start;
+  size_t len = end - start;
+  if (!S->mapped) {
+    lua_pushlstring(L, text, len);
+    return;
+  }
+  if (len > 0 && text[len - 1] == '\n') len--;
+  if (len > 0 && text[len - 1] == '\r') len--;
+  luaL_Buffer b;
+  char *line = luaL_buffinitsize(L, &b, len + 1);
+  memcpy(line, text, len);
+  line[len] = '\n';
+  luaL_pushresultsize(&b, len + 1);
+}
+
+static size_t get_line_count(lua_State *L, TextBuffer *B) {
+  check_loader(L, B, false);
+  if (!B->loader)
+    return P(B, B->root).lines;
+  SDL_LockMutex(B->loader->mutex);
+  size_t n = B->stores[ORIGINAL].nlines;
+  SDL_UnlockMutex(B->loader->mutex);
+  return n;
+}
+
+/* lines are usually read in order, so the last piece found is tried first */
+static void push_line(lua_State *L, TextBuffer *B, size_t i) {
+  if (B->loader) {
+    Store *S = &B->stores[ORIGINAL];
+    SDL_LockMutex(B->loader->mutex);
+    size_t start = S->starts[i], end = S->starts[i + 1];
+    SDL_UnlockMutex(B->loader->mutex);
+    push_text(L, S, start, end);
+    return;
+  }
+  int piece = B->last_piece;
+  size_t start = B->last_piece_start;
+  if (piece == NIL || i < start || i >= start + P(B, piece).count) {
+    piece = B->root;
+    start = 0;
+    for (;;) {
+      size_t before = P(B, P(B, piece).left).lines;
+      if (i < start + before) {
+        piece = P(B, piece).left;
+      } else if (i < start + before + P(B, piece).count) {
+        start += before;
+        break;
+      } else {
+        start += before + P(B, piece).count;
+        piece = P(B, piece).right;
+      }
+    }
+    B->last_piece = piece;
+    B->last_piece_start = start;
+  }
+  Store *S = &B->stores[P(B, piece).store];
+  size_t line = P(B, piece).first + i - start;
+  push_text(L, S, S->starts[line], S->starts[line + 1]);
+}
+
+/* replaces `remove` lines starting at line `at` by the strings at indexes
+   `first` to `last` of the stack, `at` being 0-based */
+static void splice(lua_State *L, TextBuffer *B, size_t at, size_t remove, int first, int last) {
+  if (B->loader)
+    luaL_error(L, "The text buffer is still loading");
+  size_t nlines = 0, len = 0;
+  for (int i = first; i <= last; i++) {
+    size_t line_len;
+    luaL_checklstring(L, i, &line_len);
+    len += line_len;
+    nlines++;
+  }
+  Store *S = &B->stores[ADDED];
+  if (!store_reserve(S, nlines, len) || !reserve_pieces(B, 3))
+    luaL_error(L, "Unable to allocate the text buffer");
+
+  int before, rest, removed, after;
+  split(B, B->root, at, &before, &rest);
+  split(B, rest, remove, &removed, &after);
+  free_pieces(B, removed);
+  int inserted = NIL;
+  if (nlines > 0) {
+    size_t store_first = S->nlines;
+    for (int i = first; i <= last; i++) {
+      size_t line_len;
+      const char *line = lua_tolstring(L, i, &line_len);
+      store_push(S, line, line_len);
+    }
+    inserted = new_piece(B, ADDED, store_first, nlines, random_priority(B));
+    B->added_used += len;
+  }
+  B->root = merge(B, merge(B, before, inserted), after);
+
+  if (S->len > MIN_COMPACT_SIZE && S->len > B->added_used * 2)
+    compact(B);
+
+  /* the lines after the edit moved, start a new cache */
+  B->last_piece = NIL;
+  lua_newtable(L);
+  lua_setiuservalue(L, 1, 1);
+  B->cached = 0;
+}
+
+/* replaces `remove` lines starting at line `at` by the lines of `text`, which
+   ends with a newline; the space in the added store and three pieces must
+   have been reserved */
+static void replace_lines(TextBuffer *B, size_t at, size_t remove, const char *text, size_t len) {
+  Store *S = &B->stores[ADDED];
+  int before, rest, removed, after;
+  split(B, B->root, at, &before, &rest);
+  split(B, rest, remove, &removed, &after);
+  free_pieces(B, removed);
+  size_t store_first = S->nlines, nlines = 0;
+  for (const char *p = text, *end = text + len; p < end; nlines++) {
+    const char *nl = memchr(p, '\n', end - p);
+    const char *e = nl ? nl + 1 : end;
+    store_push(S, p, e - p);
+    p = e;
+  }
+  int inserted = nlines > 0 ? new_piece(B, ADDED, store_first, nlines, random_priority(B)) : NIL;
+  B->added_used += len;
+  B->root = merge(B, merge(B, before, inserted), after);
+}
+
+
+static FILE *open_file(const char *path, uint64_t *size) {
+#ifdef _WIN32
+  LPWSTR wpath = utfconv_utf8towc(path);
+  FILE *fp = wpath ? _wfopen(wpath, L"rb") : NULL;
+  SDL_free(wpath);
+  struct _stat64 st;
+  bool ok = fp && _fstat64(_fileno(fp), &st) == 0;
+  if (ok && (st.st_mode & _S_IFDIR)) {
+#else
+  FILE *fp = fopen(path, "rb");
+  struct stat st;
+  bool ok = fp && fstat(fileno(fp), &st) == 0;
+  if (ok && S_ISDIR(st.st_mode)) {
+#endif
+    ok = false;
+    errno = EISDIR;
+  }
+  if (!ok) {
+    int error = errno;
+    if (fp) fclose(fp);
+    errno = error;
+    return NULL;
+  }
+  *size = st.st_size;
+  return fp;
+}
+
+/* starts finding the lines of the original store from a thread, reading them
+   from `fp` if the store isn't mapped, and waits for the first ones; if
+   `notify` is set, "loaded" events are sent with `id` as they are found */
+static void start_loader(lua_State *L, TextBuffer *B, FILE *fp, bool notify, lua_Integer id) {
+  Store *S = &B->stores[ORIGINAL];
+  Loader *loader = SDL_calloc(1, sizeof(Loader));
+  if (loader) {
+    loader->store = S;
+    loader->fp = fp;
+    loader->total = fp ? S->capacity - 1 : S->len;
+    loader->notify = notify;
+    loader->id = id;
+    loader->mutex = SDL_CreateMutex();
+    loader->batch_done = SDL_CreateCondition();
+    if (loader->mutex && loader->batch_done)
+      loader->thread = SDL_CreateThread(loader_thread, "textbuffer_loader", loader);
+  }
+  if (!loader || !loader->thread) {
+    if (fp) fclose(fp);
+    if (loader && loader->batch_done) SDL_DestroyCondition(loader->batch_done);
+    if (loader && loader->mutex) SDL_DestroyMutex(loader->mutex);
+    SDL_free(loader);
+    luaL_error(L, "Unable to create the loader thread: %s", SDL_GetError());
+    return;
+  }
+  B->loader = loader;
+
+  /* so that the buffer never looks empty, files read at once are loaded
+     when this returns */
+  SDL_LockMutex(loader->mutex);
+  while (S->nlines == 0 && !SDL_GetAtomicInt(&loader->done))
+    SDL_WaitCondition(loader->batch_done, loader->mutex);
+  SDL_UnlockMutex(loader->mutex);
+}
+
+static int f_new(lua_State *L) {
+  if (!lua_isnoneornil(L, 1)) luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  size_t n = lua_isnil(L, 1) ? 0 : luaL_len(L, 1), len = 0;
+  for (size_t i = 1; i <= n; i++) {
+    size_t line_len;
+    lua_rawgeti(L, 1, i);
+    if (!lua_isstring(L, -1))
+      return luaL_error(L, "invalid line %d, expected a string", (int) i);
+    lua_tolstring(L, -1, &line_len);
+    len += line_len;
+    lua_pop(L, 1);
+  }
+  TextBuffer *B = new_buffer(L);
+  Store *S = &B->stores[ORIGINAL];
+  if (!store_reserve(S, n, len))
+    return luaL_error(L, "Unable to allocate the text buffer");
+  for (size_t i = 1; i <= n; i++) {
+    size_t line_len;
+    lua_rawgeti(L, 1, i);
+    const char *line = lua_tolstring(L, -1, &line_len);
+    store_push(S, line, line_len);
+    lua_pop(L, 1);
+  }
+  set_original_lines(B);
+  return 1;
+}
+
+/* splits text the way Doc:load did with file:lines(), removing the carriage
+   return at the end of each line and making sure each ends with a newline */
+static int f_load(lua_State *L) {
+  size_t len;
+  const char *text = luaL_checklstring(L, 1, &len);
+  const char *end = text + len;
+  TextBuffer *B = new_buffer(L);
+  Store *S = &B->stores[ORIGINAL];
+  size_t nlines = count_lines(text, end);
+  if (!store_reserve(S, nlines ? nlines : 1, len + 1))
+    return luaL_error(L, "Unable to allocate the text buffer");
+
+  LineStats stats = { 0 };
+  for (const char *p = text; p < end;) {
+    const char *nl = memchr(p, '\n', end - p);
+    const char *e = nl ? nl : end;
+    add_line_stats(&stats, p, e);
+    if (e > p && e[-1] == '\r')
+      e--;
+    memcpy(S->text + S->len, p, e - p);
+    S->len += e - p;
+    S->text[S->len++] = '\n';
+    S->starts[++S->nlines] = S->len;
+    p = nl ? nl + 1 : end;
+  }
+  if (S->nlines == 0)
+    store_push(S, "\n", 1);
+  set_original_lines(B);
+  B->crlf = stats.crlf > 0;
+  push_line_stats(L, &stats);
+  return 2;
+}
+
+/* the lines keep their newline, so that they can be concatenated back */
+static int f_split_lines(lua_State *L) {
+  size_t len;
+  const char *text = luaL_checklstring(L, 1, &len);
+  const char *end = text + len;
+  size_t nlines = count_lines(text, end);
+  if (len == 0 || end[-1] == '\n') nlines++;
+  if (nlines > INT_MAX)
+    return luaL_error(L, "too many lines");
+  lua_createtable(L, (int) nlines, 0);
+  LineStats stats = { 0 };
+  const char *p = text;
+  for (size_t i = 1; i <= nlines; i++) {
+    const char *nl = p < end ? memchr(p, '\n', end - p) : NULL;
+    const char *e = nl ? nl + 1 : end;
+    add_line_stats(&stats, p, nl ? nl : end);
+    lua_pushlstring(L, p, e - p);
+    lua_rawseti(L, -2, i);
+    p = e;
+  }
+  push_line_stats(L, &stats);
+  return 2;
+}
+
+static int f_open(lua_State *L);
+
+static int f_map(lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  bool notify = !lua_isnoneornil(L, 2);
+  lua_Integer id = notify ? luaL_checkinteger(L, 2) : 0;
+  char *text = NULL;
+  uint64_t len = 0;
+#ifdef _WIN32
+  LPWSTR wpath = utfconv_utf8towc(path);
+  if (!wpath) {
+    lua_pushnil(L);
+    lua_pushstring(L, UTFCONV_ERROR_INVALID_CONVERSION);
+    return 2;
+  }
+  HANDLE file = CreateFileW(wpath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                            NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  SDL_free(wpath);
+  LARGE_INTEGER size;
+  bool ok = file != INVALID_HANDLE_VALUE && GetFileSizeEx(file, &size);
+  if (ok && size.QuadPart > 0 && (uint64_t) size.QuadPart <= SIZE_MAX) {
+    HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    text = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    ok = text != NULL;
+    if (mapping) CloseHandle(mapping);
+  }
+  int error = ok ? 0 : (int) GetLastError();
+  if (ok) len = size.QuadPart;
+  if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+  if (!ok) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: error %d", path, error);
+    return 2;
+  }
+#else
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  bool ok = fd >= 0 && fstat(fd, &st) == 0;
+  if (ok && st.st_size > 0 && (uint64_t) st.st_size <= SIZE_MAX) {
+    text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ok = text != MAP_FAILED;
+    if (!ok) text = NULL;
+  }
+  int error = errno;
+  if (ok) len = st.st_size;
+  if (fd >= 0) close(fd);
+  if (text && !guard_mapping(text, len)) {
+    /* reading the file is safer than crashing if it's truncated */
+    munmap(text, len);
+    return f_open(L);
+  }
+  if (!ok) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", path, strerror(error));
+    return 2;
+  }
+#endif
+  if (len > SIZE_MAX) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: file too large", path);
+    return 2;
+  }
+
+  TextBuffer *B = new_buffer(L);
+  Store *S = &B->stores[ORIGINAL];
+  if (!text) {
+    /* like an empty file loaded with textbuffer.load */
+    if (!store_reserve(S, 1, 1))
+      return luaL_error(L, "Unable to allocate the text buffer");
+    store_push(S, "\n", 1);
+    set_original_lines(B);
+    return 1;
+  }
+  S->text = text;
+  S->len = S->capacity = len;
+  S->mapped = true;
+  start_loader(L, B, NULL, notify, id);
+  if (!notify && !finish_loader(L, B, true)) {
+    lua_pushnil(L);
+    lua_insert(L, -2);
+    return 2;
+  }
+  return 1;
+}
+
+static int f_open(lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  bool notify = !lua_isnoneornil(L, 2);
+  lua_Integer id = notify ? luaL_checkinteger(L, 2) : 0;
+  uint64_t size = 0;
+  FILE *fp = open_file(path, &size);
+  if (!fp) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", path, strerror(errno));
+    return 2;
+  }
+  if (size >= SIZE_MAX) {
+    fclose(fp);
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: file too large", path);
+    return 2;
+  }
+  TextBuffer *B = new_buffer(L);
+  Store *S = &B->stores[ORIGINAL];
+  /* the lines are never longer than in the file, but the last one may get a
+     newline */
+  S->text = SDL_malloc(size + 1);
+  if (!S->text) {
+    fclose(fp);
+    return luaL_error(L, "Unable to allocate the text buffer");
+  }
+  S->capacity = size + 1;
+  start_loader(L, B, fp, notify, id);
+  /* nothing tells when the file is read without an id */
+  if (!notify && !finish_loader(L, B, true)) {
+    lua_pushnil(L);
+    lua_insert(L, -2);
+    return 2;
+  }
+  return 1;
+}
+
+static int f_buffer_splice(lua_State *L) {
+  TextBuffer *B = luaL_checkudata(L, 1, API_TYPE_TEXT_BUFFER);
+  size_t n = get_line_count(L, B);
+  lua_Integer at = luaL_checkinteger(L, 2);
+  lua_Integer remove = luaL_checkinteger(L, 3);
+  luaL_argcheck(L, at >= 1 && (lua_Unsigned) at <= n + 1, 2, "position out of bounds");
+  luaL_argcheck(L, remove >= 0, 3, "non-negative value expected");
+  if (!lua_isnoneornil(L, 4)) luaL_checktype(L, 4, LUA_TTABLE);
+  if ((lua_Unsigned) remove > n - at + 1)
+    remove = n - at + 1;
+
+  int count = lua_isnoneornil(L, 4) ? 0 : (int) luaL_len(L, 4);
+  lua_settop(L, 4);
+  luaL_checkstack(L, count, "too many lines");
+  for (int i = 1; i <= count; i++) {
+    lua_rawgeti(L, 4, i);
+    if (!lua_isstring(L, -1))
+      return luaL_error(L, "invalid line %d, expected a string", i);
+  }
+  splice(L, B, at - 1, remove, 5, 4 + count);
+  return 0;
+}
+
+static int f_buffer_index(lua_State *L) {
+  TextBuffer *B = luaL_checkudata(L, 1, API_TYPE_TEXT_BUFFER);
+  int isnum;
+  lua_Integer i = lua_tointegerx(L, 2, &isnum);
+  if (!isnum) {
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    return 1;
+  }
+  if (i < 1 || (lua_Unsigned) i > get_line_count(L, B)) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_getiuservalue(L, 1, 1);
+  if (lua_rawgeti(L, -1, i) != LUA_TNIL)
+    return 1;
+  lua_pop(L, 1);
+  if (B->cached >= MAX_CACHED_LINES) {
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setiuservalue(L, 1, 1);
+    lua_replace(L, -2);
+    B->cached = 0;
+  }
+  push_line(L, B, i - 1);
+  lua_pushvalue(L, -1);
+  lua_rawseti(L, -3, i);
+  B->cached++;
+  return 1;
+}
+
+/* only the last line can be removed by setting it to nil, like with
+   table.remove, as the buffer can't have holes */
+static int f_buffer_newindex(lua_State *L) {
+  TextBuffer *B = luaL_checkudata(L, 1, API_TYPE_TEXT_BUFFER);
+  size_t n = get_line_count(L, B);
+  lua_Integer i = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, i >= 1 && (lua_Unsigned) i <= n + 1, 2, "line out of bounds");
+  lua_settop(L, 3);
+  if (lua_isnil(L, 3)) {
+    if ((lua_Unsigned) i < n)
+      return luaL_error(L, "only the last line can be removed");
+    if ((lua_Unsigned) i == n)
+      splice(L, B, i - 1, 1, 4, 3);
+  } else {
+    splice(L, B, i - 1, (lua_Unsigned) i <= n ? 1 : 0, 3, 3);
+  }
+  return 0;
+}
+
+static int f_buffer_len(lua_State *L) {
+  TextBuffer *B = luaL_checkudata(L, 1, API_TYPE_TEXT_BUFFER);
+  lua_pushinteger(L, get_line_count(L, B));
+  return 1;
+}
+
+static int f_buffer_get_load_state(lua_State *L) {
+  TextBuffer *B = luaL_checkudata(L, 1, API_TYPE_TEXT_BUFFER);
+  if (B->loader)
+    SDL_SetAtomicInt(&B->loader->event_pending, 0);
+  check_loader(L, B, false);
+  size_t total = B->stores[ORIGINAL].len;
+  if (!B->loader) {
+    lua_pushboolean(L, false);
+    lua_pushinteger(L, total);
+    lua_pushinteger(L, total);
+    lua_pushboolean(L, B->crlf);
+    return 4;
+  }
+  SDL_LockMutex(B->loader->mutex);
+  lua_pushboolean(L, true);
+  lua_pushinteger(L, B->loader->loaded);
+  lua_pushinteger(L, B->loader->total);
+  lua_pushboolean(L, B->loader->crlf);
+  SDL_UnlockMutex(B->loader->mutex);
+  return 4;
+}
+
+static TextBuffer *check_loaded_buffer(lua_State *L) {
+  TextBuffer *B = luaL_checkudata(L, 1, API_TYPE_TEXT_BUFFER);
+  check_loader(L, B, false);
+  if (B->loader)
+    luaL_error(L, "The text buffer is still loading");
+  return B;
+}
+
+/* gets the 0-based line and column of the position at `idx`, the column
+   being clamped to the line, or just after it */
+static size_t check_position(lua_State *L, TextBuffer *B, int idx, size_t *col) {
+  lua_Integer line = luaL_checkinteger(L, idx);
+  lua_Integer c = luaL_checkinteger(L, idx + 1);
+  luaL_argcheck(L, line >= 1 && (lua_Unsigned) line <= P(B, B->root).lines, idx, "line out of bounds");
+  size_t len = get_line_length(B, line - 1);
+  *col = c < 1 ? 0 : (lua_Unsigned) c - 1 > len ? len : (size_t) c - 1;
+  return line - 1;
+}
+
+static int f_buffer_get_offset(lua_State *L) {
+  TextBuffer *B = check_loaded_buffer(L);
+  size_t col, line = check_position(L, B, 2, &col);
+  lua_pushinteger(L, get_line_offset(B, line) + col + 1);
+  return 1;
+}
+
+static int f_buffer_get_position(lua_State *L) {
+  TextBuffer *B = check_loaded_buffer(L);
+  lua_Integer offset = luaL_checkinteger(L, 2);
+  size_t total = P(B, B->root).bytes, col = 0, line = 0;
+  if (total > 0) {
+    offset = offset < 1 ? 1 : (lua_Unsigned) offset > total ? (lua_Integer) total : offset;
+    line = find_offset(B, offset - 1, &col);
+  }
+  lua_pushinteger(L, line + 1);
+  lua_pushinteger(L, col + 1);
+  return 2;
+}
+
+static int f_buffer_get_text(lua_State *L) {
+  TextBuffer *B = check_loaded_buffer(L);
+  TextRange R;
+  R.line1 = check_position(L, B, 2, &R.col1);
+  R.line2 = check_position(L, B, 4, &R.col2);
+  size_t start = get_line_offset(B, R.line1) + R.col1;
+  size_t end = get_line_offset(B, R.line2) + R.col2;
+  if (end <= start) {
+    lua_pushliteral(L, "");
+    return 1;
+  }
+  luaL_Buffer b;
+  char *text = luaL_buffinitsize(L, &b, end - start);
+  R.out = text;
+  copy_range(B, B->root, 0, &R);
+  luaL_pushresultsize(&b, R.out - text);
+  return 1;
+}
+
+/* an edit of `apply_edits`, with 0-based positions */
+typedef struct {
+  size_t line1, col1, line2, col2;
+  const char *text;
+  size_t len;
+  size_t new_line1, new_col1, new_line2, new_col2;
+} Edit;
+
+/* numbers that aren't integers, like math.huge, are clamped */
+static lua_Integer get_edit_field(lua_State *L, int t, size_t i) {
+  int isnum;
+  lua_rawgeti(L, t, i);
+  lua_Integer n = lua_tointegerx(L, -1, &isnum);
+  if (!isnum) {
+    lua_Number x = lua_tonumberx(L, -1, &isnum);
+    if (!isnum || x != x)
+      luaL_error(L, "invalid position at index %d", (int) i);
+    n = x >= (lua_Number) LUA_MAXINTEGER ? LUA_MAXINTEGER : x <= 0 ? 0 : (lua_Integer) x;
+  }
+  lua_pop(L, 1);
+  return n;
+}
+
+/* reads the position at index `i` of the edits, clamped to the text like
+   Doc:sanitize_position, so that sorted positions stay sorted */
+static void get_edit_position(lua_State *L, TextBuffer *B, size_t i, size_t *line, size_t *col) {
+  lua_Integer l = get_edit_field(L, 2, i), c = get_edit_field(L, 2, i + 1);
+  size_t n = P(B, B->root).lines;
+  if (l < 1) {
+    *line = 0, *col = 0;
+    return;
+  }
+  if ((lua_Unsigned) l > n)
+    *line = n - 1, c = LUA_MAXINTEGER;
+  else
+    *line = (size_t) l - 1;
+  size_t len = get_line_length(B, *line);
+  if (len > 0) len--;
+  *col = c < 1 ? 0 : (lua_Unsigned) c - 1 > len ? len : (size_t) c - 1;
+}
+
+static char *copy_line_part(TextBuffer *B, size_t line, size_t col1, size_t col2, char *out) {
+  TextRange R = { out, line, col1, line, col2 };
+  copy_range(B, B->root, 0, &R);
+  return R.out;
+}
+
+/* the new position of a position, the edits being applied */
+static void shift_position(Edit *edits, size_t n, size_t *line, size_t *col) {
+  /* the last edit starting before it */
+  size_t lo = 0, hi = n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (edits[mid].line1 < *line || (edits[mid].line1 == *line && edits[mid].col1 <= *col))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0) return;
+  Edit *e = &edits[lo - 1];
+  if (*line < e->line2 || (*line == e->line2 && *col <= e->col2)) {
+    *line = e->new_line1, *col = e->new_col1;
+  } else if (*line == e->line2) {
+    *col = e->new_col2 + *col - e->col2;
+    *line = e->new_line2;
+  } else {
+    *line = *line - e->line2 + e->new_line2;
+  }
+}
+
+/* replaces ranges of text sorted by position, each edit touching the same
+   lines as the previous one being applied with it in a single splice, and
+   moves the positions of the second table the way the edits move them */
+static int f_buffer_apply_edits(lua_State *L) {
+  TextBuffer *B = check_loaded_buffer(L);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  if (!lua_isnoneornil(L, 3)) luaL_checktype(L, 3, LUA_TTABLE);
+  lua_settop(L, 3);
+  size_t n = luaL_len(L, 2) / 5;
+  if (n > INT_MAX / 4)
+    return luaL_error(L, "too many edits");
+  Edit *edits = lua_newuserdatauv(L, (n > 0 ? n : 1) * sizeof(Edit), 0);
+
+  /* the removed text, an edit starting in the range of the previous one
+     starting at its end */
+  lua_createtable(L, (int) n, 0);
+  size_t start_line = 0, start_col = 0;
+  for (size_t i = 0; i < n; i++) {
+    Edit *e = &edits[i];
+    get_edit_position(L, B, i * 5 + 1, &e->line1, &e->col1);
+    get_edit_position(L, B, i * 5 + 3, &e->line2, &e->col2);
+    if (lua_rawgeti(L, 2, i * 5 + 5) != LUA_TSTRING)
+      return luaL_error(L, "invalid text at index %d, expected a string", (int) (i * 5 + 5));
+    e->text = lua_tolstring(L, -1, &e->len);
+    lua_pop(L, 1);
+    if (e->line1 < start_line || (e->line1 == start_line && e->col1 < start_col))
+      return luaL_error(L, "edit %d starts before the previous one", (int) (i + 1));
+    start_line = e->line1, start_col = e->col1;
+    if (i > 0) {
+      Edit *prev = &edits[i - 1];
+      if (e->line1 < prev->line2 || (e->line1 == prev->line2 && e->col1 < prev->col2))
+        e->line1 = prev->line2, e->col1 = prev->col2;
+    }
+    if (e->line2 < e->line1 || (e->line2 == e->line1 && e->col2 < e->col1))
+      e->line2 = e->line1, e->col2 = e->col1;
+    size_t start = get_line_offset(B, e->line1) + e->col1;
+    size_t end = get_line_offset(B, e->line2) + e->col2;
+    luaL_Buffer b;
+    char *text = luaL_buffinitsize(L, &b, end - start);
+    TextRange R = { text, e->line1, e->col1, e->line2, e->col2 };
+    if (end > start)
+      copy_range(B, B->root, 0, &R);
+    luaL_pushresultsize(&b, R.out - text);
+    lua_rawseti(L, 5, i + 1);
+  }
+
+  lua_createtable(L, (int) n * 4, 0);
+  lua_newtable(L);
+  int nruns = 0;
+  size_t delta_lines = 0; /* lines added before the run, wrapping if removed */
+  for (size_t i = 0, j; i < n; i = j) {
+    for (j = i + 1; j < n && edits[j].line1 == edits[j - 1].line2; j++);
+    size_t first = edits[i].line1 + delta_lines, last = edits[j - 1].line2 + delta_lines;
+    size_t last_len = get_line_length(B, last);
+    size_t len = edits[i].col1 + last_len - edits[j - 1].col2;
+    for (size_t k = i; k < j; k++) {
+      len += edits[k].len;
+      if (k + 1 < j) len += edits[k + 1].col1 - edits[k].col2;
+    }
+
+    /* the new lines of the run, tracking the positions of the edits */
+    luaL_Buffer b;
+    char *text = luaL_buffinitsize(L, &b, len);
+    char *out = copy_line_part(B, first, 0, edits[i].col1, text);
+    const char *line_start = text;
+    size_t line = first;
+    for (size_t k = i; k < j; k++) {
+      Edit *e = &edits[k];
+      e->new_line1 = line, e->new_col1 = out - line_start;
+      memcpy(out, e->text, e->len);
+      for (const char *nl = memchr(out, '\n', e->len); nl; nl = memchr(nl + 1, '\n', out + e->len - nl - 1)) {
+        line++;
+        line_start = nl + 1;
+      }
+      out += e->len;
+      e->new_line2 = line, e->new_col2 = out - line_start;
+      if (k + 1 < j)
+        out = copy_line_part(B, first + e->line2 - edits[i].line1, e->col2, edits[k + 1].col1, out);
+    }
+    out = copy_line_part(B, last, edits[j - 1].col2, last_len, out);
+    size_t new_count = line - first + 1, old_count = last - first + 1;
+
+    if (!store_reserve(&B->stores[ADDED], new_count, len) || !reserve_pieces(B, 3))
+      return luaL_error(L, "Unable to allocate the text buffer");
+    replace_lines(B, first, old_count, text, len);
+    luaL_pushresultsize(&b, 0);
+    lua_pop(L, 1);
+    delta_lines += new_count - old_count;
+
+    for (size_t k = i; k < j; k++) {
+      size_t values[4] = { edits[k].new_line1 + 1, edits[k].new_col1 + 1, edits[k].new_line2 + 1, edits[k].new_col2 + 1 };
+      for (int v = 0; v < 4; v++) {
+        lua_pushinteger(L, values[v]);
+        lua_rawseti(L, 6, k * 4 + v + 1);
+      }
+    }
+    size_t run[3] = { first + 1, old_count, new_count };
+    for (int v = 0; v < 3; v++) {
+      lua_pushinteger(L, run[v]);
+      lua_rawseti(L, 7, ++nruns);
+    }
+  }
+
+  if (!lua_isnil(L, 3)) {
+    size_t npositions = luaL_len(L, 3) / 2;
+    for (size_t i = 0; i < npositions; i++) {
+      lua_Integer l = get_edit_field(L, 3, i * 2 + 1), c = get_edit_field(L, 3, i * 2 + 2);
+      if (l < 1 || c < 1) continue;
+      size_t line = l - 1, col = c - 1;
+      shift_position(edits, n, &line, &col);
+      lua_pushinteger(L, line + 1);
+      lua_rawseti(L, 3, i * 2 + 1);
+      lua_pushinteger(L, col + 1);
+      lua_rawseti(L, 3, i * 2 + 2);
+    }
+  }
+
+  Store *S = &B->stores[ADDED];
+  if (n > 0) {
+    if (S->len > MIN_COMPACT_SIZE && S->len > B->added_used * 2)
+      compact(B);
+    B->last_piece = NIL;
+    lua_newtable(L);
+    lua_setiuservalue(L, 1, 1);
+    B->cached = 0;
+  }
+  lua_pushvalue(L, 5);
+  lua_pushvalue(L, 6);
+  lua_pushvalue(L, 7);
+  return 3;
+}
+
+/* the other buffer may still be loading, it's waited for */
+static int f_buffer_diff(lua_State *L) {
+  TextBuffer *A = check_loaded_buffer(L);
+  TextBuffer *B = luaL_checkudata(L, 2, API_TYPE_TEXT_BUFFER);
+  check_loader(L, B, true);
+  Diff D;
+  memset(&D, 0, sizeof(Diff));
+  if (!diff_buffers(A, B, &D)) {
+    SDL_free(D.hunks);
+    return luaL_error(L, "Unable to allocate the diff");
+  }
+  if (D.nhunks > INT_MAX / 4) {
+    SDL_free(D.hunks);
+    return luaL_error(L, "too many hunks");
+  }
+  lua_createtable(L, (int) D.nhunks * 4, 0);
+  for (size_t i = 0; i < D.nhunks * 4; i++) {
+    /* the starts are 1-based */
+    lua_pushinteger(L, D.hunks[i] + (i % 2 == 0));
+    lua_rawseti(L, -2, i + 1);
+  }
+  SDL_free(D.hunks);
+  return 1;
+}
+
+static int f_buffer_get_size(lua_State *L) {
+  TextBuffer *B = check_loaded_buffer(L);
+  lua_pushinteger(L, P(B, B->root).bytes);
+  return 1;
+}
+
+static int f_buffer_detach(lua_State *L) {
+  TextBuffer *B = luaL_checkudata(L, 1, API_TYPE_TEXT_BUFFER);
+  check_loader(L, B, true);
+  if (B->saves > 0 && B->stores[ORIGINAL].mapped)
+    return luaL_error(L, "The text buffer is being saved");
+  if (is_mapping_truncated(&B->stores[ORIGINAL]))
+    return luaL_error(L, "The mapped file was truncated");
+  if (!detach(B))
+    return luaL_error(L, "Unable to allocate the text buffer");
+  return 0;
+}
+
+/* the file is written to a temporary file that replaces it once complete,
+   or in place when no file can be created in its directory */
+static int f_buffer_save(lua_State *L) {
+  TextBuffer *B = luaL_checkudata(L, 1, API_TYPE_TEXT_BUFFER);
+  const char *path = luaL_checkstring(L, 2);
+  bool crlf = lua_toboolean(L, 3);
+  bool notify = !lua_isnoneornil(L, 4);
+  lua_Integer id = notify ? luaL_checkinteger(L, 4) : 0;
+  check_loader(L, B, true);
+  Store *S = &B->stores[ORIGINAL];
+  /* the truncated part of the file would be written as NUL bytes */
+  if (is_mapping_truncated(S))
+    return luaL_error(L, "The mapped file was truncated");
+#ifdef _WIN32
+  /* the mapping would prevent the file from being replaced */
+  if (S->mapped && (B->saves > 0 || !detach(B)))
+    return luaL_error(L, "Unable to detach the text buffer");
+#endif
+
+  Saver *saver = lua_newuserdatauv(L, sizeof(Saver), 1);
+  memset(saver, 0, sizeof(Saver));
+  luaL_setmetatable(L, API_TYPE_TEXT_BUFFER_SAVE);
+  lua_pushvalue(L, 1);
+  lua_setiuservalue(L, -2, 1);
+  saver->buffer = B;
+  saver->crlf = crlf;
+  saver->notify = notify;
+  saver->id = id;
+
+#ifdef _WIN32
+  saver->path = SDL_strdup(path);
+#else
+  /* replace the target of symbolic links, not the links */
+  char *target = realpath(path, NULL);
+  saver->path = SDL_strdup(target ? target : path);
+  free(target);
+  /* the directory being writable doesn't allow writing read-only files */
+  if (saver->path && access(saver->path, W_OK) != 0 && errno != ENOENT) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", path, strerror(errno));
+    return 2;
+  }
+#endif
+  int npieces = B->npieces - 1 - B->nfree;
+  saver->segments = SDL_malloc((npieces > 0 ? npieces : 1) * sizeof(Segment));
+  saver->added = SDL_malloc(B->added_used > 0 ? B->added_used : 1);
+  if (!saver->path || !saver->segments || !saver->added)
+    return luaL_error(L, "Unable to allocate the text buffer");
+
+  saver->fp = open_temp_file(saver->path, &saver->temp_path);
+  if (!saver->fp) {
+    /* the mapped file may be the one written */
+    if (S->mapped && (B->saves > 0 || !detach(B)))
+      return luaL_error(L, "Unable to detach the text buffer");
+    saver->fp = open_in_place(saver->path);
+  }
+  if (!saver->fp) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", path, strerror(errno));
+    return 2;
+  }
+
+  size_t added_len = 0;
+  snapshot_pieces(B, B->root, saver, &added_len);
+  saver->thread = SDL_CreateThread(saver_thread, "textbuffer_saver", saver);
+  if (!saver->thread)
+    return luaL_error(L, "Unable to create the saver thread: %s", SDL_GetError());
+  B->saves++;
+  return 1;
+}
+
+static int buffer_next(lua_State *L) {
+  lua_Integer i = luaL_checkinteger(L, 2) + 1;
+  lua_pushinteger(L, i);
+  return lua_geti(L, 1, i) == LUA_TNIL ? 1 : 2;
+}
+
+static int f_buffer_pairs(lua_State *L) {
+  luaL_checkudata(L, 1, API_TYPE_TEXT_BUFFER);
+  lua_pushcfunction(L, buffer_next);
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, 0);
+  return 3;
+}
+
+static int f_buffer_gc(lua_State *L) {
+  TextBuffer *B = luaL_checkudata(L, 1, API_TYPE_TEXT_BUFFER);
+  if (B->loader) {
+    SDL_SetAtomicInt(&B->loader->cancel, 1);
+    stop_loader(B);
+  }
+  store_free(&B->stores[ORIGINAL]);
+  store_free(&B->stores[ADDED]);
+  SDL_free(B->pieces);
+  memset(B, 0, sizeof(TextBuffer));
+  return 0;
+}
+
+static int f_save_wait(lua_State *L) {
+  Saver *saver = luaL_checkudata(L, 1, API_TYPE_TEXT_BUFFER_SAVE);
+  if (saver->thread)
+    finish_saver(saver);
+  if (saver->failed) {
+    lua_pushnil(L);
+    lua_pushstring(L, saver->error);
+    return 2;
+  }
+  lua_pushboolean(L, true);
+  return 1;
+}
+
+static int f_save_gc(lua_State *L) {
+  Saver *saver = luaL_checkudata(L, 1, API_TYPE_TEXT_BUFFER_SAVE);
+  if (saver->thread) {
+    finish_saver(saver);
+  } else if (saver->fp) {
+    /* the save failed before starting */
+    fclose(saver->fp);
+    if (saver->temp_path) remove_file(saver->temp_path);
+    saver->fp = NULL;
+  }
+  free_saver(saver);
+  return 0;
+}
+
+static int loaded_event_callback(lua_State *L, SDL_Event *e) {
+  lua_pushstring(L, "loaded");
+  lua_pushinteger(L, (intptr_t) e->user.data1);
+  return 2;
+}
+
+static int saved_event_callback(lua_State *L, SDL_Event *e) {
+  lua_pushstring(L, "saved");
+  lua_pushinteger(L, (intptr_t) e->user.data1);
+  return 2;
+}
+
+
+static const luaL_Reg bufferLib[] = {
+  { "__newindex", f_buffer_newindex },
+  { "__len",      f_buffer_len      },
+  { "__pairs",    f_buffer_pairs    },
+  { "__gc",       f_buffer_gc       },
+  { NULL, NULL }
+};
+
+static const luaL_Reg bufferMethods[] = {
+  { "splice",         f_buffer_splice         },
+  { "get_load_state", f_buffer_get_load_state },
+  { "detach",         f_buffer_detach         },
+  { "get_offset",     f_buffer_get_offset     },
+  { "get_position",   f_buffer_get_position   },
+  { "get_text",       f_buffer_get_text       },
+  { "apply_edits",    f_buffer_apply_edits    },
+  { "diff",           f_buffer_diff           },
+  { "get_size",       f_buffer_get_size       },
+  { "save",           f_buffer_save           },
+  { NULL, NULL }
+};
+
+static const luaL_Reg saveLib[] = {
+  { "wait", f_save_wait },
+  { "__gc", f_save_gc   },
+  { NULL, NULL }
+};
+
+static const luaL_Reg lib[] = {
+  { "new",         f_new         },
+  { "load",        f_load        },
+  { "map",         f_map         },
+  { "open",        f_open        },
+  { "split_lines", f_split_lines },
+  { NULL, NULL }
+};
+
+int luaopen_textbuffer(lua_State *L) {
+  luaL_newmetatable(L, API_TYPE_TEXT_BUFFER);
+  luaL_setfuncs(L, bufferLib, 0);
+  /* integer keys are lines, the others are methods */
+  luaL_newlib(L, bufferMethods);
+  lua_pushcclosure(L, f_buffer_index, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, API_TYPE_TEXT_BUFFER_SAVE);
+  luaL_setfuncs(L, saveLib, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  if (!register_custom_event("loaded", loaded_event_callback))
+    return luaL_error(L, "Unable to register custom loaded event: %s", SDL_GetError());
+  if (!register_custom_event("saved", saved_event_callback))
+    return luaL_error(L, "Unable to register custom saved event: %s", SDL_GetError());
+
+  luaL_newlib(L, lib);
+  return 1;
+}
@@ -0,0 +1,1884 @@
+#include "api.h"
+#include "custom_events.h"
+#include "../renderer.h"
+
+#define PCRE2_CODE_UNIT_WIDTH 8
+
+#include <SDL3/SDL.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pcre2.h>
+
+/* Native implementation of core.tokenizer.tokenize.
+ *
+ * Syntaxes are compiled once into a NativeSyntax userdata, keeping a copy of
+ * the patterns (with the '^' of whole line patterns removed) and the regexes
+ * already compiled. Tokenizing works on byte offsets and produces the same
+ * tokens and states as the Lua implementation, see data/core/tokenizer.lua
+ * for a description of the state string.
+ *
+ * To avoid trying every pattern at every position, the bytes each pattern
+ * can start with are computed on compilation, and only the patterns that can
+ * start with the current byte are tried, in their original order. Runs of
+ * bytes no pattern can start with are consumed at once.
+ *
+ * Tokens can also be returned packed into a TokenList, see "Token lists".
+ * Long lines keep checkpoints to tokenize them again after an edit only
+ * around it, see "Edits of long lines".
+ *
+ * Jobs tokenize ranges of lines on worker threads, see "Background jobs". */
+
+/* from utf8.c */
+const char *utf8extra_next(const char *s, const char *e);
+const char *utf8extra_prev(const char *s, const char *e);
+const char *utf8extra_decode(const char *s, unsigned int *val);
+const char *utf8extra_find(lua_State *L, const char *s, const char *es,
+                           const char *init, const char *p, size_t lp,
+                           int anchor, const char **match_end,
+                           const char **captures, int *ncaptures);
+int utf8extra_isvalid(const char *s, const char *e);
+
+/* must match LUA_MAXCAPTURES of utf8.c */
+#define MAX_CAPTURES 32
+#define MAX_STATE_LENGTH 256
+/* bytes tokenized between checks of the time limit */
+#define TIME_CHECK_INTERVAL 200
+#define SEARCH_CACHE_SIZE 4
+/* bytes between the checkpoints of long lines */
+#define CHECKPOINT_INTERVAL 4096
+/* bytes around an edit the patterns are assumed to look at when matching */
+#define EDIT_MARGIN 256
+/* lines tokenized by a job between notifications of new results */
+#define JOB_BATCH_LINES 64
+#define MAX_WORKERS 8
+
+/* ids of the token types interned on module load */
+#define TYPE_NORMAL 1
+#define TYPE_INCOMPLETE 2
+
+typedef struct NativeSyntax NativeSyntax;
+
+typedef struct {
+  char *source;
+  size_t len;
+  pcre2_code *re;
+  pcre2_match_data *md;
+  bool whole_line;
+  /* bytes a match can start with, unless any_first_byte */
+  unsigned char first_bytes[32];
+  bool any_first_byte;
+} PatternMatcher;
+
+typedef struct {
+  PatternMatcher match[2];  /* start and end delimiters */
+  int *types;
+  int ntypes;
+  bool type_is_table;
+  /* the type was a table, replaced by its first type as there are no
+     captures */
+  bool type_without_captures;
+  bool is_pair;
+  bool disabled;
+  bool reported;
+  bool has_escape;
+  unsigned int escape;
+  NativeSyntax *subsyntax;
+} NativePattern;
+
+typedef struct {
+  char *text;
+  size_t len;
+  int type;
+} Symbol;
+
+struct NativeSyntax {
+  NativePattern *patterns;
+  int npatterns;
+  /* copy of syntax.symbols for jobs, which can't access the Lua table */
+  Symbol *symbols;
+  size_t symbols_capacity;
+  /* indices of the patterns that can match at each byte, in order and
+     without the whole line ones, the ones for byte c start at
+     dispatch[dispatch_start[c]] */
+  int *dispatch;
+  int dispatch_start[257];
+};
+
+typedef struct {
+  int type;
+  size_t start, end;
+  bool whitespace;
+} Token;
+
+/* consecutive tokens covering a whole line, the text of the line is the
+   uservalue of the userdata */
+typedef struct {
+  size_t ntokens;
+  uint32_t *ends;
+  uint16_t *types;
+  /* the states at the checkpoints are stored one after the other, each one
+     from checkpoint_states[i] to checkpoint_states[i + 1] */
+  size_t ncheckpoints;
+  uint32_t *checkpoint_offsets;
+  uint32_t *checkpoint_states;
+  unsigned char *states;
+} TokenList;
+
+/* position where tokenizing can start again with the state it had there */
+typedef struct {
+  size_t offset;
+  int state_len;
+  unsigned char state[MAX_STATE_LENGTH];
+} Checkpoint;
+
+/* the tokens of the line before it was edited, the texts only differ between
+   the same prefix and suffix */
+typedef struct {
+  TokenList *list;
+  const char *text;
+  size_t old_end, new_end;
+  /* first checkpoint of the list to converge to */
+  size_t next;
+} Previous;
+
+typedef struct {
+  size_t start, end;
+  size_t captures[MAX_CAPTURES];
+  int ncaptures;
+} Match;
+
+/* Result of an unanchored search, every position from `from` up to the match
+ * was tried, so it's also the result when searching from any of them. This
+ * avoids searching again for a far away end delimiter from every position of
+ * a long line. */
+typedef struct {
+  PatternMatcher *pm;
+  size_t from;
+  bool found;
+  Match m;
+} SearchResult;
+
+/* stack slots used while tokenizing */
+enum {
+  SLOT_BASE = 1, SLOT_TEXT, SLOT_STATE, SLOT_RESUME, SLOT_MAX_TIME, SLOT_REPORT,
+  SLOT_SYNTAX, SLOT_SYMBOLS, SLOT_TOKENS, SLOT_TYPES, SLOT_CHECKPOINTS
+};
+
+typedef struct {
+  lua_State *L;
+  /* running in a job, where only SLOT_TOKENS of the Lua stack is used */
+  bool detached;
+  pcre2_match_data *md;
+  const char *text;
+  size_t len;
+  Token *tokens;
+  size_t ntokens, capacity;
+  /* kept alive in SLOT_CHECKPOINTS, never added by jobs */
+  Checkpoint *checkpoints;
+  size_t ncheckpoints, checkpoints_capacity, next_checkpoint;
+  Previous *prev;
+  unsigned char state[MAX_STATE_LENGTH];
+  int state_len;
+  NativeSyntax *base, *current;
+  NativePattern *subsyntax_info;
+  int current_pattern_idx;
+  int current_level;
+  int utf8_valid;  /* -1 when not checked yet */
+  SearchResult searches[SEARCH_CACHE_SIZE];
+  int next_search;
+} Tokenizer;
+
+
+static int intern_type(lua_State *L, int types_idx) {
+  /* the type string is on top of the stack, and gets popped */
+  lua_pushvalue(L, -1);
+  lua_rawget(L, types_idx);
+  int id = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  if (id == 0) {
+    id = lua_rawlen(L, types_idx) + 1;
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, types_idx, id);
+    lua_pushinteger(L, id);
+    lua_rawset(L, types_idx);
+  } else {
+    lua_pop(L, 1);
+  }
+  return id;
+}
+
+
+/* Syntax compilation */
+
+static void add_first_byte(PatternMatcher *m, unsigned int c) {
+  m->first_bytes[c >> 3] |= 1 << (c & 7);
+}
+
+static bool may_start_with(PatternMatcher *m, unsigned char c) {
+  return m->any_first_byte || (m->first_bytes[c >> 3] >> (c & 7)) & 1;
+}
+
+/* Adds the bytes a match of the single character pattern item p can start
+ * with, by trying it on every ASCII character. Only literals are exact for
+ * non-ASCII characters. Returns false if the item is too long to try. */
+static bool add_item_first_bytes(lua_State *L, PatternMatcher *m, const char *p, const char *ep) {
+  if (*p != '%' && *p != '[' && *p != '.' && (unsigned char) *p >= 0x80) {
+    add_first_byte(m, (unsigned char) *p);
+    return true;
+  }
+  /* the matcher looks past the end of the pattern for a quantifier */
+  char item[128];
+  if (ep - p >= (ptrdiff_t) sizeof(item)) return false;
+  memcpy(item, p, ep - p);
+  item[ep - p] = '\0';
+  for (unsigned int c = 0; c < 0x80; c++) {
+    /* terminated like Lua strings, as the matcher may look at the next byte */
+    char s[2] = { (char) c, '\0' };
+    const char *caps[MAX_CAPTURES], *end;
+    int ncaptures;
+    if (utf8extra_find(L, s, s + 1, s, item, ep - p, 1, &end, caps, &ncaptures))
+      add_first_byte(m, c);
+  }
+  for (unsigned int c = 0x80; c < 0x100; c++)
+    add_first_byte(m, c);
+  return true;
+}
+
+/* Returns false if the Lua pattern can match the empty string, or starts
+ * with an item that isn't analyzed, so it may match anywhere. */
+static bool lua_pattern_first_bytes(lua_State *L, PatternMatcher *m, const char *p, const char *ep) {
+  while (p < ep) {
+    const char *e;
+    switch (*p) {
+      case '(': case ')':
+        /* captures don't consume input */
+        p++;
+        continue;
+      case '$':
+        if (p + 1 == ep) return false;
+        e = p + 1;
+        break;
+      case '%':
+        if (p + 1 == ep) return false;
+        if (p[1] == 'b') {
+          if (p + 3 > ep) return false;
+          add_first_byte(m, (unsigned char) p[2]);
+          return true;
+        }
+        /* frontiers and back references */
+        if (p[1] == 'f' || (p[1] >= '0' && p[1] <= '9')) return false;
+        e = utf8extra_next(p + 1, ep);
+        break;
+      case '[':
+        e = p + 1;
+        if (e < ep && *e == '^') e++;
+        do {
+          if (e >= ep) return false;
+          if (*e == '%') e++;
+          e++;
+        } while (e >= ep || *e != ']');
+        e++;
+        break;
+      default:
+        e = utf8extra_next(p, ep);
+        break;
+    }
+    if (!add_item_first_bytes(L, m, p, e)) return false;
+    /* an optional item lets the match start with the next one */
+    if (e < ep && (*e == '*' || *e == '?' || *e == '-')) {
+      p = e + 1;
+      continue;
+    }
+    return true;
+  }
+  return false;
+}
+
+static bool regex_first_bytes(PatternMatcher *m) {
+  uint32_t min_length, type;
+  const uint8_t *bitmap = NULL;
+  if (pcre2_pattern_info(m->re, PCRE2_INFO_MINLENGTH, &min_length) != 0 || min_length == 0)
+    return false;
+  pcre2_pattern_info(m->re, PCRE2_INFO_FIRSTCODETYPE, &type);
+  if (type == 1) {
+    uint32_t c;
+    pcre2_pattern_info(m->re, PCRE2_INFO_FIRSTCODEUNIT, &c);
+    /* it isn't reported whether it's matched caselessly */
+    add_first_byte(m, c);
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+      add_first_byte(m, c ^ 0x20);
+    else if (c >= 0x80)
+      for (c = 0x80; c < 0x100; c++) add_first_byte(m, c);
+    return true;
+  }
+  if (pcre2_pattern_info(m->re, PCRE2_INFO_FIRSTBITMAP, &bitmap) == 0 && bitmap) {
+    memcpy(m->first_bytes, bitmap, sizeof(m->first_bytes));
+    return true;
+  }
+  return false;
+}
+
+static bool matcher_has_captures(PatternMatcher *m) {
+  if (m->re) {
+    uint32_t count;
+    return pcre2_pattern_info(m->re, PCRE2_INFO_CAPTURECOUNT, &count) != 0 || count > 0;
+  }
+  const char *p = m->source, *ep = m->source + m->len;
+  while (p < ep) {
+    switch (*p++) {
+      case '(':
+        return true;
+      case '%':
+        /* the delimiters of %b may be parentheses */
+        p += p < ep && *p == 'b' ? 3 : 1;
+        break;
+      case '[':
+        if (p < ep && *p == '^') p++;
+        do {
+          if (p >= ep) return false;
+          if (*p == '%') p++;
+          p++;
+        } while (p < ep && *p != ']');
+        p++;
+        break;
+    }
+  }
+  return false;
+}
+
+static bool compile_matcher(lua_State *L, PatternMatcher *m, int idx, bool is_regex, int whole_line) {
+  size_t len;
+  const char *source = lua_tolstring(L, idx, &len);
+  if (!source) return false;
+  if (whole_line < 0) {
+    /* not known yet by the Lua tokenizer, detect it the same way */
+    whole_line = source[0] == '^';
+    if (whole_line) { source++; len--; }
+  }
+  m->whole_line = whole_line;
+  m->source = SDL_malloc(len + 1);
+  memcpy(m->source, source, len + 1);
+  m->len = len;
+  if (is_regex) {
+    int errcode;
+    PCRE2_SIZE erroffset;
+    m->re = pcre2_compile((PCRE2_SPTR) m->source, len, PCRE2_UTF, &errcode, &erroffset, NULL);
+    if (!m->re) return false;
+    pcre2_jit_compile(m->re, PCRE2_JIT_COMPLETE);
+    m->md = pcre2_match_data_create_from_pattern(m->re, NULL);
+    m->any_first_byte = !regex_first_bytes(m);
+  } else {
+    m->any_first_byte = !lua_pattern_first_bytes(L, m, m->source, m->source + len);
+  }
+  return true;
+}
+
+static int get_whole_line(lua_State *L, int pattern_idx, int i) {
+  int res = -1;
+  if (lua_getfield(L, pattern_idx, "whole_line") == LUA_TTABLE) {
+    if (lua_rawgeti(L, -1, i) != LUA_TNIL)
+      res = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  return res;
+}
+
+static void compile_pattern(lua_State *L, NativePattern *p, int pattern_idx, int types_idx) {
+  pattern_idx = lua_absindex(L, pattern_idx);
+  if (!lua_istable(L, pattern_idx)) {
+    p->disabled = true;
+    return;
+  }
+  p->disabled = lua_getfield(L, pattern_idx, "disabled") != LUA_TNIL && lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  bool is_regex = lua_getfield(L, pattern_idx, "pattern") == LUA_TNIL;
+  if (is_regex) {
+    lua_pop(L, 1);
+    lua_getfield(L, pattern_idx, "regex");
+  }
+  if (lua_istable(L, -1)) {
+    p->is_pair = true;
+    for (int i = 0; i < 2; i++) {
+      lua_rawgeti(L, -1, i + 1);
+      if (!compile_matcher(L, &p->match[i], -1, is_regex, get_whole_line(L, pattern_idx, i + 1)))
+        p->disabled = true;
+      lua_pop(L, 1);
+    }
+    if (lua_rawgeti(L, -1, 3) == LUA_TSTRING)
+      p->has_escape = utf8extra_decode(lua_tostring(L, -1), &p->escape) != NULL;
+    lua_pop(L, 1);
+  } else if (!compile_matcher(L, &p->match[0], -1, is_regex, get_whole_line(L, pattern_idx, 1))) {
+    p->disabled = true;
+  }
+  lua_pop(L, 1);
+
+  int type = lua_getfield(L, pattern_idx, "type");
+  if (type == LUA_TTABLE) {
+    p->type_is_table = true;
+    p->ntypes = lua_rawlen(L, -1);
+    p->types = SDL_calloc(p->ntypes + 1, sizeof(int));
+    p->types[0] = TYPE_NORMAL;
+    for (int i = 0; i < p->ntypes; i++) {
+      if (lua_rawgeti(L, -1, i + 1) == LUA_TSTRING)
+        p->types[i] = intern_type(L, types_idx);
+      else {
+        p->types[i] = TYPE_NORMAL;
+        lua_pop(L, 1);
+      }
+    }
+  } else {
+    p->types = SDL_calloc(1, sizeof(int));
+    p->ntypes = 1;
+    if (type == LUA_TSTRING) {
+      lua_pushvalue(L, -1);
+      p->types[0] = intern_type(L, types_idx);
+    } else {
+      p->types[0] = TYPE_NORMAL;
+    }
+  }
+  lua_pop(L, 1);
+
+  /* the Lua tokenizer replaces a table of types by its first type when the
+     pattern matches without captures, do it here once and for all, as jobs
+     share the compiled patterns; the syntax is fixed when reporting it */
+  if (p->type_is_table && p->match[0].source && !matcher_has_captures(&p->match[0])) {
+    p->type_is_table = false;
+    p->ntypes = 1;
+    p->type_without_captures = true;
+  }
+}
+
+static size_t hash_symbol(const char *text, size_t len) {
+  size_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char) text[i]) * 16777619u;
+  return h;
+}
+
+static int find_symbol(NativeSyntax *syntax, const char *text, size_t len) {
+  if (syntax->symbols_capacity == 0) return 0;
+  size_t mask = syntax->symbols_capacity - 1;
+  for (size_t i = hash_symbol(text, len) & mask;; i = (i + 1) & mask) {
+    Symbol *sym = &syntax->symbols[i];
+    if (!sym->text) return 0;
+    if (sym->len == len && memcmp(sym->text, text, len) == 0) return sym->type;
+  }
+}
+
+static void compile_symbols(lua_State *L, NativeSyntax *syntax, int symbols_idx, int types_idx) {
+  size_t count = 0, capacity = 8;
+  lua_pushnil(L);
+  while (lua_next(L, symbols_idx)) {
+    count++;
+    lua_pop(L, 1);
+  }
+  if (count == 0) return;
+  while (capacity < count * 2) capacity *= 2;
+  syntax->symbols = SDL_calloc(capacity, sizeof(Symbol));
+  syntax->symbols_capacity = capacity;
+  lua_pushnil(L);
+  while (lua_next(L, symbols_idx)) {
+    if (lua_type(L, -2) != LUA_TSTRING || lua_type(L, -1) != LUA_TSTRING) {
+      lua_pop(L, 1);
+      continue;
+    }
+    size_t len;
+    const char *text = lua_tolstring(L, -2, &len);
+    size_t i = hash_symbol(text, len) & (capacity - 1);
+    while (syntax->symbols[i].text)
+      i = (i + 1) & (capacity - 1);
+    syntax->symbols[i].text = SDL_malloc(len + 1);
+    memcpy(syntax->symbols[i].text, text, len + 1);
+    syntax->symbols[i].len = len;
+    syntax->symbols[i].type = intern_type(L, types_idx);
+  }
+}
+
+static void compile_dispatch(NativeSyntax *syntax) {
+  /* count the entries first, then fill them */
+  for (int pass = 0; pass < 2; pass++) {
+    int count = 0;
+    for (int c = 0; c < 256; c++) {
+      syntax->dispatch_start[c] = count;
+      for (int n = 0; n < syntax->npatterns; n++) {
+        NativePattern *p = &syntax->patterns[n];
+        if (p->disabled || p->match[0].whole_line || !may_start_with(&p->match[0], c))
+          continue;
+        if (syntax->dispatch) syntax->dispatch[count] = n;
+        count++;
+      }
+    }
+    syntax->dispatch_start[256] = count;
+    if (!syntax->dispatch) syntax->dispatch = SDL_malloc((count + 1) * sizeof(int));
+  }
+}
+
+static int f_syntax_gc(lua_State *L) {
+  NativeSyntax *syntax = luaL_checkudata(L, 1, API_TYPE_NATIVE_SYNTAX);
+  SDL_free(syntax->dispatch);
+  syntax->dispatch = NULL;
+  for (size_t i = 0; i < syntax->symbols_capacity; i++)
+    SDL_free(syntax->symbols[i].text);
+  SDL_free(syntax->symbols);
+  syntax->symbols = NULL;
+  syntax->symbols_capacity = 0;
+  for (int i = 0; i < syntax->npatterns; i++) {
+    NativePattern *p = &syntax->patterns[i];
+    for (int j = 0; j < 2; j++) {
+      SDL_free(p->match[j].source);
+      if (p->match[j].md) pcre2_match_data_free(p->match[j].md);
+      if (p->match[j].re) pcre2_code_free(p->match[j].re);
+    }
+    SDL_free(p->types);
+  }
+  SDL_free(syntax->patterns);
+  syntax->patterns = NULL;
+  syntax->npatterns = 0;
+  return 0;
+}
+
+static int f_syntax_get_pattern_count(lua_State *L) {
+  NativeSyntax *syntax = luaL_checkudata(L, 1, API_TYPE_NATIVE_SYNTAX);
+  lua_pushinteger(L, syntax->npatterns);
+  return 1;
+}
+
+static int f_syntax_set_subsyntax(lua_State *L) {
+  NativeSyntax *syntax = luaL_checkudata(L, 1, API_TYPE_NATIVE_SYNTAX);
+  int n = luaL_checkinteger(L, 2);
+  NativeSyntax *subsyntax = luaL_checkudata(L, 3, API_TYPE_NATIVE_SYNTAX);
+  luaL_argcheck(L, n >= 1 && n <= syntax->npatterns, 2, "invalid pattern index");
+  /* keep a reference to the subsyntax for as long as it's used */
+  lua_getiuservalue(L, 1, 1);
+  lua_pushvalue(L, 3);
+  lua_rawseti(L, -2, n);
+  syntax->patterns[n - 1].subsyntax = subsyntax;
+  return 0;
+}
+
+static int f_compile(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  int types_idx = lua_upvalueindex(1);
+  lua_getfield(L, 1, "patterns");
+  int npatterns = lua_istable(L, 2) ? lua_rawlen(L, 2) : 0;
+  /* the states store pattern indices as bytes */
+  if (npatterns > 255) {
+    lua_pushnil(L);
+    lua_pushstring(L, "syntaxes can't have more than 255 patterns");
+    return 2;
+  }
+
+  NativeSyntax *syntax = lua_newuserdatauv(L, sizeof(NativeSyntax), 1);
+  memset(syntax, 0, sizeof(NativeSyntax));
+  luaL_setmetatable(L, API_TYPE_NATIVE_SYNTAX);
+  lua_newtable(L);
+  lua_pushvalue(L, 1);
+  lua_setfield(L, -2, "syntax");
+  lua_setiuservalue(L, -2, 1);
+
+  syntax->patterns = SDL_calloc(npatterns + 1, sizeof(NativePattern));
+  syntax->npatterns = npatterns;
+  for (int i = 0; i < npatterns; i++) {
+    lua_rawgeti(L, 2, i + 1);
+    compile_pattern(L, &syntax->patterns[i], -1, types_idx);
+    lua_pop(L, 1);
+  }
+  compile_dispatch(syntax);
+  if (lua_getfield(L, 1, "symbols") == LUA_TTABLE)
+    compile_symbols(L, syntax, lua_gettop(L), types_idx);
+  lua_pop(L, 1);
+  return 1;
+}
+
+
+/* Token lists
+ *
+ * The tokens of a line packed as the end offset and type id of each one,
+ * which takes a fraction of the memory of a table of strings. They behave as
+ * read-only arrays of alternating types and texts, the texts are only
+ * created when indexed. The checkpoints of long lines are packed with them. */
+
+static void push_token_list(lua_State *L, const Token *tokens, size_t ntokens,
+                            const Checkpoint *checkpoints, size_t ncheckpoints, int text_idx) {
+  text_idx = lua_absindex(L, text_idx);
+  size_t states_len = 0;
+  for (size_t i = 0; i < ncheckpoints; i++)
+    states_len += checkpoints[i].state_len;
+  size_t size = sizeof(TokenList) + ntokens * (sizeof(uint32_t) + sizeof(uint16_t))
+    + (ncheckpoints * 2 + 1) * sizeof(uint32_t) + states_len;
+  TokenList *list = lua_newuserdatauv(L, size, 1);
+  list->ntokens = ntokens;
+  list->ncheckpoints = ncheckpoints;
+  list->ends = (uint32_t *) (list + 1);
+  list->checkpoint_offsets = list->ends + ntokens;
+  list->checkpoint_states = list->checkpoint_offsets + ncheckpoints;
+  list->types = (uint16_t *) (list->checkpoint_states + ncheckpoints + 1);
+  list->states = (unsigned char *) (list->types + ntokens);
+  for (size_t i = 0; i < ntokens; i++) {
+    list->ends[i] = tokens[i].end;
+    list->types[i] = tokens[i].type <= UINT16_MAX ? tokens[i].type : TYPE_NORMAL;
+  }
+  list->checkpoint_states[0] = 0;
+  for (size_t i = 0; i < ncheckpoints; i++) {
+    const Checkpoint *c = &checkpoints[i];
+    list->checkpoint_offsets[i] = c->offset;
+    memcpy(list->states + list->checkpoint_states[i], c->state, c->state_len);
+    list->checkpoint_states[i + 1] = list->checkpoint_states[i] + c->state_len;
+  }
+  luaL_setmetatable(L, API_TYPE_TOKEN_LIST);
+  lua_pushvalue(L, text_idx);
+  lua_setiuservalue(L, -2, 1);
+}
+
+static int f_token_list_index(lua_State *L) {
+  TokenList *list = luaL_checkudata(L, 1, API_TYPE_TOKEN_LIST);
+  lua_Integer i = lua_isinteger(L, 2) ? lua_tointeger(L, 2) : 0;
+  if (i < 1 || (lua_Unsigned) i > list->ntokens * 2) {
+    lua_pushnil(L);
+    return 1;
+  }
+  size_t n = (i - 1) / 2;
+  if (i % 2 == 1) {
+    lua_rawgeti(L, lua_upvalueindex(1), list->types[n]);
+  } else {
+    lua_getiuservalue(L, 1, 1);
+    const char *text = lua_tostring(L, -1);
+    size_t start = n > 0 ? list->ends[n - 1] : 0;
+    lua_pushlstring(L, text + start, list->ends[n] - start);
+  }
+  return 1;
+}
+
+static int f_token_list_len(lua_State *L) {
+  TokenList *list = luaL_checkudata(L, 1, API_TYPE_TOKEN_LIST);
+  lua_pushinteger(L, list->ntokens * 2);
+  return 1;
+}
+
+
+/* Tokenizing */
+
+static void push_token(Tokenizer *T, int type, size_t start, size_t end);
+
+static bool text_is_whitespace(lua_State *L, const char *text, size_t start, size_t end) {
+  for (size_t i = start; i < end; i++) {
+    unsigned char c = text[i];
+    if (c >= 0x80) {
+      /* use the same definition of %s as the Lua tokenizer for the rest */
+      const char *e, *caps[MAX_CAPTURES];
+      int ncaps;
+      return utf8extra_find(L, text + i, text + end, text + i, "%s*$", 4, 1, &e, caps, &ncaps) != NULL;
+    }
+    if (c != ' ' && (c < '\t' || c > '\r')) return false;
+  }
+  return true;
+}
+
+static bool is_whitespace(Tokenizer *T, size_t start, size_t end) {
+  return text_is_whitespace(T->L, T->text, start, end);
+}
+
+static void grow_tokens(Tokenizer *T) {
+  size_t capacity = T->capacity ? T->capacity * 2 : 64;
+  Token *tokens = lua_newuserdatauv(T->L, capacity * sizeof(Token), 0);
+  if (T->ntokens)
+    memcpy(tokens, T->tokens, T->ntokens * sizeof(Token));
+  lua_replace(T->L, SLOT_TOKENS);
+  T->tokens = tokens;
+  T->capacity = capacity;
+}
+
+static void push_token(Tokenizer *T, int type, size_t start, size_t end) {
+  if (end <= start) return;
+  if (T->ntokens > 0) {
+    Token *prev = &T->tokens[T->ntokens - 1];
+    if (prev->type == type || (type != TYPE_INCOMPLETE && prev->whitespace)) {
+      /* only the new part has to be checked, so merging stays linear */
+      prev->whitespace = prev->whitespace && is_whitespace(T, start, end);
+      prev->type = type;
+      prev->end = end;
+      return;
+    }
+  }
+  if (T->ntokens == T->capacity)
+    grow_tokens(T);
+  T->tokens[T->ntokens++] = (Token) { type, start, end, is_whitespace(T, start, end) };
+}
+
+static void add_checkpoint(Tokenizer *T, size_t offset) {
+  if (T->ncheckpoints == T->checkpoints_capacity) {
+    size_t capacity = T->checkpoints_capacity ? T->checkpoints_capacity * 2 : 16;
+    Checkpoint *checkpoints = lua_newuserdatauv(T->L, capacity * sizeof(Checkpoint), 0);
+    if (T->ncheckpoints)
+      memcpy(checkpoints, T->checkpoints, T->ncheckpoints * sizeof(Checkpoint));
+    lua_replace(T->L, SLOT_CHECKPOINTS);
+    T->checkpoints = checkpoints;
+    T->checkpoints_capacity = capacity;
+  }
+  Checkpoint *c = &T->checkpoints[T->ncheckpoints++];
+  c->offset = offset;
+  c->state_len = T->state_len;
+  memcpy(c->state, T->state, T->state_len);
+  T->next_checkpoint = offset + CHECKPOINT_INTERVAL;
+}
+
+static int get_symbol_type(Tokenizer *T, int type, size_t start, size_t end) {
+  lua_State *L = T->L;
+  if (T->detached) {
+    int symbol_type = find_symbol(T->current, T->text + start, end - start);
+    return symbol_type ? symbol_type : type;
+  }
+  if (!lua_istable(L, SLOT_SYMBOLS)) return type;
+  lua_pushlstring(L, T->text + start, end - start);
+  if (lua_rawget(L, SLOT_SYMBOLS) == LUA_TSTRING)
+    return intern_type(L, SLOT_TYPES);
+  lua_pop(L, 1);
+  return type;
+}
+
+static void push_tokens(Tokenizer *T, NativePattern *p, Match *m) {
+  if (m->ncaptures > 0) {
+    /* consecutive spans from the start of the match, to each capture and to
+       the end of the match, each one with its own type */
+    size_t start = m->start;
+    for (int i = 0; i <= m->ncaptures; i++) {
+      size_t fin = i < m->ncaptures ? m->captures[i] : m->end;
+      int type = p->type_is_table && i < p->ntypes ? p->types[i] : TYPE_NORMAL;
+      if (fin > start)
+        push_token(T, get_symbol_type(T, type, start, fin), start, fin);
+      start = fin;
+    }
+  } else {
+    push_token(T, get_symbol_type(T, p->types[0], m->start, m->end), m->start, m->end);
+  }
+}
+
+static void report_bad_pattern(Tokenizer *T, NativePattern *p, bool is_error, const char *msg, int a, int b) {
+  lua_State *L = T->L;
+  /* jobs leave the reports to the main thread */
+  if (T->detached || p->reported || !lua_isfunction(L, SLOT_REPORT)) return;
+  p->reported = true;
+  lua_pushvalue(L, SLOT_REPORT);
+  lua_pushboolean(L, is_error);
+  lua_getiuservalue(L, SLOT_SYNTAX, 1);
+  lua_getfield(L, -1, "syntax");
+  lua_remove(L, -2);
+  lua_pushinteger(L, p - T->current->patterns + 1);
+  lua_pushstring(L, msg);
+  lua_pushinteger(L, a);
+  lua_pushinteger(L, b);
+  lua_call(L, 6, 0);
+}
+
+static void set_current_syntax(Tokenizer *T, NativeSyntax *syntax) {
+  lua_State *L = T->L;
+  T->current = syntax;
+  if (T->detached) return;
+  lua_getiuservalue(L, SLOT_SYNTAX, 1);
+  lua_getfield(L, -1, "syntax");
+  lua_getfield(L, -1, "symbols");
+  lua_replace(L, SLOT_SYMBOLS);
+  lua_pop(L, 2);
+}
+
+static void enter_subsyntax(Tokenizer *T, NativePattern *p) {
+  lua_State *L = T->L;
+  if (T->detached) {
+    T->current = p->subsyntax;
+    return;
+  }
+  lua_getiuservalue(L, SLOT_SYNTAX, 1);
+  lua_rawgeti(L, -1, p - T->current->patterns + 1);
+  lua_replace(L, SLOT_SYNTAX);
+  lua_pop(L, 1);
+  set_current_syntax(T, p->subsyntax);
+}
+
+static void retrieve_syntax_state(Tokenizer *T) {
+  if (!T->detached) {
+    lua_pushvalue(T->L, SLOT_BASE);
+    lua_replace(T->L, SLOT_SYNTAX);
+  }
+  set_current_syntax(T, T->base);
+  T->subsyntax_info = NULL;
+  T->current_pattern_idx = 0;
+  T->current_level = 1;
+  for (int i = 0; i < T->state_len; i++) {
+    int target = T->state[i];
+    if (target == 0 || target > T->current->npatterns) break;
+    NativePattern *p = &T->current->patterns[target - 1];
+    if (p->subsyntax) {
+      enter_subsyntax(T, p);
+      T->subsyntax_info = p;
+      T->current_pattern_idx = 0;
+      T->current_level = i + 2;
+    } else {
+      T->current_pattern_idx = target;
+      break;
+    }
+  }
+}
+
+static void set_subsyntax_pattern_idx(Tokenizer *T, int pattern_idx) {
+  T->current_pattern_idx = pattern_idx;
+  if (T->current_level > T->state_len) {
+    if (T->state_len == MAX_STATE_LENGTH)
+      luaL_error(T->L, "subsyntaxes nested too deeply");
+    T->state[T->state_len++] = pattern_idx;
+  } else {
+    T->state[T->current_level - 1] = pattern_idx;
+  }
+}
+
+static void push_subsyntax(Tokenizer *T, NativePattern *p, int pattern_idx) {
+  set_subsyntax_pattern_idx(T, pattern_idx);
+  T->current_level++;
+  T->subsyntax_info = p;
+  enter_subsyntax(T, p);
+  T->current_pattern_idx = 0;
+}
+
+static void pop_subsyntax(Tokenizer *T) {
+  T->current_level--;
+  T->state_len = SDL_min(T->state_len, T->current_level);
+  set_subsyntax_pattern_idx(T, 0);
+  retrieve_syntax_state(T);
+}
+
+static bool match_at(Tokenizer *T, PatternMatcher *pm, size_t offset, bool anchor, Match *m) {
+  if (pm->re) {
+    /* pcre2 validates the whole subject on every call unless told otherwise,
+       so check it only once per line */
+    if (T->utf8_valid < 0)
+      T->utf8_valid = utf8extra_isvalid(T->text, T->text + T->len);
+    uint32_t options = (anchor ? PCRE2_ANCHORED : 0) | (T->utf8_valid ? PCRE2_NO_UTF_CHECK : 0);
+    /* like regex.find, the subject starts at the offset */
+    /* match data can't be shared between threads, jobs have their own */
+    pcre2_match_data *md = T->md ? T->md : pm->md;
+    int rc = pcre2_match(pm->re, (PCRE2_SPTR) T->text + offset, T->len - offset, 0,
+                         options, md, NULL);
+    if (rc < 0) {
+      if (rc != PCRE2_ERROR_NOMATCH) {
+        PCRE2_UCHAR buffer[120];
+        pcre2_get_error_message(rc, buffer, sizeof(buffer));
+        luaL_error(T->L, "regex matching error %d: %s", rc, buffer);
+      }
+      return false;
+    }
+    /* the ovector of a job was too small for all the groups */
+    if (rc == 0) rc = pcre2_get_ovector_count(md);
+    PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(md);
+    if (ovector[0] > ovector[1])
+      luaL_error(T->L, "regex matching error: \\K was used in an assertion to "
+                       " set the match start after its end");
+    m->start = offset + ovector[0];
+    m->end = offset + ovector[1];
+    m->ncaptures = SDL_min(rc - 1, MAX_CAPTURES);
+    for (int i = 0; i < m->ncaptures; i++) {
+      PCRE2_SIZE s = ovector[(i + 1) * 2];
+      m->captures[i] = s == PCRE2_UNSET ? T->len : offset + s;
+    }
+  } else {
+    const char *caps[MAX_CAPTURES], *end;
+    const char *s = utf8extra_find(T->L, T->text, T->text + T->len, T->text + offset,
+                                   pm->source, pm->len, anchor, &end, caps, &m->ncaptures);
+    if (!s) return false;
+    m->start = s - T->text;
+    m->end = end - T->text;
+    for (int i = 0; i < m->ncaptures; i++)
+      m->captures[i] = caps[i] - T->text;
+  }
+  return true;
+}
+
+static bool is_escaped(Tokenizer *T, NativePattern *p, size_t pos) {
+  int count = 0;
+  const char *s = T->text + pos;
+  while (s > T->text) {
+    unsigned int c;
+    s = utf8extra_prev(T->text, s);
+    if (!utf8extra_decode(s, &c) || c != p->escape) break;
+    count++;
+  }
+  return count % 2 == 1;
+}
+
+static bool search_text(Tokenizer *T, NativePattern *p, PatternMatcher *pm, size_t *offset, bool at_start, bool close, Match *m) {
+  size_t next = *offset;
+  for (;;) {
+    *offset = next;
+    /* if the pattern contained '^', allow matching only the whole line */
+    if (pm->whole_line && next > 0)
+      return false;
+    if (!match_at(T, pm, next, at_start || pm->whole_line, m))
+      return false;
+    if (!p->has_escape || !is_escaped(T, p, m->start))
+      return true;
+    if (at_start || !close)
+      return false;
+    /* the match is escaped, so look for the next one */
+    next = m->end > next ? m->end : (size_t) (utf8extra_next(T->text + next, T->text + T->len) - T->text);
+    if (next > T->len) return false;
+  }
+}
+
+static bool find_text(Tokenizer *T, NativePattern *p, size_t offset, bool at_start, bool close, Match *m) {
+  if (p->disabled) return false;
+  PatternMatcher *pm = &p->match[close && p->is_pair ? 1 : 0];
+  /* regexes see a subject starting at the offset, so their results can't be
+     reused from another offset */
+  if (at_start || pm->re || pm->whole_line)
+    return search_text(T, p, pm, &offset, at_start, close, m);
+  for (int i = 0; i < SEARCH_CACHE_SIZE; i++) {
+    SearchResult *r = &T->searches[i];
+    if (r->pm == pm && r->from <= offset && (!r->found || offset <= r->m.start)) {
+      if (r->found) *m = r->m;
+      return r->found;
+    }
+  }
+  SearchResult *r = &T->searches[T->next_search];
+  T->next_search = (T->next_search + 1) % SEARCH_CACHE_SIZE;
+  r->pm = pm;
+  r->found = search_text(T, p, pm, &offset, at_start, close, &r->m);
+  r->from = offset;
+  if (r->found) *m = r->m;
+  return r->found;
+}
+
+static bool check_time(Uint64 start_time, double max_time) {
+  return (SDL_GetPerformanceCounter() - start_time) / (double) SDL_GetPerformanceFrequency() > max_time;
+}
+
+/* takes back the tokens and checkpoints of a list before the offset, the text
+   before it must be the same */
+static void load_token_list(Tokenizer *T, TokenList *list, size_t i) {
+  for (size_t n = 0; n < list->ntokens && list->types[n] != TYPE_INCOMPLETE; n++) {
+    size_t start = n > 0 ? list->ends[n - 1] : 0, end = SDL_min(list->ends[n], i);
+    if (end <= start) break;
+    if (T->ntokens == T->capacity)
+      grow_tokens(T);
+    T->tokens[T->ntokens++] = (Token) { list->types[n], start, end, is_whitespace(T, start, end) };
+  }
+  for (size_t n = 0; n < list->ncheckpoints && list->checkpoint_offsets[n] < i; n++) {
+    int state_len = T->state_len;
+    unsigned char state[MAX_STATE_LENGTH];
+    memcpy(state, T->state, state_len);
+    T->state_len = list->checkpoint_states[n + 1] - list->checkpoint_states[n];
+    memcpy(T->state, list->states + list->checkpoint_states[n], T->state_len);
+    add_checkpoint(T, list->checkpoint_offsets[n]);
+    T->state_len = state_len;
+    memcpy(T->state, state, state_len);
+  }
+}
+
+/* loads the tokens of a partially tokenized line, returns the offset of the
+   first character to tokenize */
+static size_t load_resume(Tokenizer *T, int res_idx) {
+  lua_State *L = T->L;
+  size_t i = 0;
+  if (lua_getfield(L, SLOT_RESUME, "offset") == LUA_TNUMBER)
+    i = lua_tointeger(L, -1) - 1;
+  lua_settop(L, res_idx);
+  if (i > T->len) i = T->len;
+
+  size_t state_len;
+  lua_getfield(L, SLOT_RESUME, "state");
+  const char *state = lua_tolstring(L, -1, &state_len);
+  if (state) {
+    T->state_len = SDL_min(state_len, MAX_STATE_LENGTH);
+    memcpy(T->state, state, T->state_len);
+  }
+  lua_pop(L, 1);
+
+  TokenList *list = luaL_testudata(L, res_idx, API_TYPE_TOKEN_LIST);
+  if (list) {
+    /* take back all the tokens, the ones before the offset are unchanged */
+    load_token_list(T, list, i);
+    return i;
+  }
+
+  /* remove "incomplete" tokens */
+  int n = lua_rawlen(L, res_idx);
+  while (n >= 2) {
+    lua_rawgeti(L, res_idx, n - 1);
+    bool incomplete = lua_isstring(L, -1) && strcmp(lua_tostring(L, -1), "incomplete") == 0;
+    lua_pop(L, 1);
+    if (!incomplete) break;
+    lua_pushnil(L); lua_rawseti(L, res_idx, n--);
+    lua_pushnil(L); lua_rawseti(L, res_idx, n--);
+  }
+
+  /* move the last token back to the native list so that it can be merged */
+  if (n >= 2) {
+    size_t len;
+    lua_rawgeti(L, res_idx, n);
+    const char *text = lua_tolstring(L, -1, &len);
+    if (text && len <= i && memcmp(T->text + i - len, text, len) == 0) {
+      lua_rawgeti(L, res_idx, n - 1);
+      int type = intern_type(L, SLOT_TYPES);
+      lua_pushnil(L); lua_rawseti(L, res_idx, n--);
+      lua_pushnil(L); lua_rawseti(L, res_idx, n--);
+      push_token(T, type, i - len, i);
+    }
+    lua_pop(L, 1);
+  }
+  return i;
+}
+
+static void push_results(Tokenizer *T, int res_idx, bool packed) {
+  lua_State *L = T->L;
+  if (packed) {
+    push_token_list(L, T->tokens, T->ntokens, T->checkpoints, T->ncheckpoints, SLOT_TEXT);
+    lua_replace(L, res_idx);
+    return;
+  }
+  int n = lua_rawlen(L, res_idx);
+  for (size_t i = 0; i < T->ntokens; i++) {
+    Token *t = &T->tokens[i];
+    lua_rawgeti(L, SLOT_TYPES, t->type);
+    lua_rawseti(L, res_idx, ++n);
+    lua_pushlstring(L, T->text + t->start, t->end - t->start);
+    lua_rawseti(L, res_idx, ++n);
+  }
+}
+
+
+/* Edits of long lines
+ *
+ * While tokenizing lines longer than CHECKPOINT_INTERVAL, the state is saved
+ * every CHECKPOINT_INTERVAL bytes at positions where tokenizing could start
+ * again, and the checkpoints are kept in the token list with the state at the
+ * end of the line. When a new version of the line is tokenized from the same
+ * state with the previous list, it starts again from the last checkpoint
+ * before the edit, loading the previous tokens before it. After the edit,
+ * once it reaches the position of a previous checkpoint with the same state
+ * and the same last token, the rest of the previous tokens are reused, as
+ * they would be produced again. Both checkpoints are taken EDIT_MARGIN bytes
+ * away from the edit, as patterns can look at the characters around their
+ * matches. */
+
+/* returns the offset to start tokenizing from, after loading the tokens
+   before it unless resuming */
+static size_t load_previous(Tokenizer *T, Previous *P, TokenList *list, const char *text, size_t len, bool resumed) {
+  size_t min_len = SDL_min(len, T->len), prefix = 0, suffix = 0;
+  while (prefix < min_len && text[prefix] == T->text[prefix]) prefix++;
+  while (suffix < min_len - prefix && text[len - suffix - 1] == T->text[T->len - suffix - 1]) suffix++;
+  P->list = list;
+  P->text = text;
+  P->old_end = len - suffix;
+  P->new_end = T->len - suffix;
+  /* the last checkpoint is the end of the line */
+  size_t last = list->ncheckpoints - 1;
+  P->next = 0;
+  while (P->next < last && list->checkpoint_offsets[P->next] < P->old_end + EDIT_MARGIN)
+    P->next++;
+  T->prev = P;
+  if (resumed) return 0;
+
+  size_t n = last;
+  while (n > 0 && list->checkpoint_offsets[n - 1] + EDIT_MARGIN > prefix) n--;
+  if (n == 0) return 0;
+  size_t offset = list->checkpoint_offsets[n - 1];
+  T->state_len = list->checkpoint_states[n] - list->checkpoint_states[n - 1];
+  memcpy(T->state, list->states + list->checkpoint_states[n - 1], T->state_len);
+  load_token_list(T, list, offset);
+  return offset;
+}
+
+/* reuses the previous tokens from the offset if they would be the same,
+   returns false if they wouldn't */
+static bool converge(Tokenizer *T, size_t i) {
+  Previous *P = T->prev;
+  TokenList *list = P->list;
+  size_t last = list->ncheckpoints - 1;
+  while (P->next < last && list->checkpoint_offsets[P->next] - P->old_end + P->new_end < i)
+    P->next++;
+  if (P->next == last) {
+    /* no checkpoint left to converge to */
+    T->prev = NULL;
+    return false;
+  }
+  size_t o = list->checkpoint_offsets[P->next];
+  if (o - P->old_end + P->new_end != i) return false;
+  const unsigned char *state = list->states + list->checkpoint_states[P->next];
+  int state_len = list->checkpoint_states[P->next + 1] - list->checkpoint_states[P->next];
+  if (state_len != T->state_len || memcmp(state, T->state, state_len) != 0) return false;
+
+  /* the first token after the checkpoint must not have been merged with the
+     one before it, and must not be merged with the new one */
+  size_t lo = 0, hi = list->ntokens;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (list->ends[mid] < o) lo = mid + 1;
+    else hi = mid;
+  }
+  if (lo == list->ntokens || list->ends[lo] != o || T->ntokens == 0) return false;
+  Token *prev = &T->tokens[T->ntokens - 1];
+  size_t start = lo > 0 ? list->ends[lo - 1] : 0;
+  if (prev->type != list->types[lo] || prev->whitespace != text_is_whitespace(T->L, P->text, start, o))
+    return false;
+
+  for (size_t n = lo + 1; n < list->ntokens; n++) {
+    if (T->ntokens == T->capacity)
+      grow_tokens(T);
+    /* nothing is merged with them anymore */
+    T->tokens[T->ntokens++] = (Token) {
+      list->types[n], list->ends[n - 1] - P->old_end + P->new_end,
+      list->ends[n] - P->old_end + P->new_end, false
+    };
+  }
+  for (size_t n = P->next; n <= last; n++) {
+    T->state_len = list->checkpoint_states[n + 1] - list->checkpoint_states[n];
+    memcpy(T->state, list->states + list->checkpoint_states[n], T->state_len);
+    if (n < last)
+      add_checkpoint(T, list->checkpoint_offsets[n] - P->old_end + P->new_end);
+  }
+  T->prev = NULL;
+  return true;
+}
+
+
+static bool can_match_at(Tokenizer *T, size_t offset) {
+  unsigned char c = T->text[offset];
+  if (T->current->dispatch_start[c + 1] > T->current->dispatch_start[c])
+    return true;
+  return T->subsyntax_info && may_start_with(&T->subsyntax_info->match[1], c);
+}
+
+/* tokenizes the text from the offset, returns false if it ran out of time,
+   leaving in the offset the position where it stopped */
+static bool tokenize(Tokenizer *T, size_t *offset, double max_time) {
+  lua_State *L = T->L;
+  Match m, sm;
+  Uint64 start_time = SDL_GetPerformanceCounter();
+  size_t i = *offset, starting_i = i;
+  /* regexes raise an error on invalid UTF-8, which must happen the same as
+     when trying every pattern, so lines like that can't skip any */
+  if (T->utf8_valid < 0)
+    T->utf8_valid = utf8extra_isvalid(T->text, T->text + T->len);
+  bool dispatch = T->utf8_valid;
+  while (i < T->len) {
+    if (T->prev && i >= T->prev->new_end + EDIT_MARGIN && converge(T, i)) {
+      *offset = T->len;
+      return true;
+    }
+    if (i >= T->next_checkpoint && !T->detached)
+      add_checkpoint(T, i);
+    if (max_time > 0 && i - starting_i > TIME_CHECK_INTERVAL) {
+      starting_i = i;
+      if (check_time(start_time, max_time)) {
+        /* we're out of time */
+        push_token(T, TYPE_INCOMPLETE, i, T->len);
+        *offset = i;
+        return false;
+      }
+    }
+    /* continue trying to match the end pattern of a pair if we have a state set */
+    if (T->current_pattern_idx > 0) {
+      NativePattern *p = &T->current->patterns[T->current_pattern_idx - 1];
+      bool found = find_text(T, p, i, false, true, &m);
+      int token_type = p->types[0];
+      bool cont = true;
+      /* ending the subsyntax takes precedence over ending the delimiter in it */
+      if (T->subsyntax_info) {
+        if (find_text(T, T->subsyntax_info, i, false, true, &sm) && (!found || sm.start < m.start)) {
+          push_token(T, token_type, i, sm.start);
+          i = sm.start;
+          cont = false;
+        }
+      }
+      if (cont) {
+        if (found) {
+          push_token(T, token_type, i, m.start);
+          push_tokens(T, p, &m);
+          set_subsyntax_pattern_idx(T, 0);
+          i = m.end;
+        } else {
+          push_token(T, token_type, i, T->len);
+          break;
+        }
+      }
+    }
+    /* general end of syntax check */
+    while (T->subsyntax_info) {
+      if (dispatch && !may_start_with(&T->subsyntax_info->match[1], T->text[i])) break;
+      if (!find_text(T, T->subsyntax_info, i, true, true, &m)) break;
+      push_tokens(T, T->subsyntax_info, &m);
+      pop_subsyntax(T);
+      i = m.end;
+    }
+
+    /* find matching pattern */
+    bool matched = false;
+    NativeSyntax *syntax = T->current;
+    unsigned char c = T->text[i];
+    /* whole line patterns are only in the full list, tried at the start */
+    bool use_all = !dispatch || i == 0;
+    int first = use_all ? 0 : syntax->dispatch_start[c];
+    int last = use_all ? syntax->npatterns : syntax->dispatch_start[c + 1];
+    for (int k = first; k < last; k++) {
+      int n = use_all ? k : syntax->dispatch[k];
+      NativePattern *p = &syntax->patterns[n];
+      if (use_all && dispatch && !may_start_with(&p->match[0], c)) continue;
+      if (!find_text(T, p, i, true, false, &m)) continue;
+      if (m.start >= m.end) {
+        report_bad_pattern(T, p, false, "Pattern successfully matched, but nothing was captured.", 0, 0);
+        continue;
+      }
+      int n_types = p->type_is_table ? p->ntypes : 1;
+      if (p->type_without_captures) {
+        if (!T->detached && !p->reported) {
+          /* same fix as done by the Lua tokenizer */
+          lua_getiuservalue(L, SLOT_SYNTAX, 1);
+          lua_getfield(L, -1, "syntax");
+          lua_getfield(L, -1, "patterns");
+          lua_rawgeti(L, -1, n + 1);
+          if (lua_getfield(L, -1, "type") == LUA_TTABLE) {
+            lua_rawgeti(L, -1, 1);
+            lua_setfield(L, -3, "type");
+          }
+          lua_pop(L, 5);
+          report_bad_pattern(T, p, false, "Token type is a table, but a string was expected.", 0, 0);
+        }
+      } else if (m.ncaptures + 1 > n_types) {
+        report_bad_pattern(T, p, true, "Not enough token types: got %d needed %d.", n_types, m.ncaptures + 1);
+      } else if (m.ncaptures + 1 < n_types) {
+        report_bad_pattern(T, p, false, "Too many token types: got %d needed %d.", n_types, m.ncaptures + 1);
+      }
+      push_tokens(T, p, &m);
+      /* update state if this was a start|end pattern pair */
+      if (p->is_pair) {
+        if (p->subsyntax)
+          push_subsyntax(T, p, n + 1);
+        else
+          set_subsyntax_pattern_idx(T, n + 1);
+      }
+      i = m.end;
+      matched = true;
+      break;
+    }
+
+    /* consume character if we didn't match */
+    if (!matched) {
+      if (i >= T->len) break;
+      size_t next = utf8extra_next(T->text + i, T->text + T->len) - T->text;
+      /* skip the characters nothing can start matching at, unless they
+         belong to a pair restored by ending a subsyntax */
+      if (dispatch && T->current_pattern_idx == 0) {
+        while (next < T->len && !can_match_at(T, next))
+          next = utf8extra_next(T->text + next, T->text + T->len) - T->text;
+      }
+      push_token(T, TYPE_NORMAL, i, next);
+      i = next;
+    }
+  }
+
+  *offset = T->len;
+  return true;
+}
+
+static int f_tokenize(lua_State *L) {
+  Tokenizer tokenizer = { 0 }, *T = &tokenizer;
+  T->L = L;
+  T->utf8_valid = -1;
+  T->base = luaL_checkudata(L, SLOT_BASE, API_TYPE_NATIVE_SYNTAX);
+  T->text = luaL_checklstring(L, SLOT_TEXT, &T->len);
+  double max_time = luaL_optnumber(L, SLOT_MAX_TIME, 0);
+  /* lists can only address lines of up to 4GB */
+  bool packed = lua_toboolean(L, SLOT_REPORT + 1) && T->len <= UINT32_MAX;
+  lua_settop(L, SLOT_REPORT);
+  lua_pushvalue(L, SLOT_BASE);   /* SLOT_SYNTAX */
+  lua_pushnil(L);                /* SLOT_SYMBOLS */
+  lua_pushnil(L);                /* SLOT_TOKENS */
+  lua_pushvalue(L, lua_upvalueindex(1)); /* SLOT_TYPES */
+  lua_pushnil(L);                /* SLOT_CHECKPOINTS */
+  T->next_checkpoint = CHECKPOINT_INTERVAL;
+
+  size_t state_len;
+  const char *state = lua_tolstring(L, SLOT_STATE, &state_len);
+  if (state) {
+    T->state_len = SDL_min(state_len, MAX_STATE_LENGTH);
+    memcpy(T->state, state, T->state_len);
+  } else {
+    T->state_len = 1;
+  }
+
+  size_t i = 0;
+  bool resumed = false;
+  Previous previous;
+  if (lua_istable(L, SLOT_RESUME)) {
+    lua_getfield(L, SLOT_RESUME, "res");
+    if (packed && luaL_testudata(L, -1, API_TYPE_TOKEN_LIST)) {
+      /* the offsets of the tokens are only valid in the same text */
+      lua_getiuservalue(L, -1, 1);
+      resumed = lua_rawequal(L, -1, SLOT_TEXT);
+      lua_pop(L, 1);
+    } else if (!packed) {
+      resumed = lua_istable(L, -1);
+    }
+    if (resumed)
+      i = load_resume(T, lua_gettop(L));
+    else
+      lua_pop(L, 1);
+  }
+  if (!resumed)
+    lua_newtable(L);
+  int res_idx = lua_gettop(L);
+
+  /* a complete list of a previous version of the line with its checkpoints */
+  TokenList *list = NULL;
+  if (packed && lua_istable(L, SLOT_RESUME)) {
+    lua_getfield(L, SLOT_RESUME, "previous");
+    list = luaL_testudata(L, -1, API_TYPE_TOKEN_LIST);
+    lua_pop(L, 1);
+  }
+  if (list && list->ncheckpoints > 0) {
+    size_t len;
+    lua_getfield(L, SLOT_RESUME, "previous");
+    lua_getiuservalue(L, -1, 1);
+    const char *text = lua_tolstring(L, -1, &len);
+    lua_pop(L, 2);
+    if (list->checkpoint_offsets[list->ncheckpoints - 1] == len) {
+      size_t offset = load_previous(T, &previous, list, text, len, resumed);
+      if (!resumed) i = offset;
+    }
+  }
+
+  retrieve_syntax_state(T);
+
+  if (!tokenize(T, &i, max_time)) {
+    push_results(T, res_idx, packed);
+    lua_pushlstring(L, "\0", 1);
+    lua_createtable(L, 0, 4);
+    lua_pushvalue(L, res_idx);
+    lua_setfield(L, -2, "res");
+    lua_pushinteger(L, i + 1);
+    lua_setfield(L, -2, "offset");
+    lua_pushlstring(L, (const char *) T->state, T->state_len);
+    lua_setfield(L, -2, "state");
+    if (T->prev) {
+      lua_getfield(L, SLOT_RESUME, "previous");
+      lua_setfield(L, -2, "previous");
+    }
+    return 3;
+  }
+  /* the end state of long lines, to reuse their tokens after an edit */
+  if (T->ncheckpoints > 0)
+    add_checkpoint(T, T->len);
+  push_results(T, res_idx, packed);
+  lua_pushlstring(L, (const char *) T->state, T->state_len);
+  return 2;
+}
+
+
+/* Background jobs
+ *
+ * A job tokenizes a snapshot of consecutive lines on one of the worker
+ * threads, one per core up to MAX_WORKERS, each with a private Lua state used
+ * only to catch errors. Jobs are run in the order they were started. The results of each line are
+ * collected under the job mutex, and a "tokenized" event with the job id is
+ * pushed when there are new ones to take with job:take_results. Jobs stop
+ * early if the state before a line is the one it was expected to have, as
+ * the rest of the lines are already up to date. A job collected while a
+ * worker runs it is kept alive until the worker is done with it, so that the
+ * garbage collector never waits for the worker. */
+
+typedef struct {
+  size_t ntokens;
+  unsigned char state[MAX_STATE_LENGTH];
+  int state_len;
+} LineResult;
+
+typedef struct Job Job;
+
+struct Job {
+  int id;
+  SDL_AtomicInt cancelled;
+  NativeSyntax *syntax;
+  int nlines;
+  const char **texts;
+  size_t *lens;
+  const char **expected;  /* state expected before each line, or NULL */
+  size_t *expected_lens;
+  unsigned char state[MAX_STATE_LENGTH];
+  int state_len;
+  /* results not taken yet, protected by the mutex */
+  SDL_Mutex *mutex;
+  LineResult *results;
+  int nresults, results_capacity;
+  Token *tokens;
+  size_t ntokens, tokens_capacity;
+  int batch_lines;
+  bool done, event_pending;
+  char *error;
+  /* protected by the worker mutex */
+  bool running, orphaned;
+  Job *next;
+};
+
+typedef struct {
+  SDL_Thread *threads[MAX_WORKERS];
+  int nthreads;
+  SDL_Mutex *mutex;
+  SDL_Condition *cond;
+  Job *first, *last;
+  bool quit;
+} Worker;
+
+static Worker worker;
+
+/* must be called with the job mutex locked */
+static void notify_job(Job *job) {
+  if (job->event_pending || SDL_GetAtomicInt(&job->cancelled)) return;
+  CustomEvent event;
+  SDL_zero(event);
+  event.data1 = (void *) (intptr_t) job->id;
+  job->event_pending = push_custom_event("tokenized", &event);
+  job->batch_lines = 0;
+}
+
+static void add_job_result(Job *job, Tokenizer *T) {
+  bool ok = true;
+  SDL_LockMutex(job->mutex);
+  if (job->ntokens + T->ntokens > job->tokens_capacity) {
+    size_t capacity = SDL_max(job->tokens_capacity * 2, job->ntokens + T->ntokens);
+    Token *tokens = SDL_realloc(job->tokens, capacity * sizeof(Token));
+    if (tokens) {
+      job->tokens = tokens;
+      job->tokens_capacity = capacity;
+    } else ok = false;
+  }
+  if (ok && job->nresults == job->results_capacity) {
+    int capacity = job->results_capacity ? job->results_capacity * 2 : JOB_BATCH_LINES;
+    LineResult *results = SDL_realloc(job->results, capacity * sizeof(LineResult));
+    if (results) {
+      job->results = results;
+      job->results_capacity = capacity;
+    } else ok = false;
+  }
+  if (ok) {
+    LineResult *r = &job->results[job->nresults++];
+    r->ntokens = T->ntokens;
+    r->state_len = T->state_len;
+    memcpy(r->state, T->state, T->state_len);
+    memcpy(job->tokens + job->ntokens, T->tokens, T->ntokens * sizeof(Token));
+    job->ntokens += T->ntokens;
+    if (++job->batch_lines >= JOB_BATCH_LINES)
+      notify_job(job);
+  }
+  SDL_UnlockMutex(job->mutex);
+  if (!ok) luaL_error(T->L, "out of memory");
+}
+
+static int f_run_job(lua_State *L) {
+  Job *job = lua_touserdata(L, 1);
+  pcre2_match_data *md = lua_touserdata(L, 2);
+  lua_settop(L, SLOT_TYPES);
+  Tokenizer tokenizer, *T = &tokenizer;
+  Token *tokens = NULL;
+  size_t capacity = 0;
+  unsigned char state[MAX_STATE_LENGTH];
+  int state_len = job->state_len;
+  memcpy(state, job->state, state_len);
+  for (int k = 0; k < job->nlines; k++) {
+    if (SDL_GetAtomicInt(&job->cancelled)) break;
+    /* the rest of the lines are up to date */
+    if (k > 0 && job->expected[k] && job->expected_lens[k] == (size_t) state_len
+        && memcmp(job->expected[k], state, state_len) == 0)
+      break;
+    memset(T, 0, sizeof(Tokenizer));
+    T->L = L;
+    T->detached = true;
+    T->md = md;
+    T->utf8_valid = -1;
+    T->tokens = tokens;
+    T->capacity = capacity;
+    T->base = job->syntax;
+    T->text = job->texts[k];
+    T->len = job->lens[k];
+    T->state_len = state_len;
+    memcpy(T->state, state, state_len);
+    retrieve_syntax_state(T);
+    size_t i = 0;
+    tokenize(T, &i, 0);
+    add_job_result(job, T);
+    /* the token buffer is kept alive in SLOT_TOKENS */
+    tokens = T->tokens;
+    capacity = T->capacity;
+    state_len = T->state_len;
+    memcpy(state, T->state, state_len);
+  }
+  return 0;
+}
+
+static void run_job(lua_State *L, pcre2_match_data *md, Job *job) {
+  char *error = NULL;
+  if (!L || !md) {
+    error = SDL_strdup("unable to create the tokenizer state");
+  } else {
+    lua_pushcfunction(L, f_run_job);
+    lua_pushlightuserdata(L, job);
+    lua_pushlightuserdata(L, md);
+    if (lua_pcall(L, 2, 0, 0) != LUA_OK)
+      error = SDL_strdup(lua_isstring(L, -1) ? lua_tostring(L, -1) : "unknown error");
+    lua_settop(L, 0);
+  }
+  SDL_LockMutex(job->mutex);
+  job->done = true;
+  job->error = error;
+  notify_job(job);
+  SDL_UnlockMutex(job->mutex);
+}
+
+static int worker_thread(UNUSED void *data) {
+  lua_State *L = luaL_newstate();
+  pcre2_match_data *md = pcre2_match_data_create(MAX_CAPTURES + 1, NULL);
+  SDL_LockMutex(worker.mutex);
+  for (;;) {
+    while (!worker.quit && !worker.first)
+      SDL_WaitCondition(worker.cond, worker.mutex);
+    if (worker.quit) break;
+    Job *job = worker.first;
+    worker.first = job->next;
+    if (!worker.first) worker.last = NULL;
+    job->running = true;
+    SDL_UnlockMutex(worker.mutex);
+    run_job(L, md, job);
+    SDL_LockMutex(worker.mutex);
+    job->running = false;
+    /* the main thread frees a collected job once it gets this event */
+    if (job->orphaned) {
+      CustomEvent event;
+      SDL_zero(event);
+      event.data1 = (void *) (intptr_t) job->id;
+      push_custom_event("tokenized", &event);
+    }
+  }
+  SDL_UnlockMutex(worker.mutex);
+  if (md) pcre2_match_data_free(md);
+  if (L) lua_close(L);
+  return 0;
+}
+
+static bool start_worker(void) {
+  if (worker.nthreads > 0) return true;
+  if (!worker.mutex) worker.mutex = SDL_CreateMutex();
+  if (!worker.cond) worker.cond = SDL_CreateCondition();
+  if (!worker.mutex || !worker.cond) return false;
+  worker.quit = false;
+  int n = SDL_clamp(SDL_GetNumLogicalCPUCores(), 1, MAX_WORKERS);
+  while (worker.nthreads < n) {
+    SDL_Thread *thread = SDL_CreateThread(worker_thread, "tokenizer_worker", NULL);
+    if (!thread) break;
+    worker.threads[worker.nthreads++] = thread;
+  }
+  return worker.nthreads > 0;
+}
+
+static int f_worker_gc(UNUSED lua_State *L) {
+  if (worker.nthreads > 0) {
+    SDL_LockMutex(worker.mutex);
+    worker.quit = true;
+    SDL_BroadcastCondition(worker.cond);
+    SDL_UnlockMutex(worker.mutex);
+    for (int i = 0; i < worker.nthreads; i++)
+      SDL_WaitThread(worker.threads[i], NULL);
+  }
+  if (worker.cond) SDL_DestroyCondition(worker.cond);
+  if (worker.mutex) SDL_DestroyMutex(worker.mutex);
+  SDL_zero(worker);
+  return 0;
+}
+
+/* returns true if a worker is running the job, which it then stops at the
+   next line */
+static bool cancel_job(Job *job, bool orphan) {
+  SDL_SetAtomicInt(&job->cancelled, 1);
+  if (worker.nthreads == 0) return false;
+  SDL_LockMutex(worker.mutex);
+  Job *prev = NULL;
+  for (Job *j = worker.first; j; prev = j, j = j->next) {
+    if (j == job) {
+      if (prev) prev->next = job->next;
+      else worker.first = job->next;
+      if (worker.last == job) worker.last = prev;
+      break;
+    }
+  }
+  bool running = job->running;
+  if (running && orphan) job->orphaned = true;
+  SDL_UnlockMutex(worker.mutex);
+  return running;
+}
+
+static int job_event_callback(lua_State *L, SDL_Event *e) {
+  /* lets a collected job be freed if the worker is done with it */
+  lua_getfield(L, LUA_REGISTRYINDEX, "native_tokenizer.orphans");
+  if (lua_rawgeti(L, -1, (intptr_t) e->user.data1) == LUA_TUSERDATA) {
+    Job *job = lua_touserdata(L, -1);
+    SDL_LockMutex(worker.mutex);
+    bool running = job->running;
+    SDL_UnlockMutex(worker.mutex);
+    if (!running) {
+      lua_pushnil(L);
+      lua_rawseti(L, -3, (intptr_t) e->user.data1);
+    }
+  }
+  lua_pop(L, 2);
+  lua_pushstring(L, "tokenized");
+  lua_pushinteger(L, (intptr_t) e->user.data1);
+  return 2;
+}
+
+static const char *get_job_string(lua_State *L, int idx, size_t *len, int anchor_idx, int n) {
+  /* keep the string alive in the job uservalue while the worker uses it */
+  if (!lua_isstring(L, idx)) return NULL;
+  const char *s = lua_tolstring(L, idx, len);
+  lua_pushvalue(L, idx);
+  lua_rawseti(L, anchor_idx, n);
+  return s;
+}
+
+static int f_start_job(lua_State *L) {
+  NativeSyntax *syntax = luaL_checkudata(L, 1, API_TYPE_NATIVE_SYNTAX);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  luaL_checktype(L, 4, LUA_TTABLE);
+  int id = luaL_checkinteger(L, 5);
+  int nlines = lua_rawlen(L, 2);
+  lua_settop(L, 5);
+  if (!start_worker())
+    return luaL_error(L, "unable to start the tokenizer worker: %s", SDL_GetError());
+
+  Job *job = lua_newuserdatauv(L, sizeof(Job), 1);
+  memset(job, 0, sizeof(Job));
+  luaL_setmetatable(L, API_TYPE_TOKENIZER_JOB);
+  /* the uservalue keeps everything used by the worker alive */
+  lua_createtable(L, 0, 4);
+  lua_pushvalue(L, 1);
+  lua_setfield(L, -2, "syntax");
+  lua_pushvalue(L, 3);
+  lua_setfield(L, -2, "init_state");
+  lua_createtable(L, nlines, 0);
+  lua_createtable(L, nlines, 0);
+  lua_setfield(L, -3, "expected");
+  lua_setfield(L, -2, "texts");
+  lua_setiuservalue(L, -2, 1);
+  lua_getiuservalue(L, -1, 1);
+  lua_getfield(L, -1, "texts");
+  lua_getfield(L, -2, "expected");
+  int texts_idx = lua_gettop(L) - 1, expected_idx = lua_gettop(L);
+
+  job->id = id;
+  job->syntax = syntax;
+  job->nlines = nlines;
+  job->texts = SDL_calloc(nlines + 1, sizeof(const char *));
+  job->lens = SDL_calloc(nlines + 1, sizeof(size_t));
+  job->expected = SDL_calloc(nlines + 1, sizeof(const char *));
+  job->expected_lens = SDL_calloc(nlines + 1, sizeof(size_t));
+  job->mutex = SDL_CreateMutex();
+  if (!job->texts || !job->lens || !job->expected || !job->expected_lens || !job->mutex)
+    return luaL_error(L, "unable to create the tokenizer job");
+  for (int k = 0; k < nlines; k++) {
+    lua_rawgeti(L, 2, k + 1);
+    job->texts[k] = get_job_string(L, -1, &job->lens[k], texts_idx, k + 1);
+    if (!job->texts[k])
+      return luaL_error(L, "line %d is not a string", k + 1);
+    lua_rawgeti(L, 4, k + 1);
+    job->expected[k] = get_job_string(L, -1, &job->expected_lens[k], expected_idx, k + 1);
+    lua_pop(L, 2);
+  }
+  size_t state_len;
+  const char *state = lua_isstring(L, 3) ? lua_tolstring(L, 3, &state_len) : NULL;
+  if (state) {
+    job->state_len = SDL_min(state_len, MAX_STATE_LENGTH);
+    memcpy(job->state, state, job->state_len);
+  } else {
+    job->state_len = 1;
+  }
+  lua_settop(L, 6);
+
+  SDL_LockMutex(worker.mutex);
+  if (worker.last) worker.last->next = job;
+  else worker.first = job;
+  worker.last = job;
+  SDL_BroadcastCondition(worker.cond);
+  SDL_UnlockMutex(worker.mutex);
+  return 1;
+}
+
+static int f_get_worker_count(lua_State *L) {
+  lua_pushinteger(L, start_worker() ? worker.nthreads : 0);
+  return 1;
+}
+
+static int f_job_take_results(lua_State *L) {
+  Job *job = luaL_checkudata(L, 1, API_TYPE_TOKENIZER_JOB);
+  SDL_LockMutex(job->mutex);
+  LineResult *results = job->results;
+  Token *tokens = job->tokens;
+  int nresults = job->nresults;
+  bool done = job->done;
+  char *error = job->error;
+  job->results = NULL;
+  job->nresults = job->results_capacity = 0;
+  job->tokens = NULL;
+  job->ntokens = job->tokens_capacity = 0;
+  job->error = NULL;
+  job->event_pending = false;
+  SDL_UnlockMutex(job->mutex);
+
+  lua_getiuservalue(L, 1, 1);
+  int anchor_idx = lua_gettop(L);
+  lua_getfield(L, anchor_idx, "texts");
+  int texts_idx = lua_gettop(L);
+  lua_getfield(L, anchor_idx, "taken");
+  int taken = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  /* the state of the last line taken is the initial state of the next one */
+  lua_getfield(L, anchor_idx, taken > 0 ? "last_state" : "init_state");
+  int init_state_idx = lua_gettop(L);
+
+  lua_createtable(L, nresults, 0);
+  size_t t = 0;
+  for (int k = 0; k < nresults; k++) {
+    LineResult *r = &results[k];
+    lua_createtable(L, 0, 4);
+    lua_pushvalue(L, init_state_idx);
+    lua_setfield(L, -2, "init_state");
+    lua_rawgeti(L, texts_idx, taken + k + 1);
+    push_token_list(L, tokens + t, r->ntokens, NULL, 0, -1);
+    lua_setfield(L, -3, "tokens");
+    lua_setfield(L, -2, "text");
+    t += r->ntokens;
+    lua_pushlstring(L, (const char *) r->state, r->state_len);
+    lua_copy(L, -1, init_state_idx);
+    lua_setfield(L, -2, "state");
+    lua_rawseti(L, -2, k + 1);
+  }
+  SDL_free(results);
+  SDL_free(tokens);
+  lua_pushvalue(L, init_state_idx);
+  lua_setfield(L, anchor_idx, "last_state");
+  lua_pushinteger(L, taken + nresults);
+  lua_setfield(L, anchor_idx, "taken");
+
+  lua_pushboolean(L, done);
+  if (error) {
+    lua_pushstring(L, error);
+    SDL_free(error);
+    return 3;
+  }
+  return 2;
+}
+
+static int f_job_cancel(lua_State *L) {
+  Job *job = luaL_checkudata(L, 1, API_TYPE_TOKENIZER_JOB);
+  cancel_job(job, false);
+  return 0;
+}
+
+static int f_job_gc(lua_State *L) {
+  Job *job = luaL_checkudata(L, 1, API_TYPE_TOKENIZER_JOB);
+  if (cancel_job(job, true)) {
+    /* resurrected with what the worker uses until it's done, then collected
+       again */
+    lua_getfield(L, LUA_REGISTRYINDEX, "native_tokenizer.orphans");
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, job->id);
+    lua_pushvalue(L, 1);
+    luaL_setmetatable(L, API_TYPE_TOKENIZER_JOB);
+    return 0;
+  }
+  SDL_free(job->texts);
+  SDL_free(job->lens);
+  SDL_free(job->expected);
+  SDL_free(job->expected_lens);
+  SDL_free(job->results);
+  SDL_free(job->tokens);
+  SDL_free(job->error);
+  if (job->mutex) SDL_DestroyMutex(job->mutex);
+  memset(job, 0, sizeof(Job));
+  return 0;
+}
+
+
+static const luaL_Reg syntaxLib[] = {
+  { "__gc",              f_syntax_gc                },
+  { "get_pattern_count", f_syntax_get_pattern_count },
+  { "set_subsyntax",     f_syntax_set_subsyntax     },
+  { NULL, NULL }
+};
+
+static const luaL_Reg jobLib[] = {
+  { "__gc",         f_job_gc           },
+  { "take_results", f_job_take_results },
+  { "cancel",       f_job_cancel       },
+  { NULL, NULL }
+};
+
+static const luaL_Reg tokenListLib[] = {
+  { "__index", f_token_list_index },
+  { "__len",   f_token_list_len   },
+  { NULL, NULL }
+};
+
+static const luaL_Reg lib[] = {
+  { "compile",          f_compile          },
+  { "tokenize",         f_tokenize         },
+  { "start_job",        f_start_job        },
+  { "get_worker_count", f_get_worker_count },
+  { NULL, NULL }
+};
+
+int luaopen_native_tokenizer(lua_State *L) {
+  if (!register_custom_event("tokenized", job_event_callback))
+    return luaL_error(L, "Unable to register custom tokenized event: %s", SDL_GetError());
+
+  luaL_newmetatable(L, API_TYPE_NATIVE_SYNTAX);
+  luaL_setfuncs(L, syntaxLib, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  /* stops the worker threads when the Lua state is closed, after the jobs
+     as it's created before any of them */
+  lua_newuserdatauv(L, 0, 0);
+  lua_newtable(L);
+  lua_pushcfunction(L, f_worker_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_setmetatable(L, -2);
+  lua_setfield(L, LUA_REGISTRYINDEX, "native_tokenizer.worker");
+  lua_newtable(L);
+  lua_setfield(L, LUA_REGISTRYINDEX, "native_tokenizer.orphans");
+
+  /* token types shared by all syntaxes, as both type -> id and id -> type */
+  lua_newtable(L);
+  const char *types[] = { "normal", "incomplete" };
+  for (int i = 0; i < 2; i++) {
+    lua_pushstring(L, types[i]);
+    lua_rawseti(L, -2, i + 1);
+    lua_pushinteger(L, i + 1);
+    lua_setfield(L, -2, types[i]);
+  }
+  int types_idx = lua_gettop(L);
+
+  luaL_newmetatable(L, API_TYPE_TOKEN_LIST);
+  lua_pushvalue(L, types_idx);
+  luaL_setfuncs(L, tokenListLib, 1);
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, API_TYPE_TOKENIZER_JOB);
+  lua_pushvalue(L, types_idx);
+  luaL_setfuncs(L, jobLib, 1);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newlibtable(L, lib);
+  lua_pushvalue(L, types_idx);
+  luaL_setfuncs(L, lib, 1);
+  return 1;
+}
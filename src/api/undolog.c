@@ -0,0 +1,418 @@
+#include "api.h"
+
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+
+/* Undo and redo stacks of documents.
+ *
+ * The records are stored in a single arena, oldest first, each one framed by
+ * its size so that the stack can be popped from the end and the oldest
+ * records evicted from the start. Positions are stored as variable length
+ * integers, relative to each other, and selections relative to the previous
+ * cursor, so a record usually takes a few bytes besides the inserted text.
+ *
+ * Consecutive records are undone together when their times are within the
+ * merge timeout, and only the oldest selection of such a group is restored,
+ * so the selections pushed within the timeout of the previous record are not
+ * stored at all. This keeps edits made with many cursors from storing the
+ * whole selection at each of them.
+ *
+ * Edits applied together with `buffer:apply_edits` are stored as a single
+ * record, each one relative to the previous. */
+
+#define UNDO_INSERT 0
+#define UNDO_REMOVE 1
+#define UNDO_SELECTION 2
+#define UNDO_EDITS 3
+
+static const char *record_types[] = { "insert", "remove", "selection", "edits", NULL };
+
+/* size, type and time, followed by the payload and the size again */
+#define HEADER_SIZE (sizeof(uint32_t) + 1 + sizeof(double))
+#define TRAILER_SIZE sizeof(uint32_t)
+
+/* arenas are compacted once this much is evicted from their start */
+#define MIN_COMPACT_SIZE (64 << 10)
+
+typedef struct {
+  char *data;
+  size_t start, len, capacity; /* records are in data[start, len) */
+  size_t count;
+  lua_Integer change_id;
+  size_t max_count, max_bytes;
+  double merge_timeout;
+} UndoLog;
+
+
+static void write_varint(char **p, uint64_t n) {
+  while (n >= 0x80) {
+    *(*p)++ = (char) (n | 0x80);
+    n >>= 7;
+  }
+  *(*p)++ = (char) n;
+}
+
+
+static uint64_t read_varint(const char **p) {
+  uint64_t n = 0;
+  for (int shift = 0;; shift += 7) {
+    unsigned char c = *(*p)++;
+    n |= (uint64_t) (c & 0x7f) << shift;
+    if (c < 0x80) return n;
+  }
+}
+
+
+static void write_signed(char **p, lua_Integer n) {
+  write_varint(p, n < 0 ? ~((uint64_t) n << 1) : (uint64_t) n << 1);
+}
+
+
+static lua_Integer read_signed(const char **p) {
+  uint64_t n = read_varint(p);
+  return (n & 1) ? (lua_Integer) ~(n >> 1) : (lua_Integer) (n >> 1);
+}
+
+
+static uint32_t read_size(const char *p) {
+  uint32_t size;
+  memcpy(&size, p, sizeof(size));
+  return size;
+}
+
+
+static int record_type(const char *record) {
+  return (unsigned char) record[sizeof(uint32_t)];
+}
+
+
+static double record_time(const char *record) {
+  double time;
+  memcpy(&time, record + sizeof(uint32_t) + 1, sizeof(time));
+  return time;
+}
+
+
+/* the last record, NULL if there are none */
+static const char *top_record(UndoLog *log) {
+  if (log->count == 0) return NULL;
+  return log->data + log->len - read_size(log->data + log->len - TRAILER_SIZE);
+}
+
+
+static void reserve(lua_State *L, UndoLog *log, size_t size) {
+  if (log->len + size <= log->capacity) return;
+  size_t used = log->len - log->start;
+  if (log->start > 0 && used + size <= log->capacity) {
+    memmove(log->data, log->data + log->start, used);
+    log->start = 0, log->len = used;
+    return;
+  }
+  size_t capacity = log->capacity ? log->capacity : 4096;
+  while (capacity < used + size) capacity *= 2;
+  char *data = malloc(capacity);
+  if (!data) luaL_error(L, "not enough memory for the undo log");
+  if (used) memcpy(data, log->data + log->start, used);
+  free(log->data);
+  log->data = data, log->start = 0, log->len = used, log->capacity = capacity;
+}
+
+
+static void evict_records(UndoLog *log) {
+  while (log->count > 1 && (log->count > log->max_count || log->len - log->start > log->max_bytes)) {
+    log->start += read_size(log->data + log->start);
+    log->count--;
+  }
+  if (log->start >= MIN_COMPACT_SIZE && log->start >= log->len - log->start) {
+    memmove(log->data, log->data + log->start, log->len - log->start);
+    log->len -= log->start, log->start = 0;
+  }
+}
+
+
+static void shrink(UndoLog *log) {
+  size_t used = log->len - log->start;
+  if (used == 0) {
+    free(log->data);
+    log->data = NULL, log->start = log->len = log->capacity = 0;
+  } else if (log->capacity > MIN_COMPACT_SIZE && used < log->capacity / 4) {
+    char *data = malloc(log->capacity / 2);
+    if (!data) return;
+    memcpy(data, log->data + log->start, used);
+    free(log->data);
+    log->data = data, log->start = 0, log->len = used, log->capacity /= 2;
+  }
+}
+
+
+static lua_Integer check_position(lua_State *L, int idx) {
+  lua_Integer n = luaL_checkinteger(L, idx);
+  luaL_argcheck(L, n >= 0, idx, "invalid position");
+  return n;
+}
+
+
+static int f_new(lua_State *L) {
+  UndoLog *log = lua_newuserdatauv(L, sizeof(UndoLog), 0);
+  memset(log, 0, sizeof(UndoLog));
+  log->change_id = 1;
+  log->max_count = log->max_bytes = SIZE_MAX;
+  luaL_setmetatable(L, API_TYPE_UNDO_LOG);
+  return 1;
+}
+
+
+static size_t check_limit(lua_State *L, int idx) {
+  lua_Number n = luaL_optnumber(L, idx, HUGE_VAL);
+  if (n >= (lua_Number) SIZE_MAX) return SIZE_MAX;
+  return n > 1 ? (size_t) n : 1;
+}
+
+
+static int f_log_set_limits(lua_State *L) {
+  UndoLog *log = luaL_checkudata(L, 1, API_TYPE_UNDO_LOG);
+  log->max_count = check_limit(L, 2);
+  log->max_bytes = check_limit(L, 3);
+  log->merge_timeout = luaL_optnumber(L, 4, 0);
+  return 0;
+}
+
+
+static int f_log_push(lua_State *L) {
+  UndoLog *log = luaL_checkudata(L, 1, API_TYPE_UNDO_LOG);
+  int type = luaL_checkoption(L, 2, NULL, record_types);
+  double time = luaL_checknumber(L, 3);
+  const char *text = NULL;
+  size_t len = 0, n = 0, payload;
+  if (type == UNDO_SELECTION) {
+    const char *top = top_record(log);
+    if (top && fabs(time - record_time(top)) < log->merge_timeout)
+      return 0;
+    luaL_checktype(L, 4, LUA_TTABLE);
+    n = lua_rawlen(L, 4);
+    payload = 10 + n * 10;
+  } else if (type == UNDO_EDITS) {
+    luaL_checktype(L, 4, LUA_TTABLE);
+    n = lua_rawlen(L, 4) / 5;
+    payload = 10 + n * 50;
+    for (size_t i = 0; i < n; i++) {
+      if (lua_rawgeti(L, 4, i * 5 + 5) != LUA_TSTRING)
+        return luaL_error(L, "invalid text at index %d, expected a string", (int) (i * 5 + 5));
+      payload += lua_rawlen(L, -1);
+      lua_pop(L, 1);
+    }
+  } else if (type == UNDO_INSERT) {
+    text = luaL_checklstring(L, 6, &len);
+    payload = 30 + len;
+  } else {
+    payload = 40;
+  }
+  if (payload > UINT32_MAX - HEADER_SIZE - TRAILER_SIZE)
+    return luaL_error(L, "undo record too large");
+
+  reserve(L, log, HEADER_SIZE + payload + TRAILER_SIZE);
+  char *record = log->data + log->len;
+  char *p = record + HEADER_SIZE;
+  if (type == UNDO_SELECTION) {
+    /* each position relative to the same one of the previous cursor */
+    lua_Integer prev[4] = { 0, 0, 0, 0 };
+    write_varint(&p, n);
+    for (size_t i = 0; i < n; i++) {
+      lua_rawgeti(L, 4, i + 1);
+      lua_Integer value = check_position(L, -1);
+      lua_pop(L, 1);
+      write_signed(&p, value - prev[i % 4]);
+      prev[i % 4] = value;
+    }
+  } else if (type == UNDO_EDITS) {
+    /* the start relative to the previous edit, the end to the start */
+    lua_Integer prev_line = 0, prev_col = 0;
+    write_varint(&p, n);
+    for (size_t i = 0; i < n; i++) {
+      lua_Integer values[4];
+      for (int k = 0; k < 4; k++) {
+        lua_rawgeti(L, 4, i * 5 + k + 1);
+        values[k] = check_position(L, -1);
+        lua_pop(L, 1);
+      }
+      lua_rawgeti(L, 4, i * 5 + 5);
+      const char *edit_text = lua_tolstring(L, -1, &len);
+      write_signed(&p, values[0] - prev_line);
+      write_signed(&p, values[1] - prev_col);
+      write_signed(&p, values[2] - values[0]);
+      write_signed(&p, values[3] - values[1]);
+      write_varint(&p, len);
+      memcpy(p, edit_text, len);
+      p += len;
+      lua_pop(L, 1);
+      prev_line = values[0], prev_col = values[1];
+    }
+  } else {
+    lua_Integer line1 = check_position(L, 4), col1 = check_position(L, 5);
+    write_varint(&p, line1);
+    write_varint(&p, col1);
+    if (type == UNDO_INSERT) {
+      write_varint(&p, len);
+      memcpy(p, text, len);
+      p += len;
+    } else {
+      lua_Integer line2 = check_position(L, 6), col2 = check_position(L, 7);
+      write_signed(&p, line2 - line1);
+      write_signed(&p, col2 - col1);
+    }
+  }
+
+  uint32_t size = (uint32_t) (p - record) + TRAILER_SIZE;
+  memcpy(record, &size, sizeof(size));
+  record[sizeof(uint32_t)] = (char) type;
+  memcpy(record + sizeof(uint32_t) + 1, &time, sizeof(time));
+  memcpy(p, &size, sizeof(size));
+  log->len += size;
+  log->count++;
+  if (type != UNDO_SELECTION) log->change_id++;
+  evict_records(log);
+  return 0;
+}
+
+
+static int f_log_pop(lua_State *L) {
+  UndoLog *log = luaL_checkudata(L, 1, API_TYPE_UNDO_LOG);
+  const char *record = top_record(log);
+  if (!record) return 0;
+  int type = record_type(record);
+  const char *p = record + HEADER_SIZE;
+  lua_pushstring(L, record_types[type]);
+  lua_pushnumber(L, record_time(record));
+  int nresults = 2;
+  if (type == UNDO_SELECTION) {
+    lua_Integer prev[4] = { 0, 0, 0, 0 };
+    size_t n = read_varint(&p);
+    lua_createtable(L, n, 0);
+    for (size_t i = 0; i < n; i++) {
+      prev[i % 4] += read_signed(&p);
+      lua_pushinteger(L, prev[i % 4]);
+      lua_rawseti(L, -2, i + 1);
+    }
+    nresults += 1;
+  } else if (type == UNDO_EDITS) {
+    lua_Integer line = 0, col = 0;
+    size_t n = read_varint(&p);
+    lua_createtable(L, n * 5, 0);
+    for (size_t i = 0; i < n; i++) {
+      line += read_signed(&p);
+      col += read_signed(&p);
+      lua_Integer line2 = line + read_signed(&p), col2 = col + read_signed(&p);
+      size_t len = read_varint(&p);
+      lua_Integer values[4] = { line, col, line2, col2 };
+      for (int k = 0; k < 4; k++) {
+        lua_pushinteger(L, values[k]);
+        lua_rawseti(L, -2, i * 5 + k + 1);
+      }
+      lua_pushlstring(L, p, len);
+      lua_rawseti(L, -2, i * 5 + 5);
+      p += len;
+    }
+    log->change_id--;
+    nresults += 1;
+  } else {
+    lua_Integer line1 = read_varint(&p), col1 = read_varint(&p);
+    lua_pushinteger(L, line1);
+    lua_pushinteger(L, col1);
+    if (type == UNDO_INSERT) {
+      size_t len = read_varint(&p);
+      lua_pushlstring(L, p, len);
+      nresults += 3;
+    } else {
+      lua_pushinteger(L, line1 + read_signed(&p));
+      lua_pushinteger(L, col1 + read_signed(&p));
+      nresults += 4;
+    }
+    log->change_id--;
+  }
+  log->len = record - log->data;
+  log->count--;
+  shrink(log);
+  return nresults;
+}
+
+
+static int f_log_peek(lua_State *L) {
+  UndoLog *log = luaL_checkudata(L, 1, API_TYPE_UNDO_LOG);
+  const char *record = top_record(log);
+  if (!record) return 0;
+  lua_pushstring(L, record_types[record_type(record)]);
+  lua_pushnumber(L, record_time(record));
+  return 2;
+}
+
+
+static int f_log_clear(lua_State *L) {
+  UndoLog *log = luaL_checkudata(L, 1, API_TYPE_UNDO_LOG);
+  free(log->data);
+  log->data = NULL;
+  log->start = log->len = log->capacity = log->count = 0;
+  return 0;
+}
+
+
+static int f_log_get_change_id(lua_State *L) {
+  UndoLog *log = luaL_checkudata(L, 1, API_TYPE_UNDO_LOG);
+  lua_pushinteger(L, log->change_id);
+  return 1;
+}
+
+
+static int f_log_get_memory(lua_State *L) {
+  UndoLog *log = luaL_checkudata(L, 1, API_TYPE_UNDO_LOG);
+  lua_pushinteger(L, log->len - log->start);
+  lua_pushinteger(L, log->capacity);
+  return 2;
+}
+
+
+static int f_log_len(lua_State *L) {
+  UndoLog *log = luaL_checkudata(L, 1, API_TYPE_UNDO_LOG);
+  lua_pushinteger(L, log->count);
+  return 1;
+}
+
+
+static int f_log_gc(lua_State *L) {
+  UndoLog *log = luaL_checkudata(L, 1, API_TYPE_UNDO_LOG);
+  free(log->data);
+  log->data = NULL;
+  return 0;
+}
+
+
+static const luaL_Reg logLib[] = {
+  { "set_limits",    f_log_set_limits    },
+  { "push",          f_log_push          },
+  { "pop",           f_log_pop           },
+  { "peek",          f_log_peek          },
+  { "clear",         f_log_clear         },
+  { "get_change_id", f_log_get_change_id },
+  { "get_memory",    f_log_get_memory    },
+  { "__len",         f_log_len           },
+  { "__gc",          f_log_gc            },
+  { NULL, NULL }
+};
+
+static const luaL_Reg lib[] = {
+  { "new", f_new },
+  { NULL, NULL }
+};
+
+int luaopen_undolog(lua_State *L) {
+  luaL_newmetatable(L, API_TYPE_UNDO_LOG);
+  luaL_setfuncs(L, logLib, 0);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  luaL_newlib(L, lib);
+  return 1;
+}
@@ -1264,6 +1264,117 @@ static int Lutf8_gsub (lua_State *L) {
 }
 
 
+/* native interface, shared with the native tokenizer */
+
+const char *utf8extra_next (const char *s, const char *e)
+{ return utf8_next(s, e); }
+
+const char *utf8extra_prev (const char *s, const char *e)
+{ return utf8_prev(s, e); }
+
+const char *utf8extra_decode (const char *s, utfint *val)
+{ return utf8_decode(s, val, 0); }
+
+/* same semantics as utf8extra.find(s, p, init, plain), but taking and
+ * returning pointers; captures are returned as the position where they start
+ * and, when capture_lens is given, their length or CAP_POSITION */
+static const char *find_pointers (lua_State *L, const char *s, const char *es,
+                                  const char *init, const char *p, size_t lp,
+                                  int anchor, int plain, const char **match_end,
+                                  const char **captures, ptrdiff_t *capture_lens,
+                                  int *ncaptures) {
+  const char *ep = p + lp;
+  *ncaptures = 0;
+  if (plain || (!anchor && nospecials(p, ep))) {
+    const char *s2 = lmemfind(init, es-init, p, lp);
+    if (s2) {
+      const char *e2 = s2 + lp;
+      if (iscont(e2)) e2 = utf8_next(e2, es);
+      *match_end = e2;
+    }
+    return s2;
+  } else {
+    MatchState ms;
+    ms.L = L;
+    ms.matchdepth = MAXCCALLS;
+    ms.src_init = s;
+    ms.src_end = es;
+    ms.p_end = ep;
+    do {
+      const char *res;
+      ms.level = 0;
+      if ((res=match(&ms, init, p)) != NULL) {
+        int i;
+        for (i = 0; i < ms.level; i++) {
+          if (ms.capture[i].len == CAP_UNFINISHED)
+            luaL_error(L, "unfinished capture");
+          captures[i] = ms.capture[i].init;
+          if (capture_lens) capture_lens[i] = ms.capture[i].len;
+        }
+        *ncaptures = ms.level;
+        *match_end = res;
+        return init;
+      }
+      if (init == es) break;
+      init = utf8_next(init, es);
+    } while (init <= es && !anchor);
+  }
+  return NULL;
+}
+
+const char *utf8extra_find (lua_State *L, const char *s, const char *es,
+                            const char *init, const char *p, size_t lp,
+                            int anchor, const char **match_end,
+                            const char **captures, int *ncaptures) {
+  return find_pointers(L, s, es, init, p, lp, anchor, 0, match_end,
+                       captures, NULL, ncaptures);
+}
+
+int utf8extra_isvalid (const char *s, const char *e) {
+  while (s < e) {
+    utfint ch;
+    s = utf8_decode(s, &ch, 1);
+    if (s == NULL || utf8_invalid(ch)) return 0;
+  }
+  return 1;
+}
+
+/* like find, but init and the returned positions (including position
+ * captures) are byte offsets, so that searching is not linear in the
+ * position of init */
+static int Lutf8_find_offsets (lua_State *L) {
+  const char *es, *s = check_utf8(L, 1, &es);
+  const char *ep, *p = check_utf8(L, 2, &ep);
+  lua_Integer init = byte_relat(luaL_optinteger(L, 3, 1), es - s);
+  int plain = lua_toboolean(L, 4);
+  int anchor = !plain && *p == '^';
+  const char *start, *end, *captures[LUA_MAXCAPTURES];
+  ptrdiff_t capture_lens[LUA_MAXCAPTURES];
+  int ncaptures, i;
+  if (init < 1) init = 1;
+  if (init > es - s + 1) {
+    lua_pushnil(L);  /* cannot find anything */
+    return 1;
+  }
+  start = find_pointers(L, s, es, s + init - 1, p + anchor, ep - p - anchor,
+                        anchor, plain, &end, captures, capture_lens, &ncaptures);
+  if (start == NULL) {
+    lua_pushnil(L);  /* not found */
+    return 1;
+  }
+  luaL_checkstack(L, ncaptures + 2, "too many captures");
+  lua_pushinteger(L, start - s + 1);
+  lua_pushinteger(L, end - s);
+  for (i = 0; i < ncaptures; i++) {
+    if (capture_lens[i] == CAP_POSITION)
+      lua_pushinteger(L, captures[i] - s + 1);
+    else
+      lua_pushlstring(L, captures[i], capture_lens[i]);
+  }
+  return ncaptures + 2;
+}
+
+
 /* lua module import interface */
 
 #if LUA_VERSION_NUM >= 502
@@ -1297,6 +1408,7 @@ int luaopen_utf8extra (lua_State *L) {
     ENTRY(widthindex),
     ENTRY(ncasecmp),
     ENTRY(find),
+    ENTRY(find_offsets),
     ENTRY(gmatch),
     ENTRY(gsub),
     ENTRY(match),
@@ -33,7 +33,7 @@
 #define CMD_BUF_INIT_SIZE (1024 * 512)
 #define COMMAND_BARE_SIZE offsetof(Command, command)
 
-enum CommandType { SET_CLIP, DRAW_TEXT, DRAW_RECT };
+enum CommandType { SET_CLIP, DRAW_TEXT, DRAW_RECT, DRAW_IMAGE };
 
 typedef struct {
   enum CommandType type;
@@ -63,6 +63,12 @@ typedef struct {
   RenColor color;
 } DrawRectCommand;
 
+typedef struct {
+  RenRect rect;
+  RenRect src;
+  RenImage *image;
+} DrawImageCommand;
+
 static unsigned cells_buf1[CELLS_X * CELLS_Y];
 static unsigned cells_buf2[CELLS_X * CELLS_Y];
 static unsigned *cells_prev = cells_buf1;
@@ -193,6 +199,18 @@ void rencache_draw_rect(RenWindow *window_renderer, RenRect rect, RenColor color
   }
 }
 
+void rencache_draw_image(RenWindow *window_renderer, RenImage *image, RenRect src, RenRect rect) {
+  if (rect.width == 0 || rect.height == 0 || src.width == 0 || src.height == 0 || !rects_overlap(last_clip_rect, rect)) {
+    return;
+  }
+  DrawImageCommand *cmd = push_command(window_renderer, DRAW_IMAGE, sizeof(DrawImageCommand));
+  if (cmd) {
+    cmd->rect = rect;
+    cmd->src = src;
+    cmd->image = image;
+  }
+}
+
 double rencache_draw_text(RenWindow *window_renderer, RenFont **fonts, const char *text, size_t len, double x, int y, RenColor color, RenTab tab)
 {
   int x_offset;
@@ -275,6 +293,11 @@ void rencache_end_frame(RenWindow *window_renderer) {
     if (r.width == 0 || r.height == 0) { continue; }
     unsigned h = HASH_INITIAL;
     hash(&h, cmd, cmd->size);
+    if (cmd->type == DRAW_IMAGE) {
+      /* the image content can change while keeping the same pointer */
+      unsigned image_hash = ren_image_get_hash(((DrawImageCommand*)&cmd->command)->image);
+      hash(&h, &image_hash, sizeof(image_hash));
+    }
     update_overlapping_cells(r, h);
   }
 
@@ -315,6 +338,7 @@ void rencache_end_frame(RenWindow *window_renderer) {
       SetClipCommand *ccmd = (SetClipCommand*)&cmd->command;
       DrawRectCommand *rcmd = (DrawRectCommand*)&cmd->command;
       DrawTextCommand *tcmd = (DrawTextCommand*)&cmd->command;
+      DrawImageCommand *icmd = (DrawImageCommand*)&cmd->command;
       switch (cmd->type) {
         case SET_CLIP:
           ren_set_clip_rect(window_renderer, intersect_rects(ccmd->rect, r));
@@ -326,6 +350,9 @@ void rencache_end_frame(RenWindow *window_renderer) {
           ren_font_group_set_tab_size(tcmd->fonts, tcmd->tab_size);
           ren_draw_text(&rs, tcmd->fonts, tcmd->text, tcmd->len, tcmd->text_x, tcmd->rect.y, tcmd->color, tcmd->tab);
           break;
+        case DRAW_IMAGE:
+          ren_draw_image(&rs, icmd->image, icmd->src, icmd->rect);
+          break;
       }
     }
 
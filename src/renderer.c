@@ -119,6 +119,8 @@ typedef struct RenFont {
   int scale;
 #endif
   float size, space_advance;
+  // xadvance shared by every printable ASCII glyph, 0 if not yet known, -1 if the font is proportional
+  float monospace_advance;
   unsigned short baseline, height, tab_size;
   unsigned short underline_thickness;
   ERenFontAntialiasing antialiasing;
@@ -455,6 +457,7 @@ static int font_set_face_metrics(RenFont *font, FT_Face face) {
   if ((err = FT_Load_Char(face, ' ', (font_set_load_options(font) | FT_LOAD_BITMAP_METRICS_ONLY | FT_LOAD_NO_HINTING) & ~FT_LOAD_FORCE_AUTOHINT)) != 0)
     return err;
   font->space_advance = face->glyph->advance.x / 64.0f;
+  font->monospace_advance = 0;
   return 0;
 }
 
@@ -574,12 +577,46 @@ float font_get_xadvance(RenFont *font, unsigned int codepoint, GlyphMetric *metr
   return adv;
 }
 
+// a font is treated as monospace when every printable ASCII character has a glyph
+// with the same xadvance as the space character
+static float font_get_monospace_advance(RenFont *font) {
+  if (font->monospace_advance == 0) {
+    font->monospace_advance = font->space_advance > 0 ? font->space_advance : -1;
+    for (unsigned int codepoint = 0x21; codepoint < 0x7F && font->monospace_advance > 0; codepoint++) {
+      unsigned int glyph_id = font_get_glyph_id(font, codepoint);
+      GlyphMetric *metric = glyph_id ? font_load_glyph_metric(font, glyph_id, 0) : NULL;
+      if (!metric || metric->xadvance != font->space_advance)
+        font->monospace_advance = -1;
+    }
+  }
+  return font->monospace_advance;
+}
+
+float ren_font_group_get_monospace_width(RenFont **fonts) {
+  float advance = font_get_monospace_advance(fonts[0]);
+  if (advance < 0)
+    return 0;
+#ifdef LITE_USE_SDL_RENDERER
+  return advance / fonts[0]->scale;
+#else
+  return advance;
+#endif
+}
+
 double ren_font_group_get_width(RenFont **fonts, const char *text, size_t len, RenTab tab, int *x_offset) {
   double width = 0;
   const char* end = text + len;
+  // ASCII glyphs of a monospace font always come from the first font of the group
+  float monospace_advance = font_get_monospace_advance(fonts[0]);
 
   bool set_x_offset = x_offset == NULL;
   while (text < end) {
+    unsigned char c = *text;
+    if (monospace_advance > 0 && set_x_offset && c < 0x7F && (c >= 0x20 || (c >= 0x9 && c <= 0xD))) {
+      width += c == '\t' ? font_get_xadvance(fonts[0], c, NULL, width, tab) : monospace_advance;
+      text++;
+      continue;
+    }
     unsigned int codepoint;
     text = utf8_to_codepoint(text, end, &codepoint);
     GlyphMetric *metric = NULL;
@@ -751,6 +788,165 @@ void ren_draw_rect(RenSurface *rs, RenRect rect, RenColor color) {
   }
 }
 
+/********************* Images ************************/
+// number of rows hashed together, so that small updates to a big image
+// (e.g. a minimap) only need to rehash the bands they touched
+#define IMAGE_BAND_ROWS 64
+
+// pixels are stored as RGBA32, the content hash is computed lazily after
+// modifications so that rencache can tell whether an image changed
+struct RenImage {
+  SDL_Surface *surface;
+  unsigned *band_hash;
+  bool *band_dirty;
+  int nbands;
+  unsigned hash;
+  bool dirty;
+};
+
+static void image_invalidate_rows(RenImage *image, int y, int count) {
+  int first = SDL_max(y, 0) / IMAGE_BAND_ROWS;
+  int last = SDL_min(y + count - 1, image->surface->h - 1) / IMAGE_BAND_ROWS;
+  for (int i = first; i <= last; i++)
+    image->band_dirty[i] = true;
+  image->dirty = image->dirty || first <= last;
+}
+
+RenImage* ren_image_new(int width, int height) {
+  SDL_Surface *surface = SDL_CreateSurface(width, height, SDL_PIXELFORMAT_RGBA32);
+  if (!surface) return NULL; // error set by SDL_CreateSurface
+  SDL_SetSurfaceBlendMode(surface, SDL_BLENDMODE_BLEND);
+  SDL_FillSurfaceRect(surface, NULL, 0);
+  RenImage *image = check_alloc(SDL_calloc(1, sizeof(RenImage)));
+  image->surface = surface;
+  image->nbands = (height + IMAGE_BAND_ROWS - 1) / IMAGE_BAND_ROWS;
+  image->band_hash = check_alloc(SDL_calloc(image->nbands, sizeof(unsigned)));
+  image->band_dirty = check_alloc(SDL_calloc(image->nbands, sizeof(bool)));
+  image_invalidate_rows(image, 0, height);
+  return image;
+}
+
+void ren_image_free(RenImage *image) {
+  SDL_DestroySurface(image->surface);
+  SDL_free(image->band_hash);
+  SDL_free(image->band_dirty);
+  SDL_free(image);
+}
+
+void ren_image_get_size(RenImage *image, int *width, int *height) {
+  *width = image->surface->w;
+  *height = image->surface->h;
+}
+
+// gives direct access to the pixels, for native code producing image content.
+// Must be paired with ren_image_unlock_pixels, reporting the modified rows.
+uint32_t* ren_image_lock_pixels(RenImage *image, int *pitch) {
+  *pitch = image->surface->pitch / sizeof(uint32_t);
+  return image->surface->pixels;
+}
+
+void ren_image_unlock_pixels(RenImage *image, int y, int height) {
+  image_invalidate_rows(image, y, height);
+}
+
+static bool image_clip_rect(RenImage *image, RenRect *rect) {
+  SDL_Rect r = { rect->x, rect->y, rect->width, rect->height };
+  SDL_Rect bounds = { 0, 0, image->surface->w, image->surface->h };
+  if (!SDL_GetRectIntersection(&bounds, &r, &r)) return false;
+  *rect = (RenRect) { r.x, r.y, r.w, r.h };
+  return true;
+}
+
+void ren_image_set_pixels(RenImage *image, RenRect rect, const uint8_t *pixels, size_t pitch) {
+  RenRect clipped = rect;
+  if (!image_clip_rect(image, &clipped)) return;
+  pixels += (clipped.y - rect.y) * pitch + (clipped.x - rect.x) * 4;
+  uint8_t *dst = (uint8_t *) image->surface->pixels + clipped.y * image->surface->pitch + clipped.x * 4;
+  for (int y = 0; y < clipped.height; y++) {
+    memcpy(dst, pixels, clipped.width * 4);
+    dst += image->surface->pitch;
+    pixels += pitch;
+  }
+  image_invalidate_rows(image, clipped.y, clipped.height);
+}
+
+void ren_image_fill_rect(RenImage *image, RenRect rect, RenColor color) {
+  if (!image_clip_rect(image, &rect)) return;
+  SDL_Rect r = { rect.x, rect.y, rect.width, rect.height };
+  SDL_FillSurfaceRect(image->surface, &r, SDL_MapSurfaceRGBA(image->surface, color.r, color.g, color.b, color.a));
+  image_invalidate_rows(image, rect.y, rect.height);
+}
+
+// moves count rows from src_y to dst_y, the rows left behind keep their content
+void ren_image_move_rows(RenImage *image, int src_y, int dst_y, int count) {
+  int h = image->surface->h;
+  if (src_y < 0) { count += src_y; dst_y -= src_y; src_y = 0; }
+  if (dst_y < 0) { count += dst_y; src_y -= dst_y; dst_y = 0; }
+  count = SDL_min(count, SDL_min(h - src_y, h - dst_y));
+  if (count <= 0 || src_y == dst_y) return;
+  uint8_t *pixels = image->surface->pixels;
+  int pitch = image->surface->pitch;
+  memmove(pixels + dst_y * pitch, pixels + src_y * pitch, (size_t) count * pitch);
+  image_invalidate_rows(image, dst_y, count);
+}
+
+uint32_t ren_image_map_color(RenImage *image, RenColor color) {
+  return SDL_MapSurfaceRGBA(image->surface, color.r, color.g, color.b, color.a);
+}
+
+unsigned ren_image_get_hash(RenImage *image) {
+  if (image->dirty) {
+    // 32bit fnv-1a over the pixels of each modified band, then over all band hashes
+    unsigned h = 2166136261;
+    for (int band = 0; band < image->nbands; band++) {
+      if (image->band_dirty[band]) {
+        unsigned bh = 2166136261;
+        int y2 = SDL_min((band + 1) * IMAGE_BAND_ROWS, image->surface->h);
+        for (int y = band * IMAGE_BAND_ROWS; y < y2; y++) {
+          // rows are hashed separately to skip the pitch padding
+          const uint32_t *row = (const uint32_t *) ((uint8_t *) image->surface->pixels + y * image->surface->pitch);
+          for (int x = 0; x < image->surface->w; x++)
+            bh = (bh ^ row[x]) * 16777619;
+        }
+        image->band_hash[band] = bh;
+        image->band_dirty[band] = false;
+      }
+      h = (h ^ image->band_hash[band]) * 16777619;
+    }
+    image->hash = h;
+    image->dirty = false;
+  }
+  return image->hash;
+}
+
+void ren_draw_image(RenSurface *rs, RenImage *image, RenRect src, RenRect dst) {
+  SDL_Surface *surface = rs->surface;
+  const int surface_scale = rs->scale;
+  SDL_Rect src_rect = { src.x, src.y, src.width, src.height };
+  SDL_Rect dst_rect = { dst.x * surface_scale, dst.y * surface_scale,
+                        dst.width * surface_scale, dst.height * surface_scale };
+  if (src_rect.w <= 0 || src_rect.h <= 0 || dst_rect.w <= 0 || dst_rect.h <= 0) return;
+
+  if (src_rect.w == dst_rect.w && src_rect.h == dst_rect.h) {
+    SDL_BlitSurface(image->surface, &src_rect, surface, &dst_rect);
+    return;
+  }
+  // scaled blitting doesn't handle clipping as we expect (see ren_draw_rect),
+  // so we clip the destination manually and shrink the source accordingly
+  SDL_Rect clip, clipped;
+  SDL_GetSurfaceClipRect(surface, &clip);
+  if (!SDL_GetRectIntersection(&clip, &dst_rect, &clipped)) return;
+  double sx = (double) src_rect.w / dst_rect.w, sy = (double) src_rect.h / dst_rect.h;
+  SDL_Rect clipped_src = {
+    src_rect.x + (int) ((clipped.x - dst_rect.x) * sx),
+    src_rect.y + (int) ((clipped.y - dst_rect.y) * sy),
+    (int) ceil(clipped.w * sx),
+    (int) ceil(clipped.h * sy)
+  };
+  if (clipped_src.w <= 0 || clipped_src.h <= 0) return;
+  SDL_BlitSurfaceScaled(image->surface, &clipped_src, surface, &clipped, SDL_SCALEMODE_NEAREST);
+}
+
 /*************** Window Management ****************/
 static void ren_add_window(RenWindow *window_renderer) {
   window_count += 1;
@@ -14,6 +14,7 @@
 
 #define FONT_FALLBACK_MAX 10
 typedef struct RenFont RenFont;
+typedef struct RenImage RenImage;
 typedef enum { FONT_HINTING_NONE, FONT_HINTING_SLIGHT, FONT_HINTING_FULL } ERenFontHinting;
 typedef enum { FONT_ANTIALIASING_NONE, FONT_ANTIALIASING_GRAYSCALE, FONT_ANTIALIASING_SUBPIXEL } ERenFontAntialiasing;
 typedef enum { FONT_STYLE_BOLD = 1, FONT_STYLE_ITALIC = 2, FONT_STYLE_UNDERLINE = 4, FONT_STYLE_SMOOTH = 8, FONT_STYLE_STRIKETHROUGH = 16 } ERenFontStyle;
@@ -38,10 +39,23 @@ void update_font_scale(RenWindow *window_renderer, RenFont **fonts);
 #endif
 void ren_font_group_set_tab_size(RenFont **font, int n);
 double ren_font_group_get_width(RenFont **font, const char *text, size_t len, RenTab tab, int *x_offset);
+float ren_font_group_get_monospace_width(RenFont **font);
 double ren_draw_text(RenSurface *rs, RenFont **font, const char *text, size_t len, float x, int y, RenColor color, RenTab tab);
 
 void ren_draw_rect(RenSurface *rs, RenRect rect, RenColor color);
 
+RenImage* ren_image_new(int width, int height);
+void ren_image_free(RenImage *image);
+void ren_image_get_size(RenImage *image, int *width, int *height);
+uint32_t* ren_image_lock_pixels(RenImage *image, int *pitch);
+void ren_image_unlock_pixels(RenImage *image, int y, int height);
+void ren_image_set_pixels(RenImage *image, RenRect rect, const uint8_t *pixels, size_t pitch);
+void ren_image_fill_rect(RenImage *image, RenRect rect, RenColor color);
+void ren_image_move_rows(RenImage *image, int src_y, int dst_y, int count);
+uint32_t ren_image_map_color(RenImage *image, RenColor color);
+unsigned ren_image_get_hash(RenImage *image);
+void ren_draw_image(RenSurface *rs, RenImage *image, RenRect src, RenRect dst);
+
 int video_init(void);
 int ren_init(void);
 void ren_free(void);